@@ -7,6 +7,7 @@
 #include "settings.h"
 #include "mailbox.h"
 #include "imap-client.h"
+#include "errors.h"
 #include "checkpoint.h"
 
 #include <stdlib.h>
@@ -31,6 +32,22 @@ struct checkpoint_context {
 	bool errors:1;
 };
 
+static void ATTR_FORMAT(1, 2)
+checkpoint_error(const char *fmt, ...)
+{
+	struct error_type *type;
+	va_list va;
+
+	type = errors_add(ERROR_CLASS_CHECKPOINT, STATE_CHECKPOINT, fmt);
+	if (type == NULL)
+		return;
+
+	va_start(va, fmt);
+	error_type_log(type, t_strdup_printf("Checkpoint: %s",
+					     t_strdup_vprintf(fmt, va)));
+	va_end(va);
+}
+
 static void
 keyword_map_update(struct checkpoint_context *ctx, struct imap_client *client)
 {
@@ -51,7 +68,7 @@ keyword_map_update(struct checkpoint_context *ctx, struct imap_client *client)
 		if (j == all_count) {
 			name = kw_my[i].name->name;
 			if (!ctx->first) {
-				i_error("Checkpoint: client %u: "
+				checkpoint_error("client %u: "
 					"Missing keyword %s",
 					client->client.idx, name);
 			}
@@ -115,7 +132,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 	uids = array_get(&view->uidmap, &count);
 	if (count != ctx->count) {
 		ctx->errors = TRUE;
-		i_error("Checkpoint: client %u: "
+		checkpoint_error("client %u: "
 			"Mailbox has only %u of %u messages",
 			client->client.global_id, count, ctx->count);
 	}
@@ -124,14 +141,14 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 		/* no THREAD checking */
 	} else if (client->view->last_thread_reply == NULL) {
 		ctx->errors = TRUE;
-		i_error("Checkpoint: client %u: Missing THREAD reply",
+		checkpoint_error("client %u: Missing THREAD reply",
 			client->client.global_id);
 	} else if (ctx->thread_reply == NULL)
 		ctx->thread_reply = client->view->last_thread_reply;
 	else if (strcmp(client->view->last_thread_reply,
 			ctx->thread_reply) != 0) {
 		ctx->errors = TRUE;
-		i_error("Checkpoint: client %u: THREAD reply differs: %s != %s",
+		checkpoint_error("client %u: THREAD reply differs: %s != %s",
 			client->client.global_id, client->view->last_thread_reply,
 			ctx->thread_reply);
 	}
@@ -149,7 +166,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 			ctx->uids[i] = uids[i];
 		if (uids[i] != ctx->uids[i]) {
 			ctx->errors = TRUE;
-			i_error("Checkpoint: client %u: "
+			checkpoint_error("client %u: "
 				"Message seq=%u UID %u != %u",
 				client->client.global_id, i + 1,
 				uids[i], ctx->uids[i]);
@@ -162,7 +179,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 				ctx->messages[i].modseq = msgs[i].modseq;
 			else if (ctx->messages[i].modseq != msgs[i].modseq) {
 				ctx->errors = TRUE;
-				i_error("Checkpoint: client %u: "
+				checkpoint_error("client %u: "
 					"Message seq=%u UID=%u "
 					"modseqs differ: %s vs %s",
 					client->client.global_id, i + 1, uids[i],
@@ -195,7 +212,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 			if ((ctx->messages[i].mail_flags & MAIL_RECENT) == 0)
 				ctx->messages[i].mail_flags |= MAIL_RECENT;
 			else {
-				i_error("Checkpoint: client %u: "
+				checkpoint_error("client %u: "
 					"Message seq=%u UID=%u "
 					"has \\Recent flag in multiple sessions",
 					client->client.global_id, i + 1, uids[i]);
@@ -207,7 +224,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 		other_flags = ctx->messages[i].mail_flags & ~MAIL_RECENT;
 		if (this_flags != other_flags) {
 			ctx->errors = TRUE;
-			i_error("Checkpoint: client %u: Message seq=%u UID=%u "
+			checkpoint_error("client %u: Message seq=%u UID=%u "
 				"flags differ: (%s) vs (%s)",
 				client->client.global_id, i + 1, uids[i],
 				mail_flags_to_str(this_flags),
@@ -216,7 +233,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 		if (memcmp(keywords_remapped, ctx->messages[i].keyword_bitmask,
 			   dest_keywords_size) != 0) {
 			ctx->errors = TRUE;
-			i_error("Checkpoint: client %u: Message seq=%u UID=%u "
+			checkpoint_error("client %u: Message seq=%u UID=%u "
 				"keywords differ: (%s) vs (%s)",
 				client->client.global_id, i + 1, uids[i],
 				checkpoint_keywords_to_str(ctx, keywords_remapped),
@@ -242,7 +259,7 @@ static void checkpoint_check_missing_recent(struct checkpoint_context *ctx,
 		    (ctx->messages[i].mail_flags & MAIL_FLAGS_SET) == 0)
 			continue;
 		if ((ctx->messages[i].mail_flags & MAIL_RECENT) == 0) {
-			i_error("Checkpoint: Message seq=%u UID=%u "
+			checkpoint_error("Message seq=%u UID=%u "
 				"isn't \\Recent anywhere", i + 1, ctx->uids[i]);
 		}
 	}
@@ -356,13 +373,13 @@ void checkpoint_neg(struct mailbox_storage *storage)
 		if (!storage->seen_all_recent || storage->dont_track_recent) {
 			/* can't handle this */
 		} else if (recent_total > ctx.count) {
-			i_error("Checkpoint: Total RECENT count %u "
+			checkpoint_error("Total RECENT count %u "
 				"larger than current message count %u",
 				recent_total, ctx.count);
 			storage->dont_track_recent = TRUE;
 		} else if (total_disconnects == 0 &&
 			   recent_total != ctx.count) {
-			i_error("Checkpoint: Total RECENT count %u != %u",
+			checkpoint_error("Total RECENT count %u != %u",
 				recent_total, ctx.count);
 			storage->dont_track_recent = TRUE;
 		}
@@ -21,6 +21,10 @@
 #include "dsasl-client.h"
 #include "imap-client.h"
 #include "client-state.h"
+#include "profile.h"
+#include "stats.h"
+#include "transitions.h"
+#include "workload.h"
 
 #include <stdlib.h>
 
@@ -48,6 +52,9 @@ struct state states[] = {
 	{ "NOOP",	  "Noop", LSTATE_AUTH,     0,   0,  FLAG_EXPUNGES },
 	{ "IDLE",	  "Idle", LSTATE_AUTH,     0,   0,  FLAG_EXPUNGES },
 	{ "CHECK",	  "Chec", LSTATE_AUTH,     0,   0,  FLAG_EXPUNGES },
+	{ "ENABLE",	  "Enab", LSTATE_AUTH,     0,   0,  0 },
+	{ "NOTIFY",	  "Noti", LSTATE_AUTH,     0,   0,  FLAG_EXPUNGES },
+	{ "LIST-STATUS",  "LSta", LSTATE_AUTH,     0,   0,  FLAG_EXPUNGES },
 	{ "LOGOUT",	  "Logo", LSTATE_NONAUTH,  100, 0,  FLAG_STATECHANGE | FLAG_STATECHANGE_NONAUTH },
 	{ "DISCONNECT",	  "Disc", LSTATE_NONAUTH,  0,   0,  0 },
 	{ "DELAY",	  "Dela", LSTATE_NONAUTH,  0,   0,  0 },
@@ -60,6 +67,20 @@ unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
 unsigned int timer_counts[STATE_COUNT];
 unsigned long long timers[STATE_COUNT];
 
+bool state_find(const char *name, enum client_state *state_r)
+{
+	unsigned int i;
+
+	for (i = 0; i < STATE_COUNT; i++) {
+		if (strcasecmp(states[i].name, name) == 0 ||
+		    strcasecmp(states[i].short_name, name) == 0) {
+			*state_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 bool do_rand(enum client_state state)
 {
 	return (i_rand_limit(100)) < states[state].probability;
@@ -70,16 +91,28 @@ bool do_rand_again(enum client_state state)
 	return (i_rand_limit(100)) < states[state].probability_again;
 }
 
-void client_state_add_to_timer(enum client_state state,
+void client_state_add_to_timer(struct client *client, enum client_state state,
 			       const struct timeval *tv_start)
 {
 	struct timeval tv_end;
-	long long diff;
+	long long diff, usecs;
 
 	i_gettimeofday(&tv_end);
-	diff = timeval_diff_msecs(&tv_end, tv_start);
-	if (diff < 0)
-		diff = 0;
+	usecs = timeval_diff_usecs(&tv_end, tv_start);
+	if (usecs < 0)
+		usecs = 0;
+	stats_add_latency(state, usecs);
+	if (client != NULL)
+		client_pipeline_command_finished(client, state, usecs);
+	if (client != NULL && client->user_client != NULL &&
+	    client->user_client->profile != NULL) {
+		stats_add_group_latency(client->user_client->profile->stats_group,
+					state, usecs);
+		stats_add_group_latency(client->user->profile->stats_group,
+					state, usecs);
+	}
+
+	diff = usecs / 1000;
 	i_assert((unsigned long long)diff < ULLONG_MAX - timers[state]);
 	timers[state] += diff;
 	timer_counts[state]++;
@@ -128,14 +161,17 @@ static void auth_sasl_callback(struct imap_client *client, struct command *cmd,
 	};
 
 	o_stream_nsendv(_client->output, vec, 2);
+	command_add_sent_bytes(client, str->used + 2);
 }
 
 static enum client_state client_eat_first_plan(struct imap_client *client)
 {
 	enum client_state state;
 
-	if (disconnect_clients)
+	if (disconnect_clients || client->client.idx >= conf.clients_count) {
+		/* stopping, or the client count was lowered */
 		return STATE_LOGOUT;
+	}
 
 	i_assert(client->plan_size > 0);
 	state = client->plan[0];
@@ -171,6 +207,31 @@ static enum client_state client_get_next_state(enum client_state state)
 	return state;
 }
 
+static enum client_state
+client_get_next_transition(struct imap_client *client, enum client_state from)
+{
+	bool allowed[STATE_COUNT];
+	enum client_state state;
+	unsigned int i;
+
+	for (i = 0; i < STATE_COUNT; i++)
+		allowed[i] = states[i].login_state <= client->client.login_state;
+	allowed[STATE_AUTHENTICATE] = allowed[STATE_LOGIN] = FALSE;
+	if (client->uid_fetch_performed)
+		allowed[STATE_UIDFETCH] = FALSE;
+	if (conf.copy_dest == NULL)
+		allowed[STATE_COPY] = FALSE;
+
+	if (transitions_pick(conf.transitions, from, allowed, &state))
+		return state;
+
+	/* no usable transitions from this state */
+	do {
+		state = client_get_next_state(from);
+	} while (state == STATE_UIDFETCH && client->uid_fetch_performed);
+	return state;
+}
+
 static enum login_state flags2login_state(enum state_flags flags)
 {
 	if ((flags & FLAG_STATECHANGE_NONAUTH) != 0)
@@ -205,7 +266,7 @@ client_get_pending_cmd_flags(struct imap_client *client,
 
 static enum client_state client_update_plan(struct imap_client *client)
 {
-	enum client_state state;
+	enum client_state state, prev_state;
 	enum login_state lstate;
 
 	state = client->plan_size > 0 ?
@@ -223,6 +284,7 @@ static enum client_state client_update_plan(struct imap_client *client)
 	if (state == STATE_LOGOUT)
 		return state;
 
+	prev_state = state;
 	while (client->plan_size <
 	       sizeof(client->plan)/sizeof(client->plan[0])) {
 		switch (client->client.login_state) {
@@ -236,7 +298,10 @@ static enum client_state client_update_plan(struct imap_client *client)
 			break;
 		case LSTATE_AUTH:
 		case LSTATE_SELECTED:
-			if (!do_rand_again(state)) {
+			if (conf.transitions != NULL) {
+				state = client_get_next_transition(client,
+								   prev_state);
+			} else if (!do_rand_again(state)) {
 				do {
 					state = client_get_next_state(state);
 				} while (state == STATE_UIDFETCH &&
@@ -254,6 +319,7 @@ static enum client_state client_update_plan(struct imap_client *client)
 		}
 
 		client->plan[client->plan_size++] = state;
+		prev_state = state;
 		if ((states[state].flags & FLAG_STATECHANGE) != 0)
 			break;
 	}
@@ -294,14 +360,13 @@ int imap_client_plan_send_more_commands(struct client *_client)
 	enum login_state new_lstate;
 	enum client_state state;
 
-	while (array_count(&client->commands) < MAX_COMMAND_QUEUE_LEN) {
+	while (array_count(&client->commands) <
+	       client_get_pipeline_depth(_client)) {
 		state = client_update_plan(client);
 		i_assert(state <= STATE_LOGOUT);
 
 		if (client->append_unfinished)
 			break;
-		if (conf.no_pipelining && array_count(&client->commands) > 0)
-			break;
 
 		if ((states[state].flags & FLAG_STATECHANGE) != 0) {
 			/* this command would change the state. check if there
@@ -345,9 +410,15 @@ int imap_client_plan_send_more_commands(struct client *_client)
 
 int imap_client_append_continue(struct imap_client *client)
 {
+	enum ostream_send_istream_result res;
+	uoff_t offset;
+
 	i_assert(client->append_stream != NULL);
 
-	switch (o_stream_send_istream(client->client.output, client->append_stream)) {
+	offset = client->append_stream->v_offset;
+	res = o_stream_send_istream(client->client.output, client->append_stream);
+	command_add_sent_bytes(client, client->append_stream->v_offset - offset);
+	switch (res) {
 	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
 		break;
 	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
@@ -382,6 +453,7 @@ int imap_client_append_continue(struct imap_client *client)
 	client->append_unfinished = FALSE;
 	client->append_can_send = FALSE;
 	o_stream_nsend_str(client->client.output, "\r\n");
+	command_add_sent_bytes(client, 2);
 	return 0;
 }
 
@@ -419,6 +491,7 @@ int imap_client_append(struct imap_client *client, const char *args, bool add_da
 		/* continues the last APPEND call */
 		str_append(cmd, "\r\n");
 		o_stream_nsend_str(client->client.output, str_c(cmd));
+		command_add_sent_bytes(client, str_len(cmd));
 	} else {
 		client->client.state = STATE_APPEND;
 		*cmd_r = command_send(client, str_c(cmd), callback);
@@ -795,7 +868,7 @@ static int client_handle_cmd_reply(struct imap_client *client, struct command *c
 				   enum command_reply reply)
 {
 	const char *str, *line;
-	unsigned int i;
+	unsigned int i, idx;
 
 	line = imap_args_to_str(args);
 	switch (reply) {
@@ -900,10 +973,10 @@ static int client_handle_cmd_reply(struct imap_client *client, struct command *c
 		if (profile_running)
 			break;
 		for (i = 0; i < 3 && !stalled && !no_new_clients; i++) {
-			if (array_count(&clients) >= conf.clients_count)
+			if (!clients_get_free_idx(&idx))
 				break;
 
-			client_new_random(array_count(&clients),
+			client_new_random(idx,
 					  client->client.user->mailbox_source);
 		}
 		break;
@@ -1136,8 +1209,11 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 	string_t *cmd;
 	const char *str;
 	enum client_random_flag_type flag_type;
+	const struct workload_template *tmpl;
 	ARRAY_TYPE(seq_range) seq_range = ARRAY_INIT;
+	enum login_state old_login_state = _client->login_state;
 	unsigned int i, j, seq1, seq2, count, msgs, owner;
+	unsigned int old_tag_counter = client->tag_counter;
 
 	state = client_eat_first_plan(client);
 
@@ -1242,7 +1318,10 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 			"From", "To", "Cc", "Subject", "References",
 			"In-Reply-To", "Message-ID",
 		};
-		count = I_MIN(msgs, 100);
+		tmpl = conf.workload == NULL ? NULL :
+			workload_pick(conf.workload, WORKLOAD_COMMAND_FETCH);
+		count = tmpl == NULL ? I_MIN(msgs, 100) :
+			workload_template_get_msg_count(tmpl, msgs);
 		if (!imap_client_get_random_seq_range(client, &seq_range, count,
 						      CLIENT_RANDOM_FLAG_TYPE_FETCH))
 			break;
@@ -1258,7 +1337,9 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 			str_append(cmd, "UID ");
 		if (conf.checkpoint_interval > 0)
 			str_append(cmd, "FLAGS ");
-		for (i = (i_rand_limit(4)) + 1; i > 0; i--) {
+		if (tmpl != NULL)
+			str_append(cmd, tmpl->args);
+		else for (i = (i_rand_limit(4)) + 1; i > 0; i--) {
 			if ((i_rand_limit(4)) != 0) {
 				str_append(cmd,
 					   fields[i_rand_limit(N_ELEMENTS(fields))]);
@@ -1294,6 +1375,13 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 		break;
 	}
 	case STATE_SEARCH:
+		tmpl = conf.workload == NULL ? NULL :
+			workload_pick(conf.workload, WORKLOAD_COMMAND_SEARCH);
+		if (tmpl != NULL) {
+			command_send(client, t_strconcat("SEARCH ", tmpl->args,
+							 NULL), state_callback);
+			break;
+		}
 		search_command_send(client);
 		break;
 	case STATE_SORT: {
@@ -1344,10 +1432,19 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 		command_send(client, str, state_callback);
 		break;
 	case STATE_STORE:
-		count = i_rand_limit(msgs < 10 ? msgs : I_MIN(msgs / 5, 50));
-		flag_type = conf.checkpoint_interval == 0 && i_rand_limit(2) == 0 ?
-			CLIENT_RANDOM_FLAG_TYPE_STORE_SILENT :
-			CLIENT_RANDOM_FLAG_TYPE_STORE;
+		tmpl = conf.workload == NULL ? NULL :
+			workload_pick(conf.workload, WORKLOAD_COMMAND_STORE);
+		if (tmpl != NULL) {
+			count = workload_template_get_msg_count(tmpl, msgs);
+			flag_type = tmpl->store_silent ?
+				CLIENT_RANDOM_FLAG_TYPE_STORE_SILENT :
+				CLIENT_RANDOM_FLAG_TYPE_STORE;
+		} else {
+			count = i_rand_limit(msgs < 10 ? msgs : I_MIN(msgs / 5, 50));
+			flag_type = conf.checkpoint_interval == 0 && i_rand_limit(2) == 0 ?
+				CLIENT_RANDOM_FLAG_TYPE_STORE_SILENT :
+				CLIENT_RANDOM_FLAG_TYPE_STORE;
+		}
 		if (!imap_client_get_random_seq_range(client, &seq_range, count,
 						      flag_type))
 			break;
@@ -1356,6 +1453,12 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 		str_append(cmd, "STORE ");
 		seq_range_to_imap_range(&seq_range, cmd);
 		str_append_c(cmd, ' ');
+		if (tmpl != NULL) {
+			str_append(cmd, tmpl->args);
+			icmd = command_send(client, str_c(cmd), state_callback);
+			icmd->seq_range = seq_range;
+			break;
+		}
 		switch (i_rand_limit(3)) {
 		case 0:
 			str_append_c(cmd, '+');
@@ -1460,6 +1563,9 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 		break;
 
 	case STATE_BANNER:
+	case STATE_ENABLE:
+	case STATE_NOTIFY:
+	case STATE_LIST_STATUS:
 	case STATE_DISCONNECT:
 	case STATE_DELAY:
 	case STATE_CHECKPOINT:
@@ -1467,6 +1573,18 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 	case STATE_COUNT:
 		i_unreached();
 	}
+
+	if (client->tag_counter != old_tag_counter) {
+		/* count only the transitions whose command was sent. the
+		   planned command may have been skipped, e.g. SELECT when
+		   already selected. */
+		if (conf.transitions != NULL &&
+		    old_login_state != LSTATE_NONAUTH) {
+			transitions_count(conf.transitions,
+					  client->transition_prev_state, state);
+		}
+		client->transition_prev_state = state;
+	}
 	return 0;
 }
 
@@ -40,6 +40,10 @@ enum client_state {
         STATE_NOOP,
         STATE_IDLE,
         STATE_CHECK,
+	/* ENABLE, NOTIFY and LIST-STATUS are used only by profile clients */
+	STATE_ENABLE,
+	STATE_NOTIFY,
+	STATE_LIST_STATUS,
         STATE_LOGOUT,
         STATE_DISCONNECT,
         STATE_DELAY,
@@ -83,9 +87,12 @@ extern unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
 extern unsigned int timer_counts[STATE_COUNT];
 extern unsigned long long timers[STATE_COUNT];
 
+/* Find a state by its name or short name, case-insensitively. */
+bool state_find(const char *name, enum client_state *state_r);
 bool do_rand(enum client_state state);
 bool do_rand_again(enum client_state state);
-void client_state_add_to_timer(enum client_state state,
+/* Add a finished command's latency. client is NULL for LMTP deliveries. */
+void client_state_add_to_timer(struct client *client, enum client_state state,
 			       const struct timeval *tv_start);
 
 int imap_client_append(struct imap_client *client, const char *args, bool add_datetime,
@@ -5,9 +5,9 @@
 #include "array.h"
 #include "istream.h"
 #include "ostream.h"
-#include "iostream-rawlog.h"
 #include "iostream-ssl.h"
 #include "str.h"
+#include "time-util.h"
 #include "imap-parser.h"
 
 #include "imap-client.h"
@@ -15,18 +15,25 @@
 #include "imap-util.h"
 #include "settings.h"
 #include "mailbox.h"
+#include "mailbox-source.h"
 #include "mailbox-state.h"
 #include "commands.h"
 #include "checkpoint.h"
 #include "profile.h"
+#include "rawlog.h"
 #include "search.h"
 #include "test-exec.h"
+#include "stats.h"
 #include "client.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+/* pipeline_depth=adaptive shrinks the window when a command's latency is
+   more than this many times the connection's lowest latency */
+#define PIPELINE_ADAPTIVE_LATENCY_FACTOR 2
+
 int clients_count = 0;
 unsigned int total_disconnects = 0;
 ARRAY_TYPE(client) clients;
@@ -157,12 +164,7 @@ static void client_wait_connect(struct client *client)
 			i_fatal("Couldn't create SSL iostream: %s", error);
 		(void)ssl_iostream_handshake(client->ssl_iostream);
 	}
-	if (conf.rawlog) {
-		if (iostream_rawlog_create_path(
-				t_strdup_printf("rawlog.%u", client->global_id),
-				&client->input, &client->output) != 0)
-			client->rawlog_fd = o_stream_get_fd(client->output);
-	}
+	rawlog_client_init(client);
 
 	client->io = io_add_istream(client->input, client_input, client);
 	client->v.connected(client);
@@ -183,20 +185,29 @@ client_new_full(unsigned int i, struct user *user, struct user_client *uc)
 		i_unreached();
 }
 
+bool clients_get_free_idx(unsigned int *idx_r)
+{
+	while (client_min_free_idx < conf.clients_count) {
+		if (client_min_free_idx >= array_count(&clients) ||
+		    array_idx_elem(&clients, client_min_free_idx) == NULL) {
+			*idx_r = client_min_free_idx;
+			return TRUE;
+		}
+		client_min_free_idx++;
+	}
+	return FALSE;
+}
+
 struct client *client_new_user(struct user *user)
 {
-	struct client *const *clientp;
 	struct user_client *uc;
+	unsigned int idx;
 
 	if (!user_get_new_client_profile(user, &uc))
 		return NULL;
-	while (client_min_free_idx < conf.clients_count) {
-		clientp = array_idx_get_space(&clients, client_min_free_idx);
-		if (*clientp == NULL)
-			return client_new_full(client_min_free_idx, user, uc);
-		client_min_free_idx++;
-	}
-	return NULL;
+	if (!clients_get_free_idx(&idx))
+		return NULL;
+	return client_new_full(idx, user, uc);
 }
 
 struct client *client_new_random(unsigned int i, struct mailbox_source *source)
@@ -241,15 +252,22 @@ int client_init(struct client *client, unsigned int idx,
 	client->global_id = ++global_id_counter;
 
 	client->fd = fd;
-	client->rawlog_fd = -1;
 	client->input = i_stream_create_fd(fd, (size_t)-1);
 	client->output = o_stream_create_fd(fd, (size_t)-1);
 	i_stream_set_name(client->input, t_strdup_printf("client %u", idx));
 	o_stream_set_name(client->output, t_strdup_printf("client %u", idx));
 	o_stream_set_no_error_handling(client->output, TRUE);
+	if (conf.no_tracking) {
+		/* free the stream buffers whenever they become empty, so
+		   mostly idle connections stay small */
+		i_stream_set_persistent_buffers(client->input, FALSE);
+		o_stream_set_persistent_buffers(client->output, FALSE);
+	}
 	o_stream_set_flush_callback(client->output, client_output, client);
 	client->io = io_add(fd, IO_WRITE, client_wait_connect, client);
         client->last_io = ioloop_time;
+	client->pipeline_window = 1;
+	client->pipeline_ssthresh = conf.pipeline_depth;
 
 	clients_count++;
 	user_add_client(user, client);
@@ -257,12 +275,71 @@ int client_init(struct client *client, unsigned int idx,
 	return 0;
 }
 
+unsigned int client_get_pipeline_depth(struct client *client)
+{
+	if (conf.no_pipelining)
+		return 1;
+	if (!conf.pipeline_adaptive)
+		return conf.pipeline_depth;
+	return (unsigned int)client->pipeline_window;
+}
+
+void client_pipeline_set_depth(struct client *client, unsigned int depth)
+{
+	if (client->pipeline_depth > 0) {
+		stats_add_pipeline_time(client->pipeline_depth,
+			timeval_diff_usecs(&ioloop_timeval,
+					   &client->pipeline_depth_start));
+	}
+	client->pipeline_depth = depth;
+	client->pipeline_depth_start = ioloop_timeval;
+}
+
+void client_pipeline_command_finished(struct client *client,
+				      enum client_state state,
+				      unsigned long long usecs)
+{
+	unsigned long long *min_usecs;
+
+	stats_add_pipeline_command(client->pipeline_depth);
+	if (!conf.pipeline_adaptive)
+		return;
+
+	if (client->pipeline_min_usecs == NULL) {
+		client->pipeline_min_usecs =
+			i_new(unsigned long long, STATE_COUNT);
+	}
+	min_usecs = &client->pipeline_min_usecs[state];
+	if (*min_usecs == 0 || usecs < *min_usecs)
+		*min_usecs = I_MAX(usecs, 1);
+	if (client->pipeline_decrease_wait > 0)
+		client->pipeline_decrease_wait--;
+
+	/* compare only against the same kind of commands */
+	if (usecs <= *min_usecs * PIPELINE_ADAPTIVE_LATENCY_FACTOR) {
+		/* the server keeps up: slow start, then grow by one command
+		   per window's worth of finished commands */
+		if (client->pipeline_window < client->pipeline_ssthresh)
+			client->pipeline_window += 1;
+		else
+			client->pipeline_window += 1 / client->pipeline_window;
+		if (client->pipeline_window > conf.pipeline_depth)
+			client->pipeline_window = conf.pipeline_depth;
+	} else if (client->pipeline_decrease_wait == 0) {
+		/* commands are queueing up: halve the window, but only once
+		   for the commands that were already in flight */
+		client->pipeline_window = I_MAX(client->pipeline_window / 2, 1);
+		client->pipeline_ssthresh = client->pipeline_window;
+		client->pipeline_decrease_wait = client->pipeline_depth;
+	}
+}
+
 void client_logout(struct client *client)
 {
 	client->state = STATE_LOGOUT;
 	client->logout_sent = TRUE;
 	if (client->user_client != NULL)
-		client->user_client->last_logout = ioloop_time;
+		client->user_client->last_logout = user_time_now();
 	client->v.logout(client);
 }
 
@@ -300,6 +377,9 @@ bool client_unref(struct client *client, bool reconnect)
 		return TRUE;
 
 	total_disconnects++;
+	if (client->protocol == CLIENT_PROTOCOL_IMAP)
+		stats_add_connection_bytes(client->bytes_sent,
+					   client->bytes_received);
 
 	if (--clients_count == 0)
 		stalled = FALSE;
@@ -311,6 +391,7 @@ bool client_unref(struct client *client, bool reconnect)
 
 	o_stream_destroy(&client->output);
 	i_stream_destroy(&client->input);
+	rawlog_client_deinit(client);
 	if (client->ssl_iostream != NULL)
 		ssl_iostream_destroy(&client->ssl_iostream);
 	if (client->io != NULL)
@@ -324,7 +405,8 @@ bool client_unref(struct client *client, bool reconnect)
 	if (disconnect_clients && !imaptest_has_clients())
 		io_loop_stop(current_ioloop);
 	else if (io_loop_is_running(current_ioloop) && !no_new_clients &&
-		 !disconnect_clients && reconnect) {
+		 !disconnect_clients && reconnect &&
+		 idx < conf.clients_count) {
 		if (client->logout_sent) {
 			/* user successfully logged out, get another
 			   random user */
@@ -343,6 +425,7 @@ bool client_unref(struct client *client, bool reconnect)
 				 client->user_client->profile == NULL))
 			clients_unstalled(source);
 	}
+	i_free(client->pipeline_min_usecs);
 	i_free(client);
 	return FALSE;
 }
@@ -357,6 +440,22 @@ int client_send_more_commands(struct client *client)
 	return ret;
 }
 
+void clients_set_count(unsigned int count)
+{
+	unsigned int i, idx;
+
+	conf.clients_count = count;
+	/* the clients above the count log out after their current command.
+	   more clients are created after each successful login, so start
+	   only the first ones here. */
+	for (i = 0; i < INIT_CLIENT_COUNT; i++) {
+		if (!clients_get_free_idx(&idx))
+			break;
+		if (client_new_random(idx, mailbox_source) == NULL)
+			break;
+	}
+}
+
 unsigned int clients_get_random_idx(void)
 {
 	struct client *const *c;
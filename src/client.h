@@ -32,21 +32,40 @@ struct client {
         unsigned int idx, global_id;
         unsigned int cur;
 
-	int fd, rawlog_fd;
+	int fd;
+	/* NULL if the connection isn't logged */
+	struct rawlog_client *rawlog;
 	struct istream *input;
 	struct ostream *output;
 	struct ssl_iostream *ssl_iostream;
 	struct io *io;
 	struct timeout *to;
+	/* IMAP protocol bytes, not including the TLS overhead */
+	uoff_t bytes_sent, bytes_received;
 
 	enum login_state login_state;
 	enum client_state state;
         time_t last_io;
 
+	/* pipeline_depth=adaptive window and its slow start threshold */
+	double pipeline_window, pipeline_ssthresh;
+	/* the lowest latency seen in this connection for each state, since
+	   e.g. FETCH2 is always much slower than NOOP. Allocated only with
+	   pipeline_depth=adaptive. */
+	unsigned long long *pipeline_min_usecs;
+	/* don't shrink the window again until this many commands finish */
+	unsigned int pipeline_decrease_wait;
+	/* number of commands in flight and since when */
+	unsigned int pipeline_depth;
+	struct timeval pipeline_depth_start;
+
 	bool delayed:1;
 	bool disconnected:1;
 	bool logout_sent:1;
 	bool idling:1;
+	/* waiting for the server's notifications or for the next poll
+	   without any commands running */
+	bool sync_waiting:1;
 };
 ARRAY_DEFINE_TYPE(client, struct client *);
 
@@ -68,7 +87,21 @@ void client_input_continue(struct client *client);
 void client_delay(struct client *client, unsigned int msecs);
 int client_send_more_commands(struct client *client);
 
+/* Returns how many commands the client may have in flight. */
+unsigned int client_get_pipeline_depth(struct client *client);
+/* The number of commands in flight changed. */
+void client_pipeline_set_depth(struct client *client, unsigned int depth);
+/* A command finished with the given latency. Called before the depth is
+   updated for the finished command. */
+void client_pipeline_command_finished(struct client *client,
+				      enum client_state state,
+				      unsigned long long usecs);
+
 unsigned int clients_get_random_idx(void);
+/* Returns the first unused client index below conf.clients_count. */
+bool clients_get_free_idx(unsigned int *idx_r);
+/* Change conf.clients_count while running. */
+void clients_set_count(unsigned int count);
 
 bool imaptest_has_clients(void);
 
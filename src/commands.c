@@ -8,6 +8,7 @@
 #include "time-util.h"
 #include "imap-parser.h"
 #include "mailbox.h"
+#include "stats.h"
 #include "imap-client.h"
 #include "commands.h"
 
@@ -146,9 +147,11 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 
 	i_assert(!client->append_unfinished);
 
+	client->client.sync_waiting = FALSE;
 	if (client->client.idling && !client->idle_done_sent) {
 		client->idle_done_sent = TRUE;
 		o_stream_nsend_str(client->client.output, "DONE\r\n");
+		command_add_sent_bytes(client, 6);
 	}
 
 	cmd = i_new(struct command, 1);
@@ -209,16 +212,31 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 	iov[2].iov_len = 2;
 	o_stream_nsendv(client->client.output, iov, 3);
 	i_gettimeofday(&cmd->tv_start);
+	cmd->bytes_sent = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+	client->client.bytes_sent += cmd->bytes_sent;
+	stats_add_transfer(cmd->bytes_sent, 0);
 
 	if (client->delay_timeout_ms > 0)
 		cmd->delay_to = timeout_add(client->delay_timeout_ms,
 					    command_delay_timeout, client);
 
 	array_append(&client->commands, &cmd, 1);
+	client_pipeline_set_depth(&client->client,
+				  array_count(&client->commands));
 	client->last_cmd = cmd;
 	return cmd;
 }
 
+void command_add_sent_bytes(struct imap_client *client, uoff_t bytes)
+{
+	client->client.bytes_sent += bytes;
+	stats_add_transfer(bytes, 0);
+	if (client->last_cmd != NULL)
+		client->last_cmd->bytes_sent += bytes;
+	else
+		stats_add_other_bytes(bytes, 0);
+}
+
 void command_unlink(struct imap_client *client, struct command *cmd)
 {
 	struct command *const *cmds;
@@ -233,7 +251,15 @@ void command_unlink(struct imap_client *client, struct command *cmd)
 	}
 	i_assert(i < count);
 
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	client_state_add_to_timer(&client->client, cmd->state, &cmd->tv_start);
+	if (cmd->tv_first_byte.tv_sec != 0) {
+		stats_add_ttfb(cmd->state,
+			timeval_diff_usecs(&cmd->tv_first_byte, &cmd->tv_start));
+	}
+	stats_add_command_bytes(cmd->state, cmd->bytes_sent,
+				cmd->bytes_received);
+	client_pipeline_set_depth(&client->client,
+				  array_count(&client->commands));
 	if (client->last_cmd == cmd)
 		client->last_cmd = NULL;
 }
@@ -26,7 +26,13 @@ struct command {
 
 	command_callback_t *callback;
 	struct timeval tv_start;
+	/* when the first reply bytes counted for this command arrived,
+	   tv_sec=0 if none yet */
+	struct timeval tv_first_byte;
 	struct timeout *delay_to;
+	/* including the literals, and for received bytes the untagged
+	   replies that arrived while this was the oldest running command */
+	uoff_t bytes_sent, bytes_received;
 
 	bool expect_bad:1;
 };
@@ -38,6 +44,9 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 		    unsigned int cmdline_len,
 		    command_callback_t *callback);
 
+/* Count bytes sent for the last command outside command_send(), e.g. the
+   APPEND literal. */
+void command_add_sent_bytes(struct imap_client *client, uoff_t bytes);
 void command_unlink(struct imap_client *client, struct command *cmd);
 void command_free(struct command *cmd);
 
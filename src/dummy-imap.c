@@ -0,0 +1,1854 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "base64.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "ostream.h"
+#include "ioloop.h"
+#include "sort.h"
+#include "seq-range-array.h"
+#include "imap-date.h"
+#include "imap-match.h"
+#include "imap-quote.h"
+#include "imap-seqset.h"
+#include "imap-util.h"
+
+#include "dummy-server.h"
+
+/* Literals are stored separately and replaced with this character in the
+   command line. */
+#define DUMMY_IMAP_LITERAL_CHAR '\001'
+#define DUMMY_IMAP_HIERARCHY_SEP '/'
+
+#define DUMMY_IMAP_CAPABILITY \
+	"IMAP4rev1 LITERAL+ SASL-IR AUTH=PLAIN IDLE UIDPLUS MULTIAPPEND " \
+	"ENABLE UNSELECT ID NAMESPACE CHILDREN SORT THREAD=REFERENCES " \
+	"LIST-STATUS"
+
+struct dummy_imap_conn {
+	struct dummy_conn conn;
+
+	/* command currently being read */
+	string_t *cmd;
+	ARRAY(struct dummy_mail_body *) literals;
+	uoff_t literal_size;
+	char *cont_tag;
+
+	struct dummy_mailbox *box;
+	/* UIDs of the messages currently visible to the client */
+	ARRAY(uint32_t) uids;
+	uint32_t seen_uidnext;
+	uint64_t seen_modseq;
+	unsigned int seen_expunge_counter;
+
+	bool literal_pending:1;
+	bool authenticating:1;
+	bool authenticated:1;
+	bool idling:1;
+	bool box_readonly:1;
+	bool logged_out:1;
+};
+
+enum dummy_imap_arg_type {
+	DUMMY_IMAP_ARG_EOL = 0,
+	DUMMY_IMAP_ARG_ATOM,
+	DUMMY_IMAP_ARG_STRING,
+	DUMMY_IMAP_ARG_LITERAL,
+	DUMMY_IMAP_ARG_LIST
+};
+
+struct dummy_imap_arg {
+	enum dummy_imap_arg_type type;
+	/* atom, string or the list's contents without the parenthesis */
+	const char *str;
+	struct dummy_mail_body *literal;
+};
+
+struct dummy_imap_args {
+	struct dummy_imap_conn *conn;
+	const char *p;
+	unsigned int literal_idx;
+};
+
+struct dummy_imap_cmd {
+	struct dummy_imap_conn *conn;
+	const char *tag, *name;
+	struct dummy_imap_args args;
+
+	bool uid:1;
+	/* EXPUNGEs can't be sent as a reply to this command */
+	bool no_expunges:1;
+};
+
+enum dummy_imap_cmd_flags {
+	DUMMY_IMAP_CMD_FLAG_AUTH	= 0x01,
+	DUMMY_IMAP_CMD_FLAG_SELECTED	= 0x02 | DUMMY_IMAP_CMD_FLAG_AUTH,
+	DUMMY_IMAP_CMD_FLAG_UID		= 0x04,
+	DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES	= 0x08
+};
+
+struct dummy_imap_command {
+	const char *name;
+	enum dummy_imap_cmd_flags flags;
+	void (*func)(struct dummy_imap_cmd *cmd);
+};
+
+enum dummy_fetch_type {
+	DUMMY_FETCH_UID,
+	DUMMY_FETCH_FLAGS,
+	DUMMY_FETCH_SIZE,
+	DUMMY_FETCH_INTERNALDATE,
+	DUMMY_FETCH_ENVELOPE,
+	DUMMY_FETCH_BODY,
+	DUMMY_FETCH_BODYSTRUCTURE,
+	DUMMY_FETCH_MODSEQ,
+	DUMMY_FETCH_SECTION
+};
+
+enum dummy_fetch_section {
+	DUMMY_FETCH_SECTION_FULL,
+	DUMMY_FETCH_SECTION_HEADER,
+	DUMMY_FETCH_SECTION_HEADER_FIELDS,
+	DUMMY_FETCH_SECTION_HEADER_FIELDS_NOT,
+	DUMMY_FETCH_SECTION_TEXT,
+	DUMMY_FETCH_SECTION_EMPTY
+};
+
+struct dummy_fetch_item {
+	enum dummy_fetch_type type;
+	enum dummy_fetch_section section;
+	/* name used in the reply for sections */
+	const char *label;
+	const char *const *fields;
+	uoff_t partial_offset, partial_size;
+
+	bool peek:1;
+	bool partial:1;
+};
+ARRAY_DEFINE_TYPE(dummy_fetch_item, struct dummy_fetch_item);
+
+static const char *const dummy_imap_system_flags[] = {
+	"\\Answered", "\\Flagged", "\\Deleted", "\\Seen", "\\Draft"
+};
+
+static void dummy_imap_send(struct dummy_imap_conn *conn, const char *line)
+{
+	struct const_iovec iov[2];
+
+	iov[0].iov_base = line;
+	iov[0].iov_len = strlen(line);
+	iov[1].iov_base = "\r\n";
+	iov[1].iov_len = 2;
+	o_stream_nsendv(conn->conn.output, iov, N_ELEMENTS(iov));
+}
+
+static void
+dummy_imap_write_flags(string_t *str, struct dummy_mailbox *box,
+		       const struct dummy_mail *mail)
+{
+	str_append(str, "FLAGS (");
+	imap_write_flags(str, mail->flags,
+			 dummy_mailbox_keywords_get_names(box, mail->keywords));
+	str_append_c(str, ')');
+}
+
+/*
+ * Mailbox view synchronization
+ */
+
+static void dummy_imap_sync(struct dummy_imap_conn *conn, bool allow_expunges)
+{
+	struct dummy_mailbox *box = conn->box;
+	const struct dummy_mail *mails, *mail;
+	const uint32_t *uids;
+	unsigned int i, count, old_count;
+	string_t *str;
+
+	if (box == NULL)
+		return;
+
+	if (allow_expunges &&
+	    conn->seen_expunge_counter != box->expunge_counter) {
+		/* send EXPUNGEs from the highest sequence, so the lower
+		   sequences stay valid */
+		uids = array_get(&conn->uids, &count);
+		for (i = count; i > 0; i--) {
+			if (dummy_mailbox_lookup_uid(box, uids[i-1]) != NULL)
+				continue;
+			dummy_imap_send(conn, t_strdup_printf(
+				"* %u EXPUNGE", i));
+			array_delete(&conn->uids, i-1, 1);
+			uids = array_get(&conn->uids, &count);
+		}
+		conn->seen_expunge_counter = box->expunge_counter;
+	}
+
+	old_count = array_count(&conn->uids);
+	if (conn->seen_uidnext != box->uidnext) {
+		mails = array_get(&box->mails, &count);
+		for (i = count; i > 0; i--) {
+			if (mails[i-1].uid < conn->seen_uidnext)
+				break;
+		}
+		for (; i < count; i++)
+			array_push_back(&conn->uids, &mails[i].uid);
+		conn->seen_uidnext = box->uidnext;
+		if (array_count(&conn->uids) != old_count) {
+			dummy_imap_send(conn, t_strdup_printf("* %u EXISTS",
+				array_count(&conn->uids)));
+			dummy_imap_send(conn, "* 0 RECENT");
+		}
+	}
+
+	if (conn->seen_modseq != box->highest_modseq) {
+		/* flag changes made by other connections */
+		str = t_str_new(128);
+		uids = array_get(&conn->uids, &count);
+		for (i = 0; i < old_count; i++) {
+			mail = dummy_mailbox_lookup_uid(box, uids[i]);
+			if (mail == NULL || mail->modseq <= conn->seen_modseq)
+				continue;
+			str_truncate(str, 0);
+			str_printfa(str, "* %u FETCH (UID %u ", i+1, mail->uid);
+			dummy_imap_write_flags(str, box, mail);
+			str_append_c(str, ')');
+			dummy_imap_send(conn, str_c(str));
+		}
+		conn->seen_modseq = box->highest_modseq;
+	}
+}
+
+void dummy_imap_mailbox_changed(struct dummy_imap_conn *conn)
+{
+	if (!conn->idling)
+		return;
+
+	o_stream_cork(conn->conn.output);
+	T_BEGIN {
+		dummy_imap_sync(conn, TRUE);
+	} T_END;
+	o_stream_uncork(conn->conn.output);
+}
+
+static void dummy_imap_notify_changes(struct dummy_imap_cmd *cmd,
+				      struct dummy_mailbox *box)
+{
+	dummy_mailbox_changed(box);
+	if (box == cmd->conn->box)
+		dummy_imap_sync(cmd->conn, !cmd->no_expunges);
+}
+
+static void dummy_imap_unselect(struct dummy_imap_conn *conn)
+{
+	struct dummy_imap_conn *const *conns;
+	unsigned int i, count;
+
+	if (conn->box == NULL)
+		return;
+
+	conns = array_get(&conn->box->imap_conns, &count);
+	for (i = 0; i < count; i++) {
+		if (conns[i] == conn) {
+			array_delete(&conn->box->imap_conns, i, 1);
+			break;
+		}
+	}
+	array_clear(&conn->uids);
+	conn->box = NULL;
+}
+
+/*
+ * Argument parsing
+ */
+
+static const char *dummy_imap_skip_list(const char *p)
+{
+	unsigned int depth = 0;
+
+	for (; *p != '\0'; p++) {
+		switch (*p) {
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0)
+				return p;
+			break;
+		case '"':
+			for (p++; *p != '"' && *p != '\0'; p++) {
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			}
+			if (*p == '\0')
+				return p;
+			break;
+		}
+	}
+	return p;
+}
+
+static void
+dummy_imap_args_init(struct dummy_imap_args *args,
+		     struct dummy_imap_conn *conn, const char *str)
+{
+	i_zero(args);
+	args->conn = conn;
+	args->p = str;
+}
+
+static void
+dummy_imap_args_next(struct dummy_imap_args *args, struct dummy_imap_arg *arg_r)
+{
+	const char *p = args->p, *start;
+	string_t *str;
+
+	i_zero(arg_r);
+	while (*p == ' ')
+		p++;
+
+	switch (*p) {
+	case '\0':
+		arg_r->type = DUMMY_IMAP_ARG_EOL;
+		break;
+	case '"':
+		str = t_str_new(64);
+		for (p++; *p != '"' && *p != '\0'; p++) {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			str_append_c(str, *p);
+		}
+		if (*p == '"')
+			p++;
+		arg_r->type = DUMMY_IMAP_ARG_STRING;
+		arg_r->str = str_c(str);
+		break;
+	case DUMMY_IMAP_LITERAL_CHAR:
+		p++;
+		if (args->conn == NULL ||
+		    args->literal_idx >= array_count(&args->conn->literals)) {
+			arg_r->type = DUMMY_IMAP_ARG_EOL;
+			break;
+		}
+		arg_r->type = DUMMY_IMAP_ARG_LITERAL;
+		arg_r->literal = array_idx_elem(&args->conn->literals,
+						args->literal_idx++);
+		break;
+	case '(':
+		start = p + 1;
+		p = dummy_imap_skip_list(p);
+		arg_r->type = DUMMY_IMAP_ARG_LIST;
+		arg_r->str = t_strdup_until(start, p);
+		if (*p == ')')
+			p++;
+		break;
+	default:
+		start = p;
+		while (*p != ' ' && *p != '\0' && *p != '(' && *p != ')') {
+			if (*p == '[') {
+				/* BODY[HEADER.FIELDS (From To)] */
+				while (*p != ']' && *p != '\0')
+					p++;
+				if (*p == '\0')
+					break;
+			}
+			p++;
+		}
+		arg_r->type = DUMMY_IMAP_ARG_ATOM;
+		arg_r->str = t_strdup_until(start, p);
+		break;
+	}
+	args->p = p;
+}
+
+static bool
+dummy_imap_args_next_astring(struct dummy_imap_args *args, const char **str_r)
+{
+	struct dummy_imap_arg arg;
+
+	dummy_imap_args_next(args, &arg);
+	switch (arg.type) {
+	case DUMMY_IMAP_ARG_ATOM:
+	case DUMMY_IMAP_ARG_STRING:
+		*str_r = arg.str;
+		return TRUE;
+	case DUMMY_IMAP_ARG_LITERAL:
+		*str_r = t_strndup(arg.literal->data, arg.literal->size);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static bool
+dummy_imap_args_next_atom(struct dummy_imap_args *args, const char **str_r)
+{
+	struct dummy_imap_arg arg;
+
+	dummy_imap_args_next(args, &arg);
+	if (arg.type != DUMMY_IMAP_ARG_ATOM)
+		return FALSE;
+	*str_r = arg.str;
+	return TRUE;
+}
+
+static void
+dummy_imap_parse_flags(struct dummy_mailbox *box, const char *str,
+		       enum mail_flags *flags_r, uint32_t *keywords_r)
+{
+	const char *const *names;
+	unsigned int i;
+
+	*flags_r = 0;
+	*keywords_r = 0;
+	for (names = t_strsplit_spaces(str, " "); *names != NULL; names++) {
+		if (**names != '\\') {
+			*keywords_r |= dummy_mailbox_keyword_get(box, *names);
+			continue;
+		}
+		for (i = 0; i < N_ELEMENTS(dummy_imap_system_flags); i++) {
+			if (strcasecmp(*names, dummy_imap_system_flags[i]) == 0) {
+				*flags_r |= 1 << i;
+				break;
+			}
+		}
+	}
+}
+
+static void dummy_imap_cmd_reply(struct dummy_imap_cmd *cmd, const char *reply)
+{
+	dummy_imap_sync(cmd->conn, !cmd->no_expunges);
+	dummy_imap_send(cmd->conn, t_strconcat(cmd->tag, " ", reply, NULL));
+}
+
+static void dummy_imap_cmd_bad(struct dummy_imap_cmd *cmd, const char *reason)
+{
+	dummy_imap_send(cmd->conn, t_strconcat(cmd->tag, " BAD ", reason, NULL));
+}
+
+/* Returns the messages (as sequences) matching the given message set.
+   UIDs that aren't visible are silently ignored. */
+static bool
+dummy_imap_cmd_get_seqs(struct dummy_imap_cmd *cmd, const char *set,
+			ARRAY_TYPE(seq_range) *seqs)
+{
+	ARRAY_TYPE(seq_range) ranges;
+	const struct seq_range *range;
+	const uint32_t *uids;
+	uint32_t seq1, seq2, max;
+	unsigned int idx1, idx2, count;
+
+	t_array_init(&ranges, 8);
+	if (imap_seq_set_parse(set, &ranges) < 0)
+		return FALSE;
+
+	uids = array_get(&cmd->conn->uids, &count);
+	max = !cmd->uid ? count : (count == 0 ? 0 : uids[count-1]);
+	array_foreach(&ranges, range) {
+		seq1 = range->seq1 == (uint32_t)-1 ? max : range->seq1;
+		seq2 = range->seq2 == (uint32_t)-1 ? max : range->seq2;
+		if (seq1 > seq2) {
+			uint32_t tmp = seq1;
+			seq1 = seq2; seq2 = tmp;
+		}
+		if (!cmd->uid) {
+			if (seq1 == 0 || seq2 > count)
+				return FALSE;
+			seq_range_array_add_range(seqs, seq1, seq2);
+			continue;
+		}
+		/* find the first UID >= seq1 and the last UID <= seq2 */
+		(void)array_bsearch_insert_pos(&cmd->conn->uids, &seq1,
+					       uint32_cmp, &idx1);
+		if (!array_bsearch_insert_pos(&cmd->conn->uids, &seq2,
+					      uint32_cmp, &idx2)) {
+			if (idx2 == 0)
+				continue;
+			idx2--;
+		}
+		if (idx1 <= idx2 && idx1 < count)
+			seq_range_array_add_range(seqs, idx1 + 1, idx2 + 1);
+	}
+	return TRUE;
+}
+
+static struct dummy_mail *
+dummy_imap_seq_lookup(struct dummy_imap_conn *conn, uint32_t seq)
+{
+	return dummy_mailbox_lookup_uid(conn->box,
+		array_idx_elem(&conn->uids, seq - 1));
+}
+
+/*
+ * Commands
+ */
+
+static void cmd_capability(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_send(cmd->conn, "* CAPABILITY "DUMMY_IMAP_CAPABILITY);
+	dummy_imap_cmd_reply(cmd, "OK Capability completed.");
+}
+
+static void cmd_noop(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_cmd_reply(cmd, t_strdup_printf("OK %s completed.",
+						   cmd->name));
+}
+
+static void cmd_id(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_send(cmd->conn, "* ID (\"name\" \"imaptest-dummy-server\")");
+	dummy_imap_cmd_reply(cmd, "OK ID completed.");
+}
+
+static void cmd_namespace(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_send(cmd->conn, "* NAMESPACE ((\"\" \"/\")) NIL NIL");
+	dummy_imap_cmd_reply(cmd, "OK Namespace completed.");
+}
+
+static void cmd_enable(struct dummy_imap_cmd *cmd)
+{
+	/* none of the extensions are supported */
+	dummy_imap_send(cmd->conn, "* ENABLED");
+	dummy_imap_cmd_reply(cmd, "OK Enabled.");
+}
+
+static void cmd_logout(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_send(cmd->conn, "* BYE Logging out");
+	dummy_imap_cmd_reply(cmd, "OK Logout completed.");
+	cmd->conn->logged_out = TRUE;
+}
+
+static void
+dummy_imap_login(struct dummy_imap_cmd *cmd, const char *username)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+
+	dummy_conn_set_user(&conn->conn, username);
+	conn->authenticated = TRUE;
+	dummy_imap_cmd_reply(cmd, "OK [CAPABILITY "DUMMY_IMAP_CAPABILITY"] "
+			     "Logged in");
+}
+
+static void cmd_login(struct dummy_imap_cmd *cmd)
+{
+	const char *username, *password;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &username) ||
+	    !dummy_imap_args_next_astring(&cmd->args, &password)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	/* any password is accepted */
+	dummy_imap_login(cmd, username);
+}
+
+static bool
+dummy_imap_sasl_plain(const char *response, const char **username_r)
+{
+	const buffer_t *buf;
+	const char *authzid, *authcid, *p, *end;
+
+	buf = t_base64_decode(0, response, strlen(response));
+	p = buf->data;
+	end = p + buf->used;
+
+	authzid = t_strndup(p, end - p);
+	p += strlen(authzid) + 1;
+	if (p >= end)
+		return FALSE;
+	authcid = t_strndup(p, end - p);
+	*username_r = *authzid != '\0' ? authzid : authcid;
+	return **username_r != '\0';
+}
+
+static void cmd_authenticate(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	const char *mech, *ir, *username;
+
+	if (!dummy_imap_args_next_atom(&cmd->args, &mech)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	if (strcasecmp(mech, "PLAIN") != 0) {
+		dummy_imap_cmd_reply(cmd, "NO Unsupported mechanism.");
+		return;
+	}
+	if (!dummy_imap_args_next_atom(&cmd->args, &ir)) {
+		/* wait for the response */
+		i_free(conn->cont_tag);
+		conn->cont_tag = i_strdup(cmd->tag);
+		conn->authenticating = TRUE;
+		dummy_imap_send(conn, "+ ");
+		return;
+	}
+	if (!dummy_imap_sasl_plain(ir, &username))
+		dummy_imap_cmd_reply(cmd, "NO Authentication failed.");
+	else
+		dummy_imap_login(cmd, username);
+}
+
+static void cmd_idle(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+
+	dummy_imap_sync(conn, TRUE);
+	i_free(conn->cont_tag);
+	conn->cont_tag = i_strdup(cmd->tag);
+	conn->idling = TRUE;
+	dummy_imap_send(conn, "+ idling");
+}
+
+static void cmd_create(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_user *user = cmd->conn->conn.user;
+	const char *name;
+	size_t len;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	len = strlen(name);
+	if (len > 0 && name[len-1] == DUMMY_IMAP_HIERARCHY_SEP)
+		name = t_strndup(name, len-1);
+	if (*name == '\0')
+		dummy_imap_cmd_reply(cmd, "NO Invalid mailbox name.");
+	else if (dummy_mailbox_find(user, name) != NULL)
+		dummy_imap_cmd_reply(cmd, "NO [ALREADYEXISTS] Mailbox already exists.");
+	else {
+		(void)dummy_mailbox_create(user, name);
+		dummy_imap_cmd_reply(cmd, "OK Create completed.");
+	}
+}
+
+static void cmd_delete(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box;
+	const char *name;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	box = dummy_mailbox_find(cmd->conn->conn.user, name);
+	if (box == NULL)
+		dummy_imap_cmd_reply(cmd, "NO [NONEXISTENT] Mailbox doesn't exist.");
+	else if (strcmp(box->name, "INBOX") == 0)
+		dummy_imap_cmd_reply(cmd, "NO INBOX can't be deleted.");
+	else if (array_count(&box->imap_conns) > 0)
+		dummy_imap_cmd_reply(cmd, "NO [INUSE] Mailbox is selected.");
+	else {
+		dummy_mailbox_delete(box);
+		dummy_imap_cmd_reply(cmd, "OK Delete completed.");
+	}
+}
+
+static void cmd_rename(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_user *user = cmd->conn->conn.user;
+	struct dummy_mailbox *box;
+	const char *name, *newname;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name) ||
+	    !dummy_imap_args_next_astring(&cmd->args, &newname)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	box = dummy_mailbox_find(user, name);
+	if (box == NULL)
+		dummy_imap_cmd_reply(cmd, "NO [NONEXISTENT] Mailbox doesn't exist.");
+	else if (strcmp(box->name, "INBOX") == 0)
+		dummy_imap_cmd_reply(cmd, "NO INBOX can't be renamed.");
+	else if (dummy_mailbox_find(user, newname) != NULL)
+		dummy_imap_cmd_reply(cmd, "NO [ALREADYEXISTS] Mailbox already exists.");
+	else {
+		i_free(box->name);
+		box->name = i_strdup(newname);
+		dummy_imap_cmd_reply(cmd, "OK Rename completed.");
+	}
+}
+
+static void cmd_subscribe(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box;
+	const char *name;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	/* subscriptions to nonexistent mailboxes are silently forgotten */
+	box = dummy_mailbox_find(cmd->conn->conn.user, name);
+	if (box != NULL)
+		box->subscribed = strcasecmp(cmd->name, "SUBSCRIBE") == 0;
+	dummy_imap_cmd_reply(cmd, t_strdup_printf("OK %s completed.",
+						   cmd->name));
+}
+
+static bool
+dummy_mailbox_has_children(struct dummy_mailbox *box)
+{
+	struct dummy_mailbox *child;
+	size_t len = strlen(box->name);
+
+	array_foreach_elem(&box->user->mailboxes, child) {
+		if (strncmp(child->name, box->name, len) == 0 &&
+		    child->name[len] == DUMMY_IMAP_HIERARCHY_SEP)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static const char *
+dummy_imap_status_line(struct dummy_mailbox *box, const char *items_str)
+{
+	const struct dummy_mail *mail;
+	const char *const *items;
+	unsigned int unseen = 0;
+	uoff_t size = 0;
+	string_t *str;
+
+	array_foreach(&box->mails, mail) {
+		if ((mail->flags & MAIL_SEEN) == 0)
+			unseen++;
+		size += mail->body->size;
+	}
+
+	str = t_str_new(128);
+	str_append(str, "* STATUS ");
+	imap_append_astring(str, box->name);
+	str_append(str, " (");
+	for (items = t_strsplit_spaces(items_str, " "); *items != NULL; items++) {
+		const char *item = t_str_ucase(*items);
+
+		if (strcmp(item, "MESSAGES") == 0)
+			str_printfa(str, "MESSAGES %u ", array_count(&box->mails));
+		else if (strcmp(item, "RECENT") == 0)
+			str_append(str, "RECENT 0 ");
+		else if (strcmp(item, "UIDNEXT") == 0)
+			str_printfa(str, "UIDNEXT %u ", box->uidnext);
+		else if (strcmp(item, "UIDVALIDITY") == 0)
+			str_printfa(str, "UIDVALIDITY %u ", box->uidvalidity);
+		else if (strcmp(item, "UNSEEN") == 0)
+			str_printfa(str, "UNSEEN %u ", unseen);
+		else if (strcmp(item, "HIGHESTMODSEQ") == 0) {
+			str_printfa(str, "HIGHESTMODSEQ %"PRIu64" ",
+				    box->highest_modseq);
+		} else if (strcmp(item, "SIZE") == 0)
+			str_printfa(str, "SIZE %"PRIuUOFF_T" ", size);
+	}
+	if (str_c(str)[str_len(str)-1] == ' ')
+		str_truncate(str, str_len(str)-1);
+	str_append_c(str, ')');
+	return str_c(str);
+}
+
+/* Parse LIST RETURN (STATUS (items)) options. Returns FALSE if they're
+   invalid. status_items_r is set to NULL if STATUS isn't requested. */
+static bool
+dummy_imap_list_return_status(struct dummy_imap_cmd *cmd,
+			      const char **status_items_r)
+{
+	struct dummy_imap_args args;
+	struct dummy_imap_arg arg;
+	const char *name;
+
+	*status_items_r = NULL;
+	if (!dummy_imap_args_next_atom(&cmd->args, &name))
+		return TRUE;
+	if (strcasecmp(name, "RETURN") != 0)
+		return FALSE;
+	dummy_imap_args_next(&cmd->args, &arg);
+	if (arg.type != DUMMY_IMAP_ARG_LIST)
+		return FALSE;
+
+	dummy_imap_args_init(&args, NULL, arg.str);
+	while (dummy_imap_args_next_atom(&args, &name)) {
+		if (strcasecmp(name, "STATUS") == 0) {
+			dummy_imap_args_next(&args, &arg);
+			if (arg.type != DUMMY_IMAP_ARG_LIST)
+				return FALSE;
+			*status_items_r = arg.str;
+		}
+	}
+	return TRUE;
+}
+
+static void cmd_list(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box;
+	struct imap_match_glob *glob;
+	const char *ref, *pattern, *status_items;
+	bool lsub = strcasecmp(cmd->name, "LSUB") == 0;
+	string_t *str;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &ref) ||
+	    !dummy_imap_args_next_astring(&cmd->args, &pattern) ||
+	    !dummy_imap_list_return_status(cmd, &status_items)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	if (*pattern == '\0') {
+		dummy_imap_send(cmd->conn, "* LIST (\\Noselect) \"/\" \"\"");
+		dummy_imap_cmd_reply(cmd, "OK List completed.");
+		return;
+	}
+
+	glob = imap_match_init(pool_datastack_create(),
+			       t_strconcat(ref, pattern, NULL),
+			       TRUE, DUMMY_IMAP_HIERARCHY_SEP);
+	str = t_str_new(128);
+	array_foreach_elem(&cmd->conn->conn.user->mailboxes, box) {
+		if (lsub && !box->subscribed)
+			continue;
+		if (imap_match(glob, box->name) != IMAP_MATCH_YES)
+			continue;
+
+		str_truncate(str, 0);
+		str_printfa(str, "* %s (%s) \"/\" ", lsub ? "LSUB" : "LIST",
+			    dummy_mailbox_has_children(box) ?
+			    "\\HasChildren" : "\\HasNoChildren");
+		imap_append_astring(str, box->name);
+		dummy_imap_send(cmd->conn, str_c(str));
+		if (status_items != NULL && !lsub) {
+			dummy_imap_send(cmd->conn,
+				dummy_imap_status_line(box, status_items));
+		}
+	}
+	dummy_imap_cmd_reply(cmd, t_strdup_printf("OK %s completed.",
+						   cmd->name));
+}
+
+static void cmd_status(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box;
+	struct dummy_imap_arg arg;
+	const char *name;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	dummy_imap_args_next(&cmd->args, &arg);
+	if (arg.type != DUMMY_IMAP_ARG_LIST) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	box = dummy_mailbox_find(cmd->conn->conn.user, name);
+	if (box == NULL) {
+		dummy_imap_cmd_reply(cmd, "NO [NONEXISTENT] Mailbox doesn't exist.");
+		return;
+	}
+	dummy_imap_send(cmd->conn, dummy_imap_status_line(box, arg.str));
+	dummy_imap_cmd_reply(cmd, "OK Status completed.");
+}
+
+static void cmd_select(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	struct dummy_mailbox *box;
+	const char *name;
+	char *const *all_keywords;
+	unsigned int i, count;
+	string_t *str;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	dummy_imap_unselect(conn);
+	box = dummy_mailbox_find(conn->conn.user, name);
+	if (box == NULL) {
+		dummy_imap_cmd_reply(cmd, "NO [NONEXISTENT] Mailbox doesn't exist.");
+		return;
+	}
+
+	conn->box = box;
+	conn->box_readonly = strcasecmp(cmd->name, "EXAMINE") == 0;
+	conn->seen_uidnext = 1;
+	conn->seen_modseq = box->highest_modseq;
+	conn->seen_expunge_counter = box->expunge_counter;
+	array_push_back(&box->imap_conns, &conn);
+
+	str = t_str_new(256);
+	str_append(str, "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft");
+	all_keywords = array_get(&box->keywords, &count);
+	for (i = 0; i < count; i++)
+		str_printfa(str, " %s", all_keywords[i]);
+	str_append_c(str, ')');
+	dummy_imap_send(conn, str_c(str));
+	dummy_imap_send(conn, "* OK [PERMANENTFLAGS (\\Answered \\Flagged "
+			"\\Deleted \\Seen \\Draft \\*)] Flags permitted.");
+
+	/* this sends EXISTS and RECENT */
+	dummy_imap_sync(conn, TRUE);
+	if (array_count(&conn->uids) == 0) {
+		dummy_imap_send(conn, "* 0 EXISTS");
+		dummy_imap_send(conn, "* 0 RECENT");
+	}
+	dummy_imap_send(conn, t_strdup_printf(
+		"* OK [UIDVALIDITY %u] UIDs valid", box->uidvalidity));
+	dummy_imap_send(conn, t_strdup_printf(
+		"* OK [UIDNEXT %u] Predicted next UID", box->uidnext));
+	dummy_imap_cmd_reply(cmd, conn->box_readonly ?
+			     "OK [READ-ONLY] Examine completed." :
+			     "OK [READ-WRITE] Select completed.");
+}
+
+static bool
+dummy_imap_expunge_deleted(struct dummy_mailbox *box,
+			   const ARRAY_TYPE(seq_range) *uidset)
+{
+	const struct dummy_mail *mails;
+	unsigned int i, count;
+	bool changed = FALSE;
+
+	mails = array_get(&box->mails, &count);
+	for (i = count; i > 0; i--) {
+		if ((mails[i-1].flags & MAIL_DELETED) == 0)
+			continue;
+		if (uidset != NULL && !seq_range_exists(uidset, mails[i-1].uid))
+			continue;
+		dummy_mailbox_expunge_uid(box, mails[i-1].uid);
+		mails = array_get(&box->mails, &count);
+		changed = TRUE;
+	}
+	return changed;
+}
+
+static void cmd_expunge(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box = cmd->conn->box;
+	ARRAY_TYPE(seq_range) uidset;
+	const char *set;
+
+	t_array_init(&uidset, 8);
+	if (cmd->uid &&
+	    (!dummy_imap_args_next_atom(&cmd->args, &set) ||
+	     imap_seq_set_parse(set, &uidset) < 0)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	if (!cmd->conn->box_readonly &&
+	    dummy_imap_expunge_deleted(box, cmd->uid ? &uidset : NULL))
+		dummy_imap_notify_changes(cmd, box);
+	dummy_imap_cmd_reply(cmd, "OK Expunge completed.");
+}
+
+static void cmd_close(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	struct dummy_mailbox *box = conn->box;
+	bool expunge;
+
+	/* CLOSE expunges silently */
+	expunge = strcmp(cmd->name, "CLOSE") == 0 && !conn->box_readonly;
+	dummy_imap_unselect(conn);
+	if (expunge && dummy_imap_expunge_deleted(box, NULL))
+		dummy_mailbox_changed(box);
+	dummy_imap_cmd_reply(cmd, t_strdup_printf("OK %s completed.",
+						   cmd->name));
+}
+
+static void cmd_check(struct dummy_imap_cmd *cmd)
+{
+	dummy_imap_cmd_reply(cmd, "OK Check completed.");
+}
+
+static void cmd_append(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_mailbox *box;
+	struct dummy_imap_arg arg;
+	struct dummy_mail *mail;
+	ARRAY_TYPE(seq_range) uids;
+	enum mail_flags flags;
+	uint32_t keywords;
+	const char *name;
+	time_t received;
+	int tz;
+	string_t *str;
+
+	if (!dummy_imap_args_next_astring(&cmd->args, &name)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	box = dummy_mailbox_find(cmd->conn->conn.user, name);
+
+	t_array_init(&uids, 4);
+	dummy_imap_args_next(&cmd->args, &arg);
+	while (arg.type != DUMMY_IMAP_ARG_EOL) {
+		flags = 0; keywords = 0;
+		received = ioloop_time;
+
+		if (arg.type == DUMMY_IMAP_ARG_LIST) {
+			if (box != NULL) {
+				dummy_imap_parse_flags(box, arg.str,
+						       &flags, &keywords);
+			}
+			dummy_imap_args_next(&cmd->args, &arg);
+		}
+		if (arg.type == DUMMY_IMAP_ARG_STRING) {
+			if (!imap_parse_datetime(arg.str, &received, &tz)) {
+				dummy_imap_cmd_bad(cmd, "Invalid date-time.");
+				return;
+			}
+			dummy_imap_args_next(&cmd->args, &arg);
+		}
+		if (arg.type != DUMMY_IMAP_ARG_LITERAL) {
+			dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+			return;
+		}
+		if (box != NULL) {
+			mail = dummy_mailbox_add(box, arg.literal, flags,
+						 keywords, received);
+			seq_range_array_add(&uids, mail->uid);
+		}
+		dummy_imap_args_next(&cmd->args, &arg);
+	}
+
+	if (box == NULL) {
+		dummy_imap_cmd_reply(cmd, "NO [TRYCREATE] Mailbox doesn't exist.");
+		return;
+	}
+	if (array_count(&uids) == 0) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	dummy_imap_notify_changes(cmd, box);
+
+	str = t_str_new(64);
+	str_printfa(str, "OK [APPENDUID %u ", box->uidvalidity);
+	imap_write_seq_range(str, &uids);
+	str_append(str, "] Append completed.");
+	dummy_imap_cmd_reply(cmd, str_c(str));
+}
+
+static void cmd_copy(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	struct dummy_mailbox *dest;
+	struct dummy_mail *mail, *new_mail;
+	ARRAY_TYPE(seq_range) seqs, src_uids, dest_uids;
+	struct seq_range_iter iter;
+	const char *set, *name, *const *keywords;
+	uint32_t seq, dest_keywords;
+	unsigned int n = 0;
+	string_t *str;
+
+	t_array_init(&seqs, 8);
+	if (!dummy_imap_args_next_atom(&cmd->args, &set) ||
+	    !dummy_imap_args_next_astring(&cmd->args, &name) ||
+	    !dummy_imap_cmd_get_seqs(cmd, set, &seqs)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	dest = dummy_mailbox_find(conn->conn.user, name);
+	if (dest == NULL) {
+		dummy_imap_cmd_reply(cmd, "NO [TRYCREATE] Mailbox doesn't exist.");
+		return;
+	}
+
+	t_array_init(&src_uids, 8);
+	t_array_init(&dest_uids, 8);
+	seq_range_array_iter_init(&iter, &seqs);
+	while (seq_range_array_iter_nth(&iter, n++, &seq)) {
+		mail = dummy_imap_seq_lookup(conn, seq);
+		if (mail == NULL)
+			continue;
+
+		dest_keywords = 0;
+		keywords = dummy_mailbox_keywords_get_names(conn->box,
+							    mail->keywords);
+		for (; keywords != NULL && *keywords != NULL; keywords++) {
+			dest_keywords |=
+				dummy_mailbox_keyword_get(dest, *keywords);
+		}
+		/* mail may point to dest->mails, which can be reallocated */
+		seq_range_array_add(&src_uids, mail->uid);
+		new_mail = dummy_mailbox_add(dest, mail->body, mail->flags,
+					     dest_keywords, mail->received);
+		seq_range_array_add(&dest_uids, new_mail->uid);
+	}
+	if (array_count(&dest_uids) == 0) {
+		dummy_imap_cmd_reply(cmd, "OK No messages copied.");
+		return;
+	}
+	dummy_imap_notify_changes(cmd, dest);
+
+	str = t_str_new(64);
+	str_printfa(str, "OK [COPYUID %u ", dest->uidvalidity);
+	imap_write_seq_range(str, &src_uids);
+	str_append_c(str, ' ');
+	imap_write_seq_range(str, &dest_uids);
+	str_append(str, "] Copy completed.");
+	dummy_imap_cmd_reply(cmd, str_c(str));
+}
+
+static void cmd_store(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	struct dummy_mailbox *box = conn->box;
+	struct dummy_mail *mail;
+	struct dummy_imap_arg arg;
+	ARRAY_TYPE(seq_range) seqs;
+	struct seq_range_iter iter;
+	enum mail_flags flags, new_flags;
+	uint32_t seq, keywords, new_keywords;
+	unsigned int n = 0;
+	const char *set, *type;
+	char modify;
+	bool silent, changed = FALSE;
+	string_t *str;
+
+	t_array_init(&seqs, 8);
+	if (!dummy_imap_args_next_atom(&cmd->args, &set) ||
+	    !dummy_imap_cmd_get_seqs(cmd, set, &seqs)) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	dummy_imap_args_next(&cmd->args, &arg);
+	if (arg.type == DUMMY_IMAP_ARG_LIST) {
+		/* (UNCHANGEDSINCE ..) */
+		dummy_imap_args_next(&cmd->args, &arg);
+	}
+	if (arg.type != DUMMY_IMAP_ARG_ATOM) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	type = t_str_ucase(arg.str);
+	modify = type[0] == '+' || type[0] == '-' ? *type++ : '\0';
+	silent = strcmp(type, "FLAGS.SILENT") == 0;
+	if (!silent && strcmp(type, "FLAGS") != 0) {
+		dummy_imap_cmd_bad(cmd, "Invalid arguments.");
+		return;
+	}
+	/* the flags can be either a list or atoms until the end of line */
+	dummy_imap_args_next(&cmd->args, &arg);
+	dummy_imap_parse_flags(box, arg.type == DUMMY_IMAP_ARG_LIST ? arg.str :
+			       t_strconcat(arg.str, cmd->args.p, NULL),
+			       &flags, &keywords);
+	if (conn->box_readonly) {
+		dummy_imap_cmd_reply(cmd, "NO Mailbox is read-only.");
+		return;
+	}
+
+	/* let the client first see changes made by others, so our own
+	   changes don't need to be sent twice */
+	dummy_imap_sync(conn, !cmd->no_expunges);
+
+	str = t_str_new(128);
+	seq_range_array_iter_init(&iter, &seqs);
+	while (seq_range_array_iter_nth(&iter, n++, &seq)) {
+		mail = dummy_imap_seq_lookup(conn, seq);
+		if (mail == NULL)
+			continue;
+
+		switch (modify) {
+		case '+':
+			new_flags = mail->flags | flags;
+			new_keywords = mail->keywords | keywords;
+			break;
+		case '-':
+			new_flags = mail->flags & ~flags;
+			new_keywords = mail->keywords & ~keywords;
+			break;
+		default:
+			new_flags = flags;
+			new_keywords = keywords;
+			break;
+		}
+		if (new_flags != mail->flags || new_keywords != mail->keywords) {
+			dummy_mailbox_update_flags(box, mail, new_flags,
+						   new_keywords);
+			changed = TRUE;
+		}
+		if (silent)
+			continue;
+
+		str_truncate(str, 0);
+		str_printfa(str, "* %u FETCH (", seq);
+		if (cmd->uid)
+			str_printfa(str, "UID %u ", mail->uid);
+		dummy_imap_write_flags(str, box, mail);
+		str_append_c(str, ')');
+		dummy_imap_send(conn, str_c(str));
+	}
+	if (changed) {
+		conn->seen_modseq = box->highest_modseq;
+		dummy_mailbox_changed(box);
+	}
+	dummy_imap_cmd_reply(cmd, "OK Store completed.");
+}
+
+static void
+dummy_imap_cmd_send_seqs(struct dummy_imap_cmd *cmd, const char *prefix,
+			 const ARRAY_TYPE(seq_range) *seqs)
+{
+	struct seq_range_iter iter;
+	unsigned int n = 0;
+	uint32_t seq;
+	string_t *str;
+
+	str = t_str_new(256);
+	str_append(str, prefix);
+	seq_range_array_iter_init(&iter, seqs);
+	while (seq_range_array_iter_nth(&iter, n++, &seq)) {
+		if (cmd->uid)
+			seq = array_idx_elem(&cmd->conn->uids, seq - 1);
+		str_printfa(str, " %u", seq);
+	}
+	dummy_imap_send(cmd->conn, str_c(str));
+}
+
+static void cmd_search(struct dummy_imap_cmd *cmd)
+{
+	ARRAY_TYPE(seq_range) seqs;
+	unsigned int count = array_count(&cmd->conn->uids);
+
+	/* The search keys aren't evaluated. All messages always match. */
+	t_array_init(&seqs, 1);
+	if (count > 0)
+		seq_range_array_add_range(&seqs, 1, count);
+
+	if (strcasecmp(cmd->name, "THREAD") == 0) {
+		string_t *str = t_str_new(256);
+		unsigned int i;
+
+		str_append(str, "* THREAD ");
+		for (i = 0; i < count; i++) {
+			str_printfa(str, "(%u)", !cmd->uid ? i + 1 :
+				    array_idx_elem(&cmd->conn->uids, i));
+		}
+		dummy_imap_send(cmd->conn, str_c(str));
+	} else {
+		dummy_imap_cmd_send_seqs(cmd, strcasecmp(cmd->name, "SORT") == 0 ?
+					 "* SORT" : "* SEARCH", &seqs);
+	}
+	dummy_imap_cmd_reply(cmd, t_strdup_printf("OK %s completed.",
+						   cmd->name));
+}
+
+/*
+ * FETCH
+ */
+
+static bool
+dummy_fetch_parse_section(const char *section, struct dummy_fetch_item *item)
+{
+	const char *p;
+
+	if (*section == '\0')
+		item->section = DUMMY_FETCH_SECTION_FULL;
+	else if (strncasecmp(section, "HEADER.FIELDS", 13) == 0) {
+		item->section = strncasecmp(section + 13, ".NOT", 4) == 0 ?
+			DUMMY_FETCH_SECTION_HEADER_FIELDS_NOT :
+			DUMMY_FETCH_SECTION_HEADER_FIELDS;
+		p = strchr(section, '(');
+		if (p == NULL)
+			return FALSE;
+		item->fields = t_strsplit_spaces(t_strcut(p + 1, ')'), " ");
+	} else if (strcasecmp(section, "HEADER") == 0 ||
+		   strcasecmp(section, "MIME") == 0 ||
+		   strcasecmp(section, "1.MIME") == 0)
+		item->section = DUMMY_FETCH_SECTION_HEADER;
+	else if (strcasecmp(section, "TEXT") == 0 ||
+		 strcmp(section, "1") == 0)
+		item->section = DUMMY_FETCH_SECTION_TEXT;
+	else
+		item->section = DUMMY_FETCH_SECTION_EMPTY;
+	return TRUE;
+}
+
+static bool
+dummy_fetch_parse_item(const char *atom, struct dummy_fetch_item *item)
+{
+	static const struct {
+		const char *name;
+		enum dummy_fetch_type type;
+	} simple_items[] = {
+		{ "UID", DUMMY_FETCH_UID },
+		{ "FLAGS", DUMMY_FETCH_FLAGS },
+		{ "RFC822.SIZE", DUMMY_FETCH_SIZE },
+		{ "INTERNALDATE", DUMMY_FETCH_INTERNALDATE },
+		{ "ENVELOPE", DUMMY_FETCH_ENVELOPE },
+		{ "BODY", DUMMY_FETCH_BODY },
+		{ "BODYSTRUCTURE", DUMMY_FETCH_BODYSTRUCTURE },
+		{ "MODSEQ", DUMMY_FETCH_MODSEQ },
+	};
+	const char *p, *end, *prefix;
+	unsigned int i;
+
+	i_zero(item);
+	p = strchr(atom, '[');
+	if (p == NULL) {
+		for (i = 0; i < N_ELEMENTS(simple_items); i++) {
+			if (strcasecmp(atom, simple_items[i].name) == 0) {
+				item->type = simple_items[i].type;
+				return TRUE;
+			}
+		}
+		item->type = DUMMY_FETCH_SECTION;
+		item->label = t_str_ucase(atom);
+		if (strcmp(item->label, "RFC822") == 0)
+			item->section = DUMMY_FETCH_SECTION_FULL;
+		else if (strcmp(item->label, "RFC822.HEADER") == 0) {
+			item->section = DUMMY_FETCH_SECTION_HEADER;
+			item->peek = TRUE;
+		} else if (strcmp(item->label, "RFC822.TEXT") == 0)
+			item->section = DUMMY_FETCH_SECTION_TEXT;
+		else
+			return FALSE;
+		return TRUE;
+	}
+
+	item->type = DUMMY_FETCH_SECTION;
+	prefix = t_str_ucase(t_strdup_until(atom, p));
+	if (strcmp(prefix, "BODY.PEEK") == 0 ||
+	    strcmp(prefix, "BINARY.PEEK") == 0) {
+		item->peek = TRUE;
+		prefix = t_strcut(prefix, '.');
+	} else if (strcmp(prefix, "BODY") != 0 &&
+		   strcmp(prefix, "BINARY") != 0)
+		return FALSE;
+
+	end = strchr(p, ']');
+	if (end == NULL ||
+	    !dummy_fetch_parse_section(t_strdup_until(p + 1, end), item))
+		return FALSE;
+	item->label = t_strconcat(prefix, t_strdup_until(p, end + 1), NULL);
+
+	if (end[1] == '<') {
+		if (str_parse_uoff(end + 2, &item->partial_offset, &p) < 0 ||
+		    *p != '.' ||
+		    str_parse_uoff(p + 1, &item->partial_size, &p) < 0 ||
+		    *p != '>')
+			return FALSE;
+		item->partial = TRUE;
+		item->label = t_strdup_printf("%s<%"PRIuUOFF_T">", item->label,
+					      item->partial_offset);
+	} else if (end[1] != '\0')
+		return FALSE;
+	return TRUE;
+}
+
+static bool
+dummy_fetch_parse_items(const struct dummy_imap_arg *arg,
+			ARRAY_TYPE(dummy_fetch_item) *items)
+{
+	struct dummy_imap_args args;
+	struct dummy_imap_arg subarg;
+	struct dummy_fetch_item *item;
+	const char *const *atoms;
+
+	if (arg->type == DUMMY_IMAP_ARG_ATOM) {
+		if (strcasecmp(arg->str, "ALL") == 0)
+			atoms = t_strsplit("FLAGS INTERNALDATE RFC822.SIZE ENVELOPE", " ");
+		else if (strcasecmp(arg->str, "FAST") == 0)
+			atoms = t_strsplit("FLAGS INTERNALDATE RFC822.SIZE", " ");
+		else if (strcasecmp(arg->str, "FULL") == 0)
+			atoms = t_strsplit("FLAGS INTERNALDATE RFC822.SIZE ENVELOPE BODY", " ");
+		else
+			atoms = t_strsplit(arg->str, " ");
+		for (; *atoms != NULL; atoms++) {
+			item = array_append_space(items);
+			if (!dummy_fetch_parse_item(*atoms, item))
+				return FALSE;
+		}
+		return TRUE;
+	}
+	if (arg->type != DUMMY_IMAP_ARG_LIST)
+		return FALSE;
+
+	dummy_imap_args_init(&args, NULL, arg->str);
+	for (;;) {
+		dummy_imap_args_next(&args, &subarg);
+		if (subarg.type == DUMMY_IMAP_ARG_EOL)
+			break;
+		if (subarg.type != DUMMY_IMAP_ARG_ATOM)
+			return FALSE;
+		item = array_append_space(items);
+		if (!dummy_fetch_parse_item(subarg.str, item))
+			return FALSE;
+	}
+	return array_count(items) > 0;
+}
+
+static bool
+dummy_fetch_header_field_match(const struct dummy_fetch_item *item,
+			       const unsigned char *line, size_t len)
+{
+	const char *const *field;
+	size_t field_len;
+
+	for (field = item->fields; *field != NULL; field++) {
+		field_len = strlen(*field);
+		if (field_len < len && line[field_len] == ':' &&
+		    strncasecmp((const char *)line, *field, field_len) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static const unsigned char *
+dummy_fetch_header_fields(const struct dummy_fetch_item *item,
+			  const struct dummy_mail_body *body, size_t *size_r)
+{
+	const unsigned char *p, *line, *end, *hdr_end;
+	bool match = FALSE;
+	buffer_t *buf;
+
+	buf = t_buffer_create(256);
+	p = body->data;
+	hdr_end = body->data + body->hdr_size;
+	while (p < hdr_end) {
+		line = p;
+		end = memchr(p, '\n', hdr_end - p);
+		p = end == NULL ? hdr_end : end + 1;
+		if (*line == '\r' || *line == '\n') {
+			/* end of header */
+			break;
+		}
+		if (*line != ' ' && *line != '\t') {
+			match = dummy_fetch_header_field_match(item, line,
+							       p - line);
+			if (item->section == DUMMY_FETCH_SECTION_HEADER_FIELDS_NOT)
+				match = !match;
+		}
+		if (match)
+			buffer_append(buf, line, p - line);
+	}
+	buffer_append(buf, "\r\n", 2);
+	*size_r = buf->used;
+	return buf->data;
+}
+
+static void
+dummy_fetch_send_section(struct dummy_imap_conn *conn, string_t *str,
+			 const struct dummy_fetch_item *item,
+			 const struct dummy_mail_body *body)
+{
+	const unsigned char *data;
+	size_t size;
+
+	switch (item->section) {
+	case DUMMY_FETCH_SECTION_FULL:
+		data = body->data;
+		size = body->size;
+		break;
+	case DUMMY_FETCH_SECTION_HEADER:
+		data = body->data;
+		size = body->hdr_size;
+		break;
+	case DUMMY_FETCH_SECTION_HEADER_FIELDS:
+	case DUMMY_FETCH_SECTION_HEADER_FIELDS_NOT:
+		data = dummy_fetch_header_fields(item, body, &size);
+		break;
+	case DUMMY_FETCH_SECTION_TEXT:
+		data = body->data + body->hdr_size;
+		size = body->size - body->hdr_size;
+		break;
+	case DUMMY_FETCH_SECTION_EMPTY:
+	default:
+		data = body->data;
+		size = 0;
+		break;
+	}
+	if (item->partial) {
+		if (item->partial_offset >= size)
+			size = 0;
+		else {
+			data += item->partial_offset;
+			size -= item->partial_offset;
+			if (size > item->partial_size)
+				size = item->partial_size;
+		}
+	}
+
+	str_printfa(str, "%s {%zu}\r\n", item->label, size);
+	o_stream_nsend(conn->conn.output, str_data(str), str_len(str));
+	o_stream_nsend(conn->conn.output, data, size);
+	str_truncate(str, 0);
+}
+
+static void
+dummy_fetch_mail(struct dummy_imap_conn *conn, uint32_t seq,
+		 struct dummy_mail *mail,
+		 const ARRAY_TYPE(dummy_fetch_item) *items, bool send_flags)
+{
+	struct dummy_mailbox *box = conn->box;
+	const struct dummy_fetch_item *item;
+	const struct dummy_mail_body *body = mail->body;
+	string_t *str;
+	bool first = TRUE;
+
+	str = t_str_new(256);
+	str_printfa(str, "* %u FETCH (", seq);
+	array_foreach(items, item) {
+		if (!first)
+			str_append_c(str, ' ');
+		first = FALSE;
+
+		switch (item->type) {
+		case DUMMY_FETCH_UID:
+			str_printfa(str, "UID %u", mail->uid);
+			break;
+		case DUMMY_FETCH_FLAGS:
+			dummy_imap_write_flags(str, box, mail);
+			send_flags = FALSE;
+			break;
+		case DUMMY_FETCH_SIZE:
+			str_printfa(str, "RFC822.SIZE %zu", body->size);
+			break;
+		case DUMMY_FETCH_INTERNALDATE:
+			str_printfa(str, "INTERNALDATE \"%s\"",
+				    imap_to_datetime(mail->received));
+			break;
+		case DUMMY_FETCH_ENVELOPE:
+			str_append(str, "ENVELOPE (NIL NIL NIL NIL NIL NIL NIL "
+				   "NIL NIL NIL)");
+			break;
+		case DUMMY_FETCH_BODY:
+		case DUMMY_FETCH_BODYSTRUCTURE:
+			str_printfa(str, "%s (\"text\" \"plain\" "
+				    "(\"charset\" \"us-ascii\") NIL NIL \"7bit\" "
+				    "%zu %u%s)",
+				    item->type == DUMMY_FETCH_BODY ?
+				    "BODY" : "BODYSTRUCTURE",
+				    body->size - body->hdr_size, body->lines,
+				    item->type == DUMMY_FETCH_BODY ? "" :
+				    " NIL NIL NIL NIL");
+			break;
+		case DUMMY_FETCH_MODSEQ:
+			str_printfa(str, "MODSEQ (%"PRIu64")", mail->modseq);
+			break;
+		case DUMMY_FETCH_SECTION:
+			dummy_fetch_send_section(conn, str, item, body);
+			break;
+		}
+	}
+	if (send_flags) {
+		/* \Seen flag was set implicitly */
+		if (!first)
+			str_append_c(str, ' ');
+		dummy_imap_write_flags(str, box, mail);
+	}
+	str_append(str, ")\r\n");
+	o_stream_nsend(conn->conn.output, str_data(str), str_len(str));
+}
+
+static void cmd_fetch(struct dummy_imap_cmd *cmd)
+{
+	struct dummy_imap_conn *conn = cmd->conn;
+	struct dummy_mailbox *box = conn->box;
+	ARRAY_TYPE(dummy_fetch_item) items;
+	ARRAY_TYPE(seq_range) seqs;
+	struct seq_range_iter iter;
+	const struct dummy_fetch_item *item;
+	struct dummy_fetch_item *uid_item;
+	struct dummy_imap_arg arg;
+	struct dummy_mail *mail;
+	const char *set;
+	unsigned int n = 0;
+	uint32_t seq;
+	bool set_seen = FALSE, have_uid = FALSE, send_flags, changed = FALSE;
+
+	t_array_init(&items, 8);
+	t_array_init(&seqs, 8);
+	if (!dummy_imap_args_next_atom(&cmd->args, &set) ||
+	    !dummy_imap_cmd_get_seqs(cmd, set, &seqs)) {
+		dummy_imap_cmd_bad(cmd, "Invalid messageset.");
+		return;
+	}
+	dummy_imap_args_next(&cmd->args, &arg);
+	if (!dummy_fetch_parse_items(&arg, &items)) {
+		dummy_imap_cmd_bad(cmd, "Invalid fetch items.");
+		return;
+	}
+	array_foreach(&items, item) {
+		if (item->type == DUMMY_FETCH_UID)
+			have_uid = TRUE;
+		if (item->type == DUMMY_FETCH_SECTION && !item->peek)
+			set_seen = !conn->box_readonly;
+	}
+	if (cmd->uid && !have_uid) {
+		uid_item = array_insert_space(&items, 0);
+		uid_item->type = DUMMY_FETCH_UID;
+	}
+
+	seq_range_array_iter_init(&iter, &seqs);
+	while (seq_range_array_iter_nth(&iter, n++, &seq)) {
+		mail = dummy_imap_seq_lookup(conn, seq);
+		if (mail == NULL)
+			continue;
+
+		send_flags = FALSE;
+		if (set_seen && (mail->flags & MAIL_SEEN) == 0) {
+			dummy_mailbox_update_flags(box, mail,
+				mail->flags | MAIL_SEEN, mail->keywords);
+			send_flags = changed = TRUE;
+		}
+		dummy_fetch_mail(conn, seq, mail, &items, send_flags);
+	}
+	if (changed) {
+		conn->seen_modseq = box->highest_modseq;
+		dummy_mailbox_changed(box);
+	}
+	dummy_imap_cmd_reply(cmd, "OK Fetch completed.");
+}
+
+static const struct dummy_imap_command dummy_imap_commands[] = {
+	{ "CAPABILITY", 0, cmd_capability },
+	{ "NOOP", 0, cmd_noop },
+	{ "ID", 0, cmd_id },
+	{ "LOGOUT", 0, cmd_logout },
+	{ "LOGIN", 0, cmd_login },
+	{ "AUTHENTICATE", 0, cmd_authenticate },
+
+	{ "ENABLE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_enable },
+	{ "NAMESPACE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_namespace },
+	{ "IDLE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_idle },
+	{ "CREATE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_create },
+	{ "DELETE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_delete },
+	{ "RENAME", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_rename },
+	{ "SUBSCRIBE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_subscribe },
+	{ "UNSUBSCRIBE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_subscribe },
+	{ "LIST", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_list },
+	{ "LSUB", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_list },
+	{ "STATUS", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_status },
+	{ "SELECT", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_select },
+	{ "EXAMINE", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_select },
+	{ "APPEND", DUMMY_IMAP_CMD_FLAG_AUTH, cmd_append },
+
+	{ "CHECK", DUMMY_IMAP_CMD_FLAG_SELECTED, cmd_check },
+	{ "CLOSE", DUMMY_IMAP_CMD_FLAG_SELECTED, cmd_close },
+	{ "UNSELECT", DUMMY_IMAP_CMD_FLAG_SELECTED, cmd_close },
+	{ "EXPUNGE", DUMMY_IMAP_CMD_FLAG_SELECTED |
+		     DUMMY_IMAP_CMD_FLAG_UID, cmd_expunge },
+	{ "FETCH", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		   DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_fetch },
+	{ "STORE", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		   DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_store },
+	{ "COPY", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		  DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_copy },
+	{ "SEARCH", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		    DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_search },
+	{ "SORT", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		  DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_search },
+	{ "THREAD", DUMMY_IMAP_CMD_FLAG_SELECTED | DUMMY_IMAP_CMD_FLAG_UID |
+		    DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES, cmd_search },
+};
+
+static void dummy_imap_command(struct dummy_imap_conn *conn)
+{
+	const struct dummy_imap_command *command = NULL;
+	struct dummy_imap_cmd cmd;
+	unsigned int i;
+
+	i_zero(&cmd);
+	cmd.conn = conn;
+	dummy_imap_args_init(&cmd.args, conn, str_c(conn->cmd));
+	if (!dummy_imap_args_next_atom(&cmd.args, &cmd.tag)) {
+		dummy_imap_send(conn, "* BAD Missing tag");
+		return;
+	}
+	if (!dummy_imap_args_next_atom(&cmd.args, &cmd.name)) {
+		dummy_imap_cmd_bad(&cmd, "Missing command.");
+		return;
+	}
+	if (strcasecmp(cmd.name, "UID") == 0) {
+		cmd.uid = TRUE;
+		if (!dummy_imap_args_next_atom(&cmd.args, &cmd.name)) {
+			dummy_imap_cmd_bad(&cmd, "Missing command.");
+			return;
+		}
+	}
+	cmd.name = t_str_ucase(cmd.name);
+
+	for (i = 0; i < N_ELEMENTS(dummy_imap_commands); i++) {
+		if (strcmp(dummy_imap_commands[i].name, cmd.name) == 0) {
+			command = &dummy_imap_commands[i];
+			break;
+		}
+	}
+	if (command == NULL ||
+	    (cmd.uid && (command->flags & DUMMY_IMAP_CMD_FLAG_UID) == 0)) {
+		dummy_imap_cmd_bad(&cmd, "Unknown command.");
+		return;
+	}
+	if ((command->flags & DUMMY_IMAP_CMD_FLAG_AUTH) != 0 &&
+	    !conn->authenticated) {
+		dummy_imap_cmd_bad(&cmd, "Not logged in.");
+		return;
+	}
+	if ((command->flags & DUMMY_IMAP_CMD_FLAG_SELECTED) ==
+	    DUMMY_IMAP_CMD_FLAG_SELECTED && conn->box == NULL) {
+		dummy_imap_cmd_bad(&cmd, "No mailbox selected.");
+		return;
+	}
+	cmd.no_expunges = !cmd.uid &&
+		(command->flags & DUMMY_IMAP_CMD_FLAG_NO_EXPUNGES) != 0;
+	command->func(&cmd);
+}
+
+static void
+dummy_imap_continuation(struct dummy_imap_conn *conn, const char *line)
+{
+	struct dummy_imap_cmd cmd;
+	const char *username;
+
+	i_zero(&cmd);
+	cmd.conn = conn;
+	cmd.tag = t_strdup(conn->cont_tag);
+
+	if (conn->idling) {
+		conn->idling = FALSE;
+		if (strcasecmp(line, "DONE") != 0)
+			dummy_imap_cmd_bad(&cmd, "Expected DONE.");
+		else
+			dummy_imap_cmd_reply(&cmd, "OK Idle completed.");
+	} else {
+		i_assert(conn->authenticating);
+		conn->authenticating = FALSE;
+		if (strcmp(line, "*") == 0)
+			dummy_imap_cmd_bad(&cmd, "Authentication aborted.");
+		else if (!dummy_imap_sasl_plain(line, &username))
+			dummy_imap_cmd_reply(&cmd, "NO Authentication failed.");
+		else
+			dummy_imap_login(&cmd, username);
+	}
+	i_free(conn->cont_tag);
+}
+
+static void dummy_imap_cmd_reset(struct dummy_imap_conn *conn)
+{
+	struct dummy_mail_body *body;
+
+	str_truncate(conn->cmd, 0);
+	array_foreach_elem(&conn->literals, body)
+		dummy_mail_body_unref(&body);
+	array_clear(&conn->literals);
+}
+
+static bool
+dummy_imap_line_get_literal(const char *line, size_t *prefix_len_r,
+			    uoff_t *size_r, bool *nonsync_r)
+{
+	size_t len = strlen(line);
+	const char *p;
+
+	if (len < 3 || line[len-1] != '}')
+		return FALSE;
+	p = strrchr(line, '{');
+	if (p == NULL)
+		return FALSE;
+	*nonsync_r = line[len-2] == '+';
+	if (str_to_uoff(t_strndup(p + 1, line + len - 1 - (*nonsync_r ? 1 : 0) -
+				   (p + 1)), size_r) < 0)
+		return FALSE;
+	*prefix_len_r = p - line;
+	return TRUE;
+}
+
+/* Returns 1 when a full command has been read, 0 if more input is needed. */
+static int dummy_imap_read_command(struct dummy_imap_conn *conn)
+{
+	struct istream *input = conn->conn.input;
+	struct dummy_mail_body *body;
+	const unsigned char *data;
+	const char *line;
+	size_t size, prefix_len;
+	bool nonsync;
+
+	for (;;) {
+		if (conn->literal_pending) {
+			data = i_stream_get_data(input, &size);
+			if (size < conn->literal_size)
+				return 0;
+			body = dummy_mail_body_new(data, conn->literal_size);
+			array_push_back(&conn->literals, &body);
+			i_stream_skip(input, conn->literal_size);
+			str_append_c(conn->cmd, DUMMY_IMAP_LITERAL_CHAR);
+			conn->literal_pending = FALSE;
+			continue;
+		}
+
+		line = i_stream_next_line(input);
+		if (line == NULL)
+			return 0;
+		if (!dummy_imap_line_get_literal(line, &prefix_len,
+						 &conn->literal_size, &nonsync)) {
+			str_append(conn->cmd, line);
+			return 1;
+		}
+		str_append_data(conn->cmd, line, prefix_len);
+		conn->literal_pending = TRUE;
+		if (!nonsync)
+			dummy_imap_send(conn, "+ OK");
+	}
+}
+
+static bool dummy_imap_input(struct dummy_conn *_conn)
+{
+	struct dummy_imap_conn *conn = (struct dummy_imap_conn *)_conn;
+	const char *line;
+
+	for (;;) {
+		if (conn->idling || conn->authenticating) {
+			if ((line = i_stream_next_line(_conn->input)) == NULL)
+				break;
+			T_BEGIN {
+				dummy_imap_continuation(conn, line);
+			} T_END;
+			continue;
+		}
+		if (dummy_imap_read_command(conn) == 0)
+			break;
+		T_BEGIN {
+			dummy_imap_command(conn);
+		} T_END;
+		dummy_imap_cmd_reset(conn);
+
+		if (conn->logged_out) {
+			o_stream_uncork(_conn->output);
+			(void)o_stream_flush(_conn->output);
+			dummy_conn_destroy(_conn);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void dummy_imap_destroy(struct dummy_conn *_conn)
+{
+	struct dummy_imap_conn *conn = (struct dummy_imap_conn *)_conn;
+
+	dummy_imap_unselect(conn);
+	dummy_imap_cmd_reset(conn);
+	array_free(&conn->literals);
+	array_free(&conn->uids);
+	str_free(&conn->cmd);
+	i_free(conn->cont_tag);
+}
+
+struct dummy_conn *dummy_imap_conn_create(int fd)
+{
+	struct dummy_imap_conn *conn;
+
+	conn = i_new(struct dummy_imap_conn, 1);
+	dummy_conn_init(&conn->conn, DUMMY_PROTOCOL_IMAP, fd);
+	conn->conn.v.input = dummy_imap_input;
+	conn->conn.v.destroy = dummy_imap_destroy;
+	conn->cmd = str_new(default_pool, 128);
+	i_array_init(&conn->literals, 2);
+	i_array_init(&conn->uids, 32);
+
+	dummy_imap_send(conn, "* OK [CAPABILITY "DUMMY_IMAP_CAPABILITY"] "
+			"imaptest dummy server ready.");
+	return &conn->conn;
+}
@@ -0,0 +1,178 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "dummy-server.h"
+
+struct dummy_lmtp_conn {
+	struct dummy_conn conn;
+
+	ARRAY(char *) rcpts;
+	/* message being received with DATA */
+	buffer_t *data;
+
+	bool have_mail_from:1;
+	bool in_data:1;
+	bool quit:1;
+};
+
+static void dummy_lmtp_send(struct dummy_lmtp_conn *conn, const char *line)
+{
+	o_stream_nsend_str(conn->conn.output, t_strconcat(line, "\r\n", NULL));
+}
+
+static void dummy_lmtp_reset(struct dummy_lmtp_conn *conn)
+{
+	char *rcpt;
+
+	array_foreach_elem(&conn->rcpts, rcpt)
+		i_free(rcpt);
+	array_clear(&conn->rcpts);
+	buffer_set_used_size(conn->data, 0);
+	conn->have_mail_from = FALSE;
+}
+
+static void dummy_lmtp_deliver(struct dummy_lmtp_conn *conn)
+{
+	struct dummy_mail_body *body;
+	struct dummy_mailbox *box;
+	char *rcpt;
+
+	body = dummy_mail_body_new(conn->data->data, conn->data->used);
+	array_foreach_elem(&conn->rcpts, rcpt) {
+		box = dummy_mailbox_find(dummy_user_get(rcpt), "INBOX");
+		(void)dummy_mailbox_add(box, body, 0, 0, ioloop_time);
+		dummy_mailbox_changed(box);
+		dummy_lmtp_send(conn, t_strdup_printf(
+			"250 2.0.0 <%s> Saved", rcpt));
+	}
+	dummy_mail_body_unref(&body);
+	dummy_lmtp_reset(conn);
+}
+
+static void dummy_lmtp_data_line(struct dummy_lmtp_conn *conn, const char *line)
+{
+	if (line[0] == '.') {
+		if (line[1] == '\0') {
+			conn->in_data = FALSE;
+			dummy_lmtp_deliver(conn);
+			return;
+		}
+		/* remove dot-stuffing */
+		line++;
+	}
+	buffer_append(conn->data, line, strlen(line));
+	buffer_append(conn->data, "\r\n", 2);
+}
+
+static const char *dummy_lmtp_get_address(const char *arg)
+{
+	const char *p;
+
+	p = strchr(arg, '<');
+	if (p == NULL)
+		return NULL;
+	return t_strcut(p + 1, '>');
+}
+
+static void dummy_lmtp_command(struct dummy_lmtp_conn *conn, const char *line)
+{
+	const char *address;
+	char *rcpt;
+
+	if (strncasecmp(line, "LHLO ", 5) == 0) {
+		dummy_lmtp_reset(conn);
+		o_stream_nsend_str(conn->conn.output,
+				   "250-localhost\r\n"
+				   "250-8BITMIME\r\n"
+				   "250-ENHANCEDSTATUSCODES\r\n"
+				   "250 PIPELINING\r\n");
+	} else if (strncasecmp(line, "MAIL FROM:", 10) == 0) {
+		if (conn->have_mail_from)
+			dummy_lmtp_send(conn, "503 5.5.1 MAIL already given");
+		else {
+			conn->have_mail_from = TRUE;
+			dummy_lmtp_send(conn, "250 2.1.0 OK");
+		}
+	} else if (strncasecmp(line, "RCPT TO:", 8) == 0) {
+		address = dummy_lmtp_get_address(line + 8);
+		if (!conn->have_mail_from)
+			dummy_lmtp_send(conn, "503 5.5.1 MAIL needed first");
+		else if (address == NULL || *address == '\0')
+			dummy_lmtp_send(conn, "501 5.5.4 Invalid address");
+		else {
+			rcpt = i_strdup(address);
+			array_push_back(&conn->rcpts, &rcpt);
+			dummy_lmtp_send(conn, "250 2.1.5 OK");
+		}
+	} else if (strcasecmp(line, "DATA") == 0) {
+		if (array_count(&conn->rcpts) == 0)
+			dummy_lmtp_send(conn, "503 5.5.1 No valid recipients");
+		else {
+			conn->in_data = TRUE;
+			dummy_lmtp_send(conn, "354 OK");
+		}
+	} else if (strcasecmp(line, "RSET") == 0) {
+		dummy_lmtp_reset(conn);
+		dummy_lmtp_send(conn, "250 2.0.0 OK");
+	} else if (strcasecmp(line, "NOOP") == 0) {
+		dummy_lmtp_send(conn, "250 2.0.0 OK");
+	} else if (strcasecmp(line, "QUIT") == 0) {
+		dummy_lmtp_send(conn, "221 2.0.0 Bye");
+		conn->quit = TRUE;
+	} else {
+		dummy_lmtp_send(conn, "500 5.5.2 Unknown command");
+	}
+}
+
+static bool dummy_lmtp_input(struct dummy_conn *_conn)
+{
+	struct dummy_lmtp_conn *conn = (struct dummy_lmtp_conn *)_conn;
+	const char *line;
+
+	while ((line = i_stream_next_line(_conn->input)) != NULL) {
+		T_BEGIN {
+			if (conn->in_data)
+				dummy_lmtp_data_line(conn, line);
+			else
+				dummy_lmtp_command(conn, line);
+		} T_END;
+
+		if (conn->quit) {
+			o_stream_uncork(_conn->output);
+			(void)o_stream_flush(_conn->output);
+			dummy_conn_destroy(_conn);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void dummy_lmtp_destroy(struct dummy_conn *_conn)
+{
+	struct dummy_lmtp_conn *conn = (struct dummy_lmtp_conn *)_conn;
+
+	dummy_lmtp_reset(conn);
+	array_free(&conn->rcpts);
+	buffer_free(&conn->data);
+}
+
+struct dummy_conn *dummy_lmtp_conn_create(int fd)
+{
+	struct dummy_lmtp_conn *conn;
+
+	conn = i_new(struct dummy_lmtp_conn, 1);
+	dummy_conn_init(&conn->conn, DUMMY_PROTOCOL_LMTP, fd);
+	conn->conn.v.input = dummy_lmtp_input;
+	conn->conn.v.destroy = dummy_lmtp_destroy;
+	i_array_init(&conn->rcpts, 4);
+	conn->data = buffer_create_dynamic(default_pool, 4096);
+
+	dummy_lmtp_send(conn, "220 localhost imaptest dummy LMTP ready");
+	return &conn->conn;
+}
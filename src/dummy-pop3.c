@@ -0,0 +1,371 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "base64.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "dummy-server.h"
+
+#define DUMMY_POP3_CAPABILITY \
+	"+OK\r\nUSER\r\nUIDL\r\nTOP\r\nPIPELINING\r\nSASL PLAIN\r\n.\r\n"
+
+struct dummy_pop3_conn {
+	struct dummy_conn conn;
+	char *username;
+
+	/* INBOX contents at login time */
+	struct dummy_mailbox *box;
+	ARRAY(uint32_t) uids;
+	ARRAY(bool) deleted;
+
+	bool authenticating:1;
+	bool quit:1;
+};
+
+static void dummy_pop3_send(struct dummy_pop3_conn *conn, const char *line)
+{
+	o_stream_nsend_str(conn->conn.output, t_strconcat(line, "\r\n", NULL));
+}
+
+static void dummy_pop3_login(struct dummy_pop3_conn *conn, const char *username)
+{
+	const struct dummy_mail *mail;
+	bool deleted = FALSE;
+
+	dummy_conn_set_user(&conn->conn, username);
+	conn->box = dummy_mailbox_find(conn->conn.user, "INBOX");
+	array_foreach(&conn->box->mails, mail) {
+		array_push_back(&conn->uids, &mail->uid);
+		array_push_back(&conn->deleted, &deleted);
+	}
+	dummy_pop3_send(conn, "+OK Logged in.");
+}
+
+static bool
+dummy_pop3_sasl_plain(const char *response, const char **username_r)
+{
+	const buffer_t *buf;
+	const char *authzid, *authcid, *p, *end;
+
+	buf = t_base64_decode(0, response, strlen(response));
+	p = buf->data;
+	end = p + buf->used;
+
+	authzid = t_strndup(p, end - p);
+	p += strlen(authzid) + 1;
+	if (p >= end)
+		return FALSE;
+	authcid = t_strndup(p, end - p);
+	*username_r = *authzid != '\0' ? authzid : authcid;
+	return **username_r != '\0';
+}
+
+static void dummy_pop3_auth_continue(struct dummy_pop3_conn *conn,
+				     const char *line)
+{
+	const char *username;
+
+	conn->authenticating = FALSE;
+	if (strcmp(line, "*") == 0)
+		dummy_pop3_send(conn, "-ERR Authentication aborted.");
+	else if (!dummy_pop3_sasl_plain(line, &username))
+		dummy_pop3_send(conn, "-ERR Authentication failed.");
+	else
+		dummy_pop3_login(conn, username);
+}
+
+/* Returns the mail for the given message number, or NULL after sending
+   an error. */
+static struct dummy_mail *
+dummy_pop3_get_mail(struct dummy_pop3_conn *conn, const char *arg,
+		    unsigned int *idx_r)
+{
+	struct dummy_mail *mail;
+	unsigned int num;
+
+	if (arg == NULL || str_to_uint(arg, &num) < 0 || num == 0 ||
+	    num > array_count(&conn->uids) ||
+	    array_idx_elem(&conn->deleted, num-1)) {
+		dummy_pop3_send(conn, "-ERR There's no message with that number.");
+		return NULL;
+	}
+	mail = dummy_mailbox_lookup_uid(conn->box,
+					array_idx_elem(&conn->uids, num-1));
+	if (mail == NULL) {
+		dummy_pop3_send(conn, "-ERR Message has been expunged.");
+		return NULL;
+	}
+	*idx_r = num - 1;
+	return mail;
+}
+
+static void
+dummy_pop3_send_body(struct dummy_pop3_conn *conn,
+		     const struct dummy_mail_body *body, unsigned int max_lines)
+{
+	struct ostream *output = conn->conn.output;
+	const unsigned char *p, *end, *line_end;
+	unsigned int lines = 0;
+
+	/* header + max_lines of the body, with the lines beginning with '.'
+	   escaped */
+	p = body->data;
+	end = body->data + body->size;
+	while (p < end) {
+		if (p >= body->data + body->hdr_size && lines++ == max_lines)
+			break;
+		if (*p == '.')
+			o_stream_nsend(output, ".", 1);
+		line_end = memchr(p, '\n', end - p);
+		line_end = line_end == NULL ? end : line_end + 1;
+		o_stream_nsend(output, p, line_end - p);
+		p = line_end;
+	}
+	if (body->size > 0 && end[-1] != '\n')
+		o_stream_nsend(output, "\r\n", 2);
+	o_stream_nsend(output, ".\r\n", 3);
+}
+
+static void dummy_pop3_cmd_stat(struct dummy_pop3_conn *conn)
+{
+	const struct dummy_mail *mail;
+	unsigned int i, count, msgs = 0;
+	uoff_t size = 0;
+
+	count = array_count(&conn->uids);
+	for (i = 0; i < count; i++) {
+		if (array_idx_elem(&conn->deleted, i))
+			continue;
+		mail = dummy_mailbox_lookup_uid(conn->box,
+						array_idx_elem(&conn->uids, i));
+		if (mail != NULL) {
+			size += mail->body->size;
+			msgs++;
+		}
+	}
+	dummy_pop3_send(conn, t_strdup_printf("+OK %u %"PRIuUOFF_T,
+					      msgs, size));
+}
+
+static void dummy_pop3_cmd_list(struct dummy_pop3_conn *conn, const char *arg,
+				bool uidl)
+{
+	const struct dummy_mail *mail;
+	unsigned int i, count;
+	string_t *str;
+
+	if (arg != NULL) {
+		mail = dummy_pop3_get_mail(conn, arg, &i);
+		if (mail == NULL)
+			return;
+		dummy_pop3_send(conn, uidl ?
+			t_strdup_printf("+OK %u %08x%08x", i + 1,
+					conn->box->uidvalidity, mail->uid) :
+			t_strdup_printf("+OK %u %zu", i + 1, mail->body->size));
+		return;
+	}
+
+	str = t_str_new(1024);
+	str_append(str, "+OK\r\n");
+	count = array_count(&conn->uids);
+	for (i = 0; i < count; i++) {
+		if (array_idx_elem(&conn->deleted, i))
+			continue;
+		mail = dummy_mailbox_lookup_uid(conn->box,
+						array_idx_elem(&conn->uids, i));
+		if (mail == NULL)
+			continue;
+		if (uidl) {
+			str_printfa(str, "%u %08x%08x\r\n", i + 1,
+				    conn->box->uidvalidity, mail->uid);
+		} else {
+			str_printfa(str, "%u %zu\r\n", i + 1, mail->body->size);
+		}
+	}
+	str_append(str, ".\r\n");
+	o_stream_nsend(conn->conn.output, str_data(str), str_len(str));
+}
+
+static void
+dummy_pop3_cmd_retr(struct dummy_pop3_conn *conn, const char *arg,
+		    const char *lines_arg, bool top)
+{
+	const struct dummy_mail *mail;
+	unsigned int idx, lines = UINT_MAX;
+
+	if (top && (lines_arg == NULL || str_to_uint(lines_arg, &lines) < 0)) {
+		dummy_pop3_send(conn, "-ERR Invalid number of lines.");
+		return;
+	}
+	mail = dummy_pop3_get_mail(conn, arg, &idx);
+	if (mail == NULL)
+		return;
+	dummy_pop3_send(conn, t_strdup_printf("+OK %zu octets",
+					      mail->body->size));
+	dummy_pop3_send_body(conn, mail->body, lines);
+}
+
+static void dummy_pop3_cmd_dele(struct dummy_pop3_conn *conn, const char *arg)
+{
+	unsigned int idx;
+	bool deleted = TRUE;
+
+	if (dummy_pop3_get_mail(conn, arg, &idx) == NULL)
+		return;
+	array_idx_set(&conn->deleted, idx, &deleted);
+	dummy_pop3_send(conn, "+OK Marked to be deleted.");
+}
+
+static void dummy_pop3_cmd_rset(struct dummy_pop3_conn *conn)
+{
+	bool *deleted;
+	unsigned int i, count;
+
+	deleted = array_get_modifiable(&conn->deleted, &count);
+	for (i = 0; i < count; i++)
+		deleted[i] = FALSE;
+	dummy_pop3_send(conn, "+OK");
+}
+
+static void dummy_pop3_cmd_quit(struct dummy_pop3_conn *conn)
+{
+	unsigned int i, count;
+	bool changed = FALSE;
+
+	if (conn->box != NULL) {
+		count = array_count(&conn->uids);
+		for (i = 0; i < count; i++) {
+			if (!array_idx_elem(&conn->deleted, i))
+				continue;
+			dummy_mailbox_expunge_uid(conn->box,
+				array_idx_elem(&conn->uids, i));
+			changed = TRUE;
+		}
+		if (changed)
+			dummy_mailbox_changed(conn->box);
+	}
+	dummy_pop3_send(conn, "+OK Logging out.");
+	conn->quit = TRUE;
+}
+
+static void dummy_pop3_command(struct dummy_pop3_conn *conn, const char *line)
+{
+	const char *const *args, *name, *arg;
+	const char *username;
+
+	args = t_strsplit_spaces(line, " ");
+	if (args[0] == NULL) {
+		dummy_pop3_send(conn, "-ERR Unknown command.");
+		return;
+	}
+	name = t_str_ucase(args[0]);
+	arg = args[1];
+
+	if (strcmp(name, "QUIT") == 0) {
+		dummy_pop3_cmd_quit(conn);
+		return;
+	}
+	if (strcmp(name, "CAPA") == 0) {
+		o_stream_nsend_str(conn->conn.output, DUMMY_POP3_CAPABILITY);
+		return;
+	}
+	if (strcmp(name, "NOOP") == 0) {
+		dummy_pop3_send(conn, "+OK");
+		return;
+	}
+
+	if (conn->box == NULL) {
+		if (strcmp(name, "USER") == 0 && arg != NULL) {
+			i_free(conn->username);
+			conn->username = i_strdup(arg);
+			dummy_pop3_send(conn, "+OK");
+		} else if (strcmp(name, "PASS") == 0 && conn->username != NULL) {
+			/* any password is accepted */
+			dummy_pop3_login(conn, conn->username);
+		} else if (strcmp(name, "AUTH") == 0 && arg == NULL) {
+			o_stream_nsend_str(conn->conn.output,
+					   "+OK\r\nPLAIN\r\n.\r\n");
+		} else if (strcmp(name, "AUTH") == 0) {
+			if (strcasecmp(arg, "PLAIN") != 0)
+				dummy_pop3_send(conn, "-ERR Unsupported mechanism.");
+			else if (args[2] == NULL) {
+				conn->authenticating = TRUE;
+				dummy_pop3_send(conn, "+ ");
+			} else if (!dummy_pop3_sasl_plain(args[2], &username))
+				dummy_pop3_send(conn, "-ERR Authentication failed.");
+			else
+				dummy_pop3_login(conn, username);
+		} else {
+			dummy_pop3_send(conn, "-ERR Unknown command.");
+		}
+		return;
+	}
+
+	if (strcmp(name, "STAT") == 0)
+		dummy_pop3_cmd_stat(conn);
+	else if (strcmp(name, "LIST") == 0)
+		dummy_pop3_cmd_list(conn, arg, FALSE);
+	else if (strcmp(name, "UIDL") == 0)
+		dummy_pop3_cmd_list(conn, arg, TRUE);
+	else if (strcmp(name, "RETR") == 0)
+		dummy_pop3_cmd_retr(conn, arg, NULL, FALSE);
+	else if (strcmp(name, "TOP") == 0)
+		dummy_pop3_cmd_retr(conn, arg, arg == NULL ? NULL : args[2], TRUE);
+	else if (strcmp(name, "DELE") == 0)
+		dummy_pop3_cmd_dele(conn, arg);
+	else if (strcmp(name, "RSET") == 0)
+		dummy_pop3_cmd_rset(conn);
+	else
+		dummy_pop3_send(conn, "-ERR Unknown command.");
+}
+
+static bool dummy_pop3_input(struct dummy_conn *_conn)
+{
+	struct dummy_pop3_conn *conn = (struct dummy_pop3_conn *)_conn;
+	const char *line;
+
+	while ((line = i_stream_next_line(_conn->input)) != NULL) {
+		T_BEGIN {
+			if (conn->authenticating)
+				dummy_pop3_auth_continue(conn, line);
+			else
+				dummy_pop3_command(conn, line);
+		} T_END;
+
+		if (conn->quit) {
+			o_stream_uncork(_conn->output);
+			(void)o_stream_flush(_conn->output);
+			dummy_conn_destroy(_conn);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void dummy_pop3_destroy(struct dummy_conn *_conn)
+{
+	struct dummy_pop3_conn *conn = (struct dummy_pop3_conn *)_conn;
+
+	array_free(&conn->uids);
+	array_free(&conn->deleted);
+	i_free(conn->username);
+}
+
+struct dummy_conn *dummy_pop3_conn_create(int fd)
+{
+	struct dummy_pop3_conn *conn;
+
+	conn = i_new(struct dummy_pop3_conn, 1);
+	dummy_conn_init(&conn->conn, DUMMY_PROTOCOL_POP3, fd);
+	conn->conn.v.input = dummy_pop3_input;
+	conn->conn.v.destroy = dummy_pop3_destroy;
+	i_array_init(&conn->uids, 32);
+	i_array_init(&conn->deleted, 32);
+
+	dummy_pop3_send(conn, "+OK imaptest dummy server ready.");
+	return &conn->conn;
+}
@@ -0,0 +1,242 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "lib-signals.h"
+#include "ioloop.h"
+#include "llist.h"
+#include "net.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "dummy-server.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define DUMMY_DEFAULT_IMAP_PORT 14300
+#define DUMMY_DEFAULT_POP3_PORT 11000
+#define DUMMY_DEFAULT_LMTP_PORT 12400
+#define DUMMY_LISTEN_BACKLOG 1024
+
+struct dummy_listener {
+	enum dummy_protocol protocol;
+	int fd;
+	struct io *io;
+};
+
+struct ioloop *dummy_ioloop;
+
+static const char *protocol_names[DUMMY_PROTOCOL_COUNT] = {
+	"imap", "pop3", "lmtp"
+};
+static struct dummy_listener listeners[DUMMY_PROTOCOL_COUNT];
+static struct dummy_conn *dummy_conns = NULL;
+
+static void dummy_conn_input(struct dummy_conn *conn)
+{
+	switch (i_stream_read(conn->input)) {
+	case -2:
+		i_unreached();
+	case -1:
+		if (conn->input->stream_errno != 0 &&
+		    conn->input->stream_errno != ECONNRESET) {
+			i_error("%s: read() failed: %s",
+				protocol_names[conn->protocol],
+				i_stream_get_error(conn->input));
+		}
+		dummy_conn_destroy(conn);
+		return;
+	}
+
+	o_stream_cork(conn->output);
+	if (conn->v.input(conn))
+		o_stream_uncork(conn->output);
+}
+
+void dummy_conn_init(struct dummy_conn *conn, enum dummy_protocol protocol,
+		     int fd)
+{
+	conn->protocol = protocol;
+	conn->fd = fd;
+	conn->input = i_stream_create_fd(fd, (size_t)-1);
+	conn->output = o_stream_create_fd(fd, (size_t)-1);
+	o_stream_set_no_error_handling(conn->output, TRUE);
+	conn->io = io_add(fd, IO_READ, dummy_conn_input, conn);
+
+	DLLIST_PREPEND(&dummy_conns, conn);
+}
+
+void dummy_conn_destroy(struct dummy_conn *conn)
+{
+	if (conn->destroyed)
+		return;
+	conn->destroyed = TRUE;
+
+	DLLIST_REMOVE(&dummy_conns, conn);
+
+	if (conn->v.destroy != NULL)
+		conn->v.destroy(conn);
+	io_remove(&conn->io);
+	i_stream_destroy(&conn->input);
+	o_stream_destroy(&conn->output);
+	i_close_fd(&conn->fd);
+	i_free(conn);
+}
+
+void dummy_conn_set_user(struct dummy_conn *conn, const char *username)
+{
+	conn->user = dummy_user_get(username);
+}
+
+static void dummy_listener_accept(struct dummy_listener *listener)
+{
+	struct dummy_conn *conn = NULL;
+	struct ip_addr ip;
+	in_port_t port;
+	int fd;
+
+	fd = net_accept(listener->fd, &ip, &port);
+	if (fd == -1)
+		return;
+	if (fd < 0) {
+		i_error("accept() failed: %m");
+		return;
+	}
+	net_set_nonblock(fd, TRUE);
+
+	switch (listener->protocol) {
+	case DUMMY_PROTOCOL_IMAP:
+		conn = dummy_imap_conn_create(fd);
+		break;
+	case DUMMY_PROTOCOL_POP3:
+		conn = dummy_pop3_conn_create(fd);
+		break;
+	case DUMMY_PROTOCOL_LMTP:
+		conn = dummy_lmtp_conn_create(fd);
+		break;
+	case DUMMY_PROTOCOL_COUNT:
+		i_unreached();
+	}
+	i_assert(conn != NULL);
+}
+
+static void
+dummy_listener_init(enum dummy_protocol protocol, const struct ip_addr *ip,
+		    in_port_t port)
+{
+	struct dummy_listener *listener = &listeners[protocol];
+
+	listener->protocol = protocol;
+	listener->fd = net_listen(ip, &port, DUMMY_LISTEN_BACKLOG);
+	if (listener->fd == -1) {
+		i_fatal("listen(%s, %u) failed: %m",
+			net_ip2addr(ip), port);
+	}
+	listener->io = io_add(listener->fd, IO_READ,
+			      dummy_listener_accept, listener);
+	printf("Listening %s on %s:%u\n", protocol_names[protocol],
+	       net_ip2addr(ip), port);
+}
+
+static void dummy_listeners_deinit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DUMMY_PROTOCOL_COUNT; i++) {
+		if (listeners[i].io == NULL)
+			continue;
+		io_remove(&listeners[i].io);
+		i_close_fd(&listeners[i].fd);
+	}
+}
+
+static void sig_die(const siginfo_t *si ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+	io_loop_stop(dummy_ioloop);
+}
+
+static void print_help(void)
+{
+	printf(
+"imaptest-dummy-server [ip=<ip>] [imap=<port>] [pop3=<port>] [lmtp=<port>]\n"
+"\n"
+" ip      IP address to listen on (default: 127.0.0.1)\n"
+" imap    IMAP port (default: %u)\n"
+" pop3    POP3 port (default: %u)\n"
+" lmtp    LMTP port (default: %u)\n"
+"\n"
+"Setting a port to 0 disables the protocol.\n",
+	       DUMMY_DEFAULT_IMAP_PORT, DUMMY_DEFAULT_POP3_PORT,
+	       DUMMY_DEFAULT_LMTP_PORT);
+}
+
+int main(int argc ATTR_UNUSED, char *argv[])
+{
+	in_port_t ports[DUMMY_PROTOCOL_COUNT] = {
+		DUMMY_DEFAULT_IMAP_PORT,
+		DUMMY_DEFAULT_POP3_PORT,
+		DUMMY_DEFAULT_LMTP_PORT
+	};
+	struct ip_addr ip;
+	const char *key, *value;
+	unsigned int i;
+
+	lib_init();
+	dummy_ioloop = io_loop_create();
+
+	lib_signals_init();
+	lib_signals_ignore(SIGPIPE, TRUE);
+	lib_signals_set_handler(SIGINT, LIBSIG_FLAG_DELAYED, sig_die, NULL);
+	lib_signals_set_handler(SIGTERM, LIBSIG_FLAG_DELAYED, sig_die, NULL);
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+
+	for (argv++; *argv != NULL; argv++) {
+		value = strchr(*argv, '=');
+		key = value == NULL ? *argv :
+			t_strdup_until(*argv, value);
+		if (value != NULL) value++;
+
+		if (strcmp(*argv, "-h") == 0 ||
+		    strcmp(*argv, "--help") == 0) {
+			print_help();
+			return 0;
+		}
+		if (value == NULL)
+			i_fatal("Unknown parameter: %s", *argv);
+
+		if (strcmp(key, "ip") == 0) {
+			if (net_addr2ip(value, &ip) < 0)
+				i_fatal("Invalid ip: %s", value);
+			continue;
+		}
+		for (i = 0; i < DUMMY_PROTOCOL_COUNT; i++) {
+			if (strcmp(key, protocol_names[i]) == 0)
+				break;
+		}
+		if (i == DUMMY_PROTOCOL_COUNT)
+			i_fatal("Unknown parameter: %s", *argv);
+		if (net_str2port_zero(value, &ports[i]) < 0)
+			i_fatal("Invalid %s port: %s", key, value);
+	}
+
+	lib_set_clean_exit(TRUE);
+	dummy_storage_init();
+	for (i = 0; i < DUMMY_PROTOCOL_COUNT; i++) {
+		if (ports[i] != 0)
+			dummy_listener_init(i, &ip, ports[i]);
+	}
+
+	io_loop_run(dummy_ioloop);
+
+	while (dummy_conns != NULL)
+		dummy_conn_destroy(dummy_conns);
+	dummy_listeners_deinit();
+	dummy_storage_deinit();
+
+	lib_signals_deinit();
+	io_loop_destroy(&dummy_ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef DUMMY_SERVER_H
+#define DUMMY_SERVER_H
+
+#include "net.h"
+#include "mail-types.h"
+
+/* Minimal in-memory IMAP/POP3/LMTP server used for measuring how much load
+   imaptest itself can generate. Nothing is persistent and only as much of
+   the protocols is implemented as imaptest needs. */
+
+#define DUMMY_MAX_KEYWORDS 32
+
+enum dummy_protocol {
+	DUMMY_PROTOCOL_IMAP = 0,
+	DUMMY_PROTOCOL_POP3,
+	DUMMY_PROTOCOL_LMTP,
+
+	DUMMY_PROTOCOL_COUNT
+};
+
+struct dummy_conn;
+struct dummy_imap_conn;
+
+struct dummy_conn_vfuncs {
+	/* Process everything that is in the input buffer. Returns FALSE if
+	   the connection was destroyed. */
+	bool (*input)(struct dummy_conn *conn);
+	void (*destroy)(struct dummy_conn *conn);
+};
+
+struct dummy_conn {
+	struct dummy_conn *prev, *next;
+	struct dummy_conn_vfuncs v;
+	enum dummy_protocol protocol;
+
+	int fd;
+	struct io *io;
+	struct istream *input;
+	struct ostream *output;
+
+	struct dummy_user *user;
+	bool destroyed:1;
+};
+
+struct dummy_mail_body {
+	unsigned int refcount;
+	size_t size, hdr_size;
+	unsigned int lines;
+	unsigned char data[];
+};
+
+struct dummy_mail {
+	uint32_t uid;
+	enum mail_flags flags;
+	/* bitmask of dummy_mailbox.keywords */
+	uint32_t keywords;
+	uint64_t modseq;
+	time_t received;
+	struct dummy_mail_body *body;
+};
+
+struct dummy_mailbox {
+	struct dummy_user *user;
+	char *name;
+
+	uint32_t uidvalidity, uidnext;
+	uint64_t highest_modseq;
+	/* increased every time messages are expunged */
+	unsigned int expunge_counter;
+
+	/* sorted by UID */
+	ARRAY(struct dummy_mail) mails;
+	ARRAY(char *) keywords;
+	/* IMAP connections that have this mailbox selected */
+	ARRAY(struct dummy_imap_conn *) imap_conns;
+
+	bool subscribed:1;
+};
+
+struct dummy_user {
+	char *username;
+	ARRAY(struct dummy_mailbox *) mailboxes;
+};
+
+extern struct ioloop *dummy_ioloop;
+
+void dummy_conn_init(struct dummy_conn *conn, enum dummy_protocol protocol,
+		     int fd);
+void dummy_conn_destroy(struct dummy_conn *conn);
+void dummy_conn_set_user(struct dummy_conn *conn, const char *username);
+
+/* Storage */
+struct dummy_user *dummy_user_get(const char *username);
+struct dummy_mailbox *
+dummy_mailbox_find(struct dummy_user *user, const char *name);
+struct dummy_mailbox *
+dummy_mailbox_create(struct dummy_user *user, const char *name);
+void dummy_mailbox_delete(struct dummy_mailbox *box);
+
+struct dummy_mail_body *
+dummy_mail_body_new(const unsigned char *data, size_t size);
+void dummy_mail_body_unref(struct dummy_mail_body **body);
+
+struct dummy_mail *
+dummy_mailbox_lookup_uid(struct dummy_mailbox *box, uint32_t uid);
+/* Add a new mail. A new reference to the body is added. */
+struct dummy_mail *
+dummy_mailbox_add(struct dummy_mailbox *box, struct dummy_mail_body *body,
+		  enum mail_flags flags, uint32_t keywords, time_t received);
+void dummy_mailbox_expunge_uid(struct dummy_mailbox *box, uint32_t uid);
+void dummy_mailbox_update_flags(struct dummy_mailbox *box,
+				struct dummy_mail *mail,
+				enum mail_flags flags, uint32_t keywords);
+/* Returns the keyword's bit, or 0 if there are too many keywords. */
+uint32_t dummy_mailbox_keyword_get(struct dummy_mailbox *box,
+				   const char *name);
+const char *const *
+dummy_mailbox_keywords_get_names(struct dummy_mailbox *box, uint32_t keywords);
+/* Notify the IMAP connections that have the mailbox selected. */
+void dummy_mailbox_changed(struct dummy_mailbox *box);
+
+void dummy_storage_init(void);
+void dummy_storage_deinit(void);
+
+/* Protocols */
+struct dummy_conn *dummy_imap_conn_create(int fd);
+void dummy_imap_mailbox_changed(struct dummy_imap_conn *conn);
+
+struct dummy_conn *dummy_pop3_conn_create(int fd);
+struct dummy_conn *dummy_lmtp_conn_create(int fd);
+
+#endif
@@ -0,0 +1,273 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "ioloop.h"
+
+#include "dummy-server.h"
+
+static HASH_TABLE(char *, struct dummy_user *) dummy_users;
+static uint32_t dummy_next_uidvalidity;
+
+static int dummy_mail_uid_cmp(const uint32_t *uid,
+			      const struct dummy_mail *mail)
+{
+	return *uid < mail->uid ? -1 :
+		(*uid > mail->uid ? 1 : 0);
+}
+
+struct dummy_user *dummy_user_get(const char *username)
+{
+	struct dummy_user *user;
+
+	user = hash_table_lookup(dummy_users, username);
+	if (user == NULL) {
+		user = i_new(struct dummy_user, 1);
+		user->username = i_strdup(username);
+		i_array_init(&user->mailboxes, 4);
+		hash_table_insert(dummy_users, user->username, user);
+		(void)dummy_mailbox_create(user, "INBOX");
+	}
+	return user;
+}
+
+static void dummy_user_free(struct dummy_user *user)
+{
+	while (array_count(&user->mailboxes) > 0) {
+		dummy_mailbox_delete(array_idx_elem(&user->mailboxes, 0));
+	}
+	array_free(&user->mailboxes);
+	i_free(user->username);
+	i_free(user);
+}
+
+struct dummy_mailbox *
+dummy_mailbox_find(struct dummy_user *user, const char *name)
+{
+	struct dummy_mailbox *box;
+
+	if (strcasecmp(name, "INBOX") == 0)
+		name = "INBOX";
+	array_foreach_elem(&user->mailboxes, box) {
+		if (strcmp(box->name, name) == 0)
+			return box;
+	}
+	return NULL;
+}
+
+struct dummy_mailbox *
+dummy_mailbox_create(struct dummy_user *user, const char *name)
+{
+	struct dummy_mailbox *box;
+
+	i_assert(dummy_mailbox_find(user, name) == NULL);
+
+	if (strcasecmp(name, "INBOX") == 0)
+		name = "INBOX";
+	box = i_new(struct dummy_mailbox, 1);
+	box->user = user;
+	box->name = i_strdup(name);
+	box->uidvalidity = ++dummy_next_uidvalidity;
+	box->uidnext = 1;
+	box->highest_modseq = 1;
+	i_array_init(&box->mails, 32);
+	i_array_init(&box->keywords, 4);
+	i_array_init(&box->imap_conns, 2);
+	array_push_back(&user->mailboxes, &box);
+	return box;
+}
+
+void dummy_mailbox_delete(struct dummy_mailbox *box)
+{
+	struct dummy_mailbox *const *boxes;
+	struct dummy_mail *mail;
+	char *keyword;
+	unsigned int i, count;
+
+	i_assert(array_count(&box->imap_conns) == 0);
+
+	boxes = array_get(&box->user->mailboxes, &count);
+	for (i = 0; i < count; i++) {
+		if (boxes[i] == box) {
+			array_delete(&box->user->mailboxes, i, 1);
+			break;
+		}
+	}
+	array_foreach_modifiable(&box->mails, mail)
+		dummy_mail_body_unref(&mail->body);
+	array_foreach_elem(&box->keywords, keyword)
+		i_free(keyword);
+	array_free(&box->mails);
+	array_free(&box->keywords);
+	array_free(&box->imap_conns);
+	i_free(box->name);
+	i_free(box);
+}
+
+struct dummy_mail_body *
+dummy_mail_body_new(const unsigned char *data, size_t size)
+{
+	struct dummy_mail_body *body;
+	const unsigned char *p;
+	size_t i;
+
+	body = i_malloc(sizeof(*body) + size);
+	body->refcount = 1;
+	body->size = size;
+	memcpy(body->data, data, size);
+
+	/* header ends at the first empty line */
+	body->hdr_size = size;
+	for (p = data; (p = memchr(p, '\n', data + size - p)) != NULL; ) {
+		p++;
+		if (p < data + size && *p == '\n') {
+			body->hdr_size = p + 1 - data;
+			break;
+		}
+		if (p + 1 < data + size && p[0] == '\r' && p[1] == '\n') {
+			body->hdr_size = p + 2 - data;
+			break;
+		}
+	}
+	for (i = body->hdr_size; i < size; i++) {
+		if (data[i] == '\n')
+			body->lines++;
+	}
+	return body;
+}
+
+void dummy_mail_body_unref(struct dummy_mail_body **_body)
+{
+	struct dummy_mail_body *body = *_body;
+
+	*_body = NULL;
+	i_assert(body->refcount > 0);
+	if (--body->refcount == 0)
+		i_free(body);
+}
+
+struct dummy_mail *
+dummy_mailbox_lookup_uid(struct dummy_mailbox *box, uint32_t uid)
+{
+	unsigned int idx;
+
+	if (!array_bsearch_insert_pos(&box->mails, &uid,
+				      dummy_mail_uid_cmp, &idx))
+		return NULL;
+	return array_idx_modifiable(&box->mails, idx);
+}
+
+struct dummy_mail *
+dummy_mailbox_add(struct dummy_mailbox *box, struct dummy_mail_body *body,
+		  enum mail_flags flags, uint32_t keywords, time_t received)
+{
+	struct dummy_mail *mail;
+
+	mail = array_append_space(&box->mails);
+	mail->uid = box->uidnext++;
+	mail->flags = flags & ~MAIL_RECENT;
+	mail->keywords = keywords;
+	mail->modseq = ++box->highest_modseq;
+	mail->received = received;
+	mail->body = body;
+	body->refcount++;
+	return mail;
+}
+
+void dummy_mailbox_expunge_uid(struct dummy_mailbox *box, uint32_t uid)
+{
+	struct dummy_mail *mail;
+
+	mail = dummy_mailbox_lookup_uid(box, uid);
+	if (mail == NULL)
+		return;
+
+	dummy_mail_body_unref(&mail->body);
+	array_delete(&box->mails, array_ptr_to_idx(&box->mails, mail), 1);
+	box->expunge_counter++;
+	box->highest_modseq++;
+}
+
+void dummy_mailbox_update_flags(struct dummy_mailbox *box,
+				struct dummy_mail *mail,
+				enum mail_flags flags, uint32_t keywords)
+{
+	flags &= ~MAIL_RECENT;
+	if (mail->flags == flags && mail->keywords == keywords)
+		return;
+	mail->flags = flags;
+	mail->keywords = keywords;
+	mail->modseq = ++box->highest_modseq;
+}
+
+uint32_t dummy_mailbox_keyword_get(struct dummy_mailbox *box,
+				   const char *name)
+{
+	char *const *keywords;
+	unsigned int i, count;
+
+	keywords = array_get(&box->keywords, &count);
+	for (i = 0; i < count; i++) {
+		if (strcasecmp(keywords[i], name) == 0)
+			return 1U << i;
+	}
+	if (count == DUMMY_MAX_KEYWORDS)
+		return 0;
+
+	char *keyword = i_strdup(name);
+	array_push_back(&box->keywords, &keyword);
+	return 1U << count;
+}
+
+const char *const *
+dummy_mailbox_keywords_get_names(struct dummy_mailbox *box, uint32_t keywords)
+{
+	ARRAY_TYPE(const_string) names;
+	char *const *all;
+	unsigned int i, count;
+
+	if (keywords == 0)
+		return NULL;
+
+	all = array_get(&box->keywords, &count);
+	t_array_init(&names, count + 1);
+	for (i = 0; i < count; i++) {
+		if ((keywords & (1U << i)) != 0) {
+			const char *name = all[i];
+			array_push_back(&names, &name);
+		}
+	}
+	array_append_zero(&names);
+	return array_front(&names);
+}
+
+void dummy_mailbox_changed(struct dummy_mailbox *box)
+{
+	struct dummy_imap_conn *const *conns;
+	unsigned int i, count;
+
+	/* the callbacks may not modify the array */
+	conns = array_get(&box->imap_conns, &count);
+	for (i = 0; i < count; i++)
+		dummy_imap_mailbox_changed(conns[i]);
+}
+
+void dummy_storage_init(void)
+{
+	hash_table_create(&dummy_users, default_pool, 0, str_hash, strcmp);
+	dummy_next_uidvalidity = ioloop_time;
+}
+
+void dummy_storage_deinit(void)
+{
+	struct hash_iterate_context *iter;
+	struct dummy_user *user;
+	char *username;
+
+	iter = hash_table_iterate_init(dummy_users);
+	while (hash_table_iterate(iter, dummy_users, &username, &user))
+		dummy_user_free(user);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&dummy_users);
+}
@@ -0,0 +1,170 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "settings.h"
+#include "errors.h"
+
+#include <stdio.h>
+
+#define ERROR_EXEMPLAR_COUNT 3
+/* how many error types are listed in the per-second summary */
+#define ERROR_INTERVAL_PRINT_TYPES 5
+
+struct error_type {
+	enum error_class eclass;
+	enum client_state state;
+	const char *fmt;
+
+	unsigned int total_count, interval_count;
+	char *exemplars[ERROR_EXEMPLAR_COUNT];
+	unsigned int exemplar_count;
+
+	/* errors_add() wants the next formatted error to be logged */
+	bool log_next:1;
+};
+
+static const char *const error_class_names[ERROR_CLASS_COUNT] = {
+	"input", "state", "warning", "checkpoint"
+};
+
+static ARRAY(struct error_type *) error_types;
+static time_t errors_log_secs;
+static unsigned int errors_logged_this_sec;
+static unsigned int errors_interval_skipped;
+
+static struct error_type *
+error_type_get(enum error_class eclass, enum client_state state,
+	       const char *fmt)
+{
+	struct error_type *type;
+
+	/* there are only a few dozen error formats, and the same format
+	   string pointer is given for each occurrence */
+	array_foreach_elem(&error_types, type) {
+		if (type->fmt == fmt && type->state == state &&
+		    type->eclass == eclass)
+			return type;
+	}
+
+	type = i_new(struct error_type, 1);
+	type->eclass = eclass;
+	type->state = state;
+	type->fmt = fmt;
+	array_append(&error_types, &type, 1);
+	return type;
+}
+
+struct error_type *
+errors_add(enum error_class eclass, enum client_state state, const char *fmt)
+{
+	struct error_type *type;
+
+	type = error_type_get(eclass, state, fmt);
+	type->total_count++;
+	type->interval_count++;
+
+	if (errors_log_secs != ioloop_time) {
+		errors_log_secs = ioloop_time;
+		errors_logged_this_sec = 0;
+	}
+	if (conf.error_log_rate == 0 ||
+	    errors_logged_this_sec < conf.error_log_rate) {
+		errors_logged_this_sec++;
+		type->log_next = TRUE;
+		return type;
+	}
+
+	errors_interval_skipped++;
+	if (type->exemplar_count < ERROR_EXEMPLAR_COUNT) {
+		/* not logged, but keep it for the final report */
+		type->log_next = FALSE;
+		return type;
+	}
+	return NULL;
+}
+
+void error_type_log(struct error_type *type, const char *msg)
+{
+	if (type->log_next)
+		i_error("%s", msg);
+	if (type->exemplar_count < ERROR_EXEMPLAR_COUNT)
+		type->exemplars[type->exemplar_count++] = i_strdup(msg);
+}
+
+static int error_type_cmp_interval(struct error_type *const *t1,
+				   struct error_type *const *t2)
+{
+	if ((*t1)->interval_count > (*t2)->interval_count)
+		return -1;
+	if ((*t1)->interval_count < (*t2)->interval_count)
+		return 1;
+	return 0;
+}
+
+void errors_print_interval(void)
+{
+	ARRAY(struct error_type *) sorted;
+	struct error_type *const *types;
+	unsigned int i, count, total = 0;
+
+	if (errors_interval_skipped > 0) {
+		t_array_init(&sorted, array_count(&error_types));
+		array_append_array(&sorted, &error_types);
+		array_sort(&sorted, error_type_cmp_interval);
+		types = array_get(&sorted, &count);
+		for (i = 0; i < count; i++)
+			total += types[i]->interval_count;
+
+		printf(" - %u errors, %u not logged:\n",
+		       total, errors_interval_skipped);
+		for (i = 0; i < count && i < ERROR_INTERVAL_PRINT_TYPES &&
+			    types[i]->interval_count > 0; i++) {
+			printf("   %6u %s %s: %s\n", types[i]->interval_count,
+			       error_class_names[types[i]->eclass],
+			       states[types[i]->state].name, types[i]->fmt);
+		}
+	}
+
+	types = array_get(&error_types, &count);
+	for (i = 0; i < count; i++)
+		types[i]->interval_count = 0;
+	errors_interval_skipped = 0;
+}
+
+void errors_print_total(void)
+{
+	struct error_type *type;
+	unsigned int i;
+
+	if (array_count(&error_types) == 0)
+		return;
+
+	printf("\nErrors:\n");
+	array_foreach_elem(&error_types, type) {
+		printf("%8u %s %s: %s\n", type->total_count,
+		       error_class_names[type->eclass],
+		       states[type->state].name, type->fmt);
+		for (i = 0; i < type->exemplar_count; i++)
+			printf("         - %s\n", type->exemplars[i]);
+	}
+}
+
+void errors_init(void)
+{
+	i_array_init(&error_types, 32);
+}
+
+void errors_deinit(void)
+{
+	struct error_type *type;
+	unsigned int i;
+
+	array_foreach_elem(&error_types, type) {
+		for (i = 0; i < type->exemplar_count; i++)
+			i_free(type->exemplars[i]);
+		i_free(type);
+	}
+	array_free(&error_types);
+}
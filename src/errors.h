@@ -0,0 +1,40 @@
+#ifndef ERRORS_H
+#define ERRORS_H
+
+#include "client-state.h"
+
+/* Error classification. Errors are counted by their class, the state the
+   connection was in and their type, which is the error's printf format
+   string. Only error_log_rate errors per second are logged in full, because
+   formatting and writing the same error for thousands of connections at once
+   would stall the ioloop. The rest are only counted and summarized in the
+   per-second output, and a few exemplars of each type are kept for the
+   final report. */
+
+enum error_class {
+	ERROR_CLASS_INPUT = 0,
+	ERROR_CLASS_STATE,
+	ERROR_CLASS_WARNING,
+	ERROR_CLASS_CHECKPOINT,
+
+	ERROR_CLASS_COUNT
+};
+
+struct error_type;
+
+/* Count an error. Returns the error's type if the caller should format the
+   error and give it to error_type_log(), NULL if it was only counted. */
+struct error_type *
+errors_add(enum error_class eclass, enum client_state state, const char *fmt);
+/* Log the formatted error and/or keep it as an exemplar. */
+void error_type_log(struct error_type *type, const char *msg);
+
+/* Print a summary of the errors that weren't logged during this interval
+   and start a new interval. */
+void errors_print_interval(void);
+void errors_print_total(void);
+
+void errors_init(void);
+void errors_deinit(void);
+
+#endif
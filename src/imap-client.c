@@ -2,10 +2,11 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
 #include "str.h"
-#include "write-full.h"
 #include "istream.h"
 #include "ostream.h"
+#include "time-util.h"
 #include "imap-seqset.h"
 #include "imap-arg.h"
 #include "imap-parser.h"
@@ -18,23 +19,71 @@
 #include "mailbox-state.h"
 #include "checkpoint.h"
 #include "profile.h"
+#include "errors.h"
+#include "rawlog.h"
+#include "replay.h"
+#include "stats.h"
 #include "test-exec.h"
 #include "imap-client.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 
+static void
+imap_client_count_input(struct imap_client *client, struct command *cmd)
+{
+	uoff_t offset = client->client.input->v_offset;
+	uoff_t bytes = offset - client->input_counted_offset;
+
+	if (bytes == 0)
+		return;
+	client->input_counted_offset = offset;
+	client->client.bytes_received += bytes;
+	stats_add_transfer(0, bytes);
+
+	if (cmd == NULL && array_count(&client->commands) > 0) {
+		/* untagged replies are counted for the oldest running
+		   command */
+		cmd = array_idx_elem(&client->commands, 0);
+	}
+	if (cmd == NULL) {
+		stats_add_other_bytes(0, bytes);
+		return;
+	}
+	cmd->bytes_received += bytes;
+	/* ioloop_timeval is when this input arrived. If the command was sent
+	   after it, the bytes are leftovers of an earlier reply. */
+	if (cmd->tv_first_byte.tv_sec == 0 &&
+	    timeval_cmp(&ioloop_timeval, &cmd->tv_start) >= 0)
+		cmd->tv_first_byte = ioloop_timeval;
+}
+
+static void
+imap_client_error(struct imap_client *client, enum error_class eclass,
+		  const char *fmt, va_list args)
+{
+	struct error_type *type;
+
+	type = errors_add(eclass, client->client.state, fmt);
+	if (type == NULL) {
+		/* rate limited - don't waste time formatting it */
+		return;
+	}
+	error_type_log(type, t_strdup_printf("%s[%u]: %s: %s",
+		client->client.user->username, client->client.global_id,
+		t_strdup_vprintf(fmt, args), client->cur_args == NULL ? "" :
+		imap_args_to_str(client->cur_args)));
+}
+
 int imap_client_input_error(struct imap_client *client, const char *fmt, ...)
 {
 	va_list va;
 
 	va_start(va, fmt);
-	i_error("%s[%u]: %s: %s", client->client.user->username,
-		client->client.global_id,
-		t_strdup_vprintf(fmt, va), client->cur_args == NULL ? "" :
-		imap_args_to_str(client->cur_args));
+	imap_client_error(client, ERROR_CLASS_INPUT, fmt, va);
 	va_end(va);
 
+	rawlog_client_error(&client->client);
 	client_disconnect(&client->client);
 	if (conf.error_quit)
 		lib_exit(2);
@@ -46,10 +95,7 @@ int imap_client_input_warn(struct imap_client *client, const char *fmt, ...)
 	va_list va;
 
 	va_start(va, fmt);
-	i_error("%s[%u]: %s: %s", client->client.user->username,
-		client->client.global_id,
-		t_strdup_vprintf(fmt, va), client->cur_args == NULL ? "" :
-		imap_args_to_str(client->cur_args));
+	imap_client_error(client, ERROR_CLASS_WARNING, fmt, va);
 	va_end(va);
 	return -1;
 }
@@ -59,12 +105,10 @@ int imap_client_state_error(struct imap_client *client, const char *fmt, ...)
 	va_list va;
 
 	va_start(va, fmt);
-	i_error("%s[%u]: %s: %s", client->client.user->username,
-		client->client.global_id,
-		t_strdup_vprintf(fmt, va), client->cur_args == NULL ? "" :
-		imap_args_to_str(client->cur_args));
+	imap_client_error(client, ERROR_CLASS_STATE, fmt, va);
 	va_end(va);
 
+	rawlog_client_error(&client->client);
 	if (conf.error_quit)
 		lib_exit(2);
 	return -1;
@@ -287,14 +331,14 @@ void imap_client_log_mailbox_view(struct imap_client *client)
 	unsigned int i, count, metadata_count;
 	string_t *str;
 
-	if (client->client.rawlog_fd == -1)
+	if (!rawlog_client_is_logged(&client->client))
 		return;
 	(void)o_stream_flush(client->client.output);
 
 	str = t_str_new(256);
 	str_printfa(str, "** view: highest_modseq=%llu\r\n",
 		    (unsigned long long)client->view->highest_modseq);
-	write_full(client->client.rawlog_fd, str_data(str), str_len(str));
+	rawlog_client_write(&client->client, str_data(str), str_len(str));
 
 	uidmap = array_get(&client->view->uidmap, &count);
 	metadata = array_get(&client->view->messages, &metadata_count);
@@ -310,9 +354,10 @@ void imap_client_log_mailbox_view(struct imap_client *client)
 		mailbox_view_keywords_write(client->view,
 					    metadata[i].keyword_bitmask, str);
 		str_append(str, ")\r\n");
-		write_full(client->client.rawlog_fd, str_data(str), str_len(str));
+		rawlog_client_write(&client->client, str_data(str),
+				    str_len(str));
 	}
-	write_full(client->client.rawlog_fd, "**\r\n", 4);
+	rawlog_client_write(&client->client, "**\r\n", 4);
 }
 
 void imap_client_mailbox_close(struct imap_client *client)
@@ -450,6 +495,7 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 	args++;
 
 	if (strcmp(tag, "+") == 0) {
+		imap_client_count_input(client, client->last_cmd);
 		if (client->last_cmd == NULL) {
 			return imap_client_input_error(client,
 				"Unexpected command continuation");
@@ -459,6 +505,7 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 		return 0;
 	}
 	if (strcmp(tag, "*") == 0) {
+		imap_client_count_input(client, NULL);
 		if (client->handle_untagged(client, args) < 0) {
 			return imap_client_input_error(client,
 						       "Invalid untagged input");
@@ -478,6 +525,7 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 		return imap_client_input_error(client,
 			"Unexpected tagged reply: %s", tag);
 	}
+	imap_client_count_input(client, cmd);
 
 	if (strcasecmp(tag_status, "OK") == 0)
 		reply = REPLY_OK;
@@ -522,6 +570,81 @@ static bool imap_client_skip_literal(struct imap_client *client)
 	}
 }
 
+static bool
+imap_client_literal_can_discard(struct imap_client *client,
+				const struct imap_arg *args)
+{
+	/* Without state tracking nobody looks at the FETCH literal contents,
+	   so they can be skipped straight from the input stream instead of
+	   having the parser buffer them first. The rest of the FETCH reply
+	   is still parsed and handled, e.g. profiles need its UID. Scripted
+	   tests always need the contents. */
+	if (!conf.no_tracking || client->test_exec_ctx != NULL)
+		return FALSE;
+	return imap_arg_atom_equals(&args[0], "*") &&
+		args[1].type == IMAP_ARG_ATOM &&
+		imap_arg_atom_equals(&args[2], "FETCH");
+}
+
+static unsigned int
+imap_arg_list_count_literal_sizes(const ARRAY_TYPE(imap_arg_list) *list)
+{
+	const struct imap_arg *args;
+	unsigned int i, count, literals = 0;
+
+	/* a list that is still being parsed has no EOL yet */
+	args = array_get(list, &count);
+	for (i = 0; i < count; i++) {
+		if (args[i].type == IMAP_ARG_LITERAL_SIZE ||
+		    args[i].type == IMAP_ARG_LITERAL_SIZE_NONSYNC)
+			literals++;
+		else if (args[i].type == IMAP_ARG_LIST) {
+			literals += imap_arg_list_count_literal_sizes(
+				&args[i]._data.list);
+		}
+	}
+	return literals;
+}
+
+static bool
+imap_client_literal_is_new(struct imap_client *client,
+			   const struct imap_arg *args)
+{
+	unsigned int literals = 0;
+
+	/* The skipped literals stay in the args as LITERAL_SIZE. Make sure
+	   the last one isn't returned again once the rest of the line has
+	   been parsed. */
+	for (; !IMAP_ARG_IS_EOL(args); args++) {
+		if (args->type == IMAP_ARG_LITERAL_SIZE ||
+		    args->type == IMAP_ARG_LITERAL_SIZE_NONSYNC)
+			literals++;
+		else if (args->type == IMAP_ARG_LIST) {
+			literals += imap_arg_list_count_literal_sizes(
+				&args->_data.list);
+		}
+	}
+	return literals > client->literals_skipped;
+}
+
+static bool imap_client_input_release_parser(struct imap_client *client)
+{
+	size_t size;
+
+	/* Idle connections without state tracking don't need to keep the
+	   parser around between responses. It's recreated when more input
+	   arrives. This must be called only at the end of a line. */
+	if (!conf.no_tracking || client->literal_left > 0)
+		return FALSE;
+	if (array_count(&client->commands) > 0 && !client->client.idling)
+		return FALSE;
+	(void)i_stream_get_data(client->client.input, &size);
+	if (size > 0)
+		return FALSE;
+	imap_parser_unref(&client->parser);
+	return TRUE;
+}
+
 static void imap_client_input(struct client *_client)
 {
 	struct imap_client *client = (struct imap_client *)_client;
@@ -539,6 +662,7 @@ static void imap_client_input(struct client *_client)
 		if (line == NULL)
 			return;
 		client->seen_banner = TRUE;
+		imap_client_count_input(client, NULL);
 
 		if (strncasecmp(line, "* PREAUTH ", 10) == 0) {
 			client->preauth = TRUE;
@@ -556,6 +680,10 @@ static void imap_client_input(struct client *_client)
 		}
 	}
 
+	if (client->parser == NULL) {
+		client->parser = imap_parser_create(_client->input, NULL,
+						    (size_t)-1);
+	}
 	while (imap_client_skip_literal(client)) {
 		ret = imap_parser_read_args(client->parser, 0,
 					    IMAP_PARSE_FLAG_LITERAL_SIZE |
@@ -577,21 +705,24 @@ static void imap_client_input(struct client *_client)
 			/* FIXME: we get here, but we shouldn't.. */
 		} else {
 			if (imap_parser_get_literal_size(client->parser,
-							 &literal_size)) {
-				if (literal_size <= MAX_INLINE_LITERAL_SIZE) {
+							 &literal_size) &&
+			    imap_client_literal_is_new(client, imap_args)) {
+				if (literal_size <= MAX_INLINE_LITERAL_SIZE &&
+				    !imap_client_literal_can_discard(client,
+								     imap_args)) {
 					/* read the literal */
 					imap_parser_read_last_literal(
 						client->parser);
 					continue;
 				}
-				/* literal too large. we still have to skip it
-				   though. */
+				/* literal too large or not needed. skip its
+				   contents and continue parsing the rest of
+				   the line. */
 				client->literal_left = literal_size;
+				client->literals_skipped++;
 				continue;
 			}
 
-			/* FIXME: we should call this for large
-			   literals too.. */
 			client->cur_args = imap_args;
 			T_BEGIN {
 				ret = imap_client_input_args(client, imap_args);
@@ -602,6 +733,7 @@ static void imap_client_input(struct client *_client)
 		if (client->literal_left == 0) {
 			/* end of command - skip CRLF */
 			imap_parser_reset(client->parser);
+			client->literals_skipped = 0;
 
 			data = i_stream_get_data(_client->input, &size);
 			if (size > 0 && data[0] == '\r') {
@@ -614,7 +746,12 @@ static void imap_client_input(struct client *_client)
 
 		if (ret < 0)
 			return;
+		if (client->literal_left == 0 &&
+		    imap_client_input_release_parser(client))
+			break;
 	}
+	/* skipped literals and CRLFs */
+	imap_client_count_input(client, NULL);
 }
 
 static int imap_client_output(struct client *_client)
@@ -628,11 +765,9 @@ static int imap_client_output(struct client *_client)
 	return 0;
 }
 
-static void imap_client_connected(struct client *_client)
+static void imap_client_connected(struct client *_client ATTR_UNUSED)
 {
-	struct imap_client *client = (struct imap_client *)_client;
-
-	client->parser = imap_parser_create(_client->input, NULL, (size_t)-1);
+	/* the parser is created lazily on the first input */
 }
 
 static void imap_client_logout(struct client *_client)
@@ -665,6 +800,9 @@ static void imap_client_free(struct client *_client)
 
 	if (client->qresync_select_cache != NULL)
 		mailbox_offline_cache_unref(&client->qresync_select_cache);
+	timeout_remove(&client->to_sync);
+	timeout_remove(&client->to_status);
+	timeout_remove(&client->to_replay);
 	if (client->test_exec_ctx != NULL) {
 		/* storage must be fully unreferenced before new test can
 		   begin. */
@@ -715,10 +853,14 @@ imap_client_new(unsigned int idx, struct user *user, struct user_client *uc)
 	if (strchr(conf.mailbox, '%') != NULL ||
 	    client->client.user_client != NULL)
 		client->try_create_mailbox = TRUE;
-	i_array_init(&client->commands, 16);
+	i_array_init(&client->commands, 4);
 
 	client->tag_counter = 1;
 	mailbox = user_get_new_mailbox(&client->client);
+	/* The view is needed also with no_tracking: its uidmap maps the
+	   sequences in EXISTS/EXPUNGE/FETCH replies and in the commands that
+	   are sent. The storage is shared by all the user's connections to
+	   the same mailbox. */
 	client->storage = mailbox_storage_get(user->mailbox_source,
 					      user->username, mailbox);
 	client->view = mailbox_view_new(client->storage);
@@ -729,5 +871,10 @@ imap_client_new(unsigned int idx, struct user *user, struct user_client *uc)
 	client->client.v.send_more_commands = user->profile != NULL ?
 		imap_client_profile_send_more_commands :
 		imap_client_plan_send_more_commands;
+	if (conf.replay != NULL && user->profile == NULL) {
+		client->replay_session = replay_get_next_session(conf.replay);
+		client->client.v.send_more_commands =
+			imap_client_replay_send_more_commands;
+	}
         return client;
 }
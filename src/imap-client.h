@@ -11,6 +11,8 @@ enum imap_capability {
 	CAP_CONDSTORE		= 0x04,
 	CAP_QRESYNC		= 0x08,
 	CAP_UIDPLUS		= 0x10,
+	CAP_LIST_STATUS		= 0x20,
+	CAP_NOTIFY		= 0x40,
 };
 
 struct imap_capability_name {
@@ -24,6 +26,8 @@ static const struct imap_capability_name cap_names[] = {
 	{ "CONDSTORE", CAP_CONDSTORE },
 	{ "QRESYNC", CAP_QRESYNC },
 	{ "UIDPLUS", CAP_UIDPLUS },
+	{ "LIST-STATUS", CAP_LIST_STATUS },
+	{ "NOTIFY", CAP_NOTIFY },
 
 	{ NULL, 0 }
 };
@@ -46,6 +50,8 @@ struct imap_client {
 	/* plan[0] contains always the next state we move to. */
 	enum client_state plan[STATE_COUNT];
 	unsigned int plan_size;
+	/* state of the last command sent by the plan */
+	enum client_state transition_prev_state;
 
 	/* LIST reply */
 	ARRAY(struct mailbox_list_entry) mailboxes_list;
@@ -53,6 +59,10 @@ struct imap_client {
 	const struct imap_arg *cur_args;
 	struct istream *append_stream;
 	uoff_t literal_left;
+	/* literals skipped from the current reply line */
+	unsigned int literals_skipped;
+	/* input offset up to which the bytes are counted */
+	uoff_t input_counted_offset;
 
 	struct search_context *search_ctx;
 	struct test_exec_context *test_exec_ctx;
@@ -75,6 +85,16 @@ struct imap_client {
 	int (*handle_untagged)(struct imap_client *, const struct imap_arg *);
 
 	unsigned int delay_timeout_ms;
+	/* profile_client imap_sync=poll */
+	struct timeout *to_sync;
+	/* profile_client imap_status_interval */
+	struct timeout *to_status;
+	/* replay=<path> session, the index of its next command and when the
+	   session started */
+	const struct replay_session *replay_session;
+	unsigned int replay_idx;
+	long long replay_start_msecs;
+	struct timeout *to_replay;
 
 	bool seen_banner:1;
 	bool append_unfinished:1;
@@ -87,6 +107,8 @@ struct imap_client {
 	bool idle_done_sent:1;
 	bool preauth:1;
 	bool uid_fetch_performed:1;
+	bool profile_sync_enabled:1;
+	bool profile_synced:1;
 };
 
 static inline struct imap_client *imap_client(struct client *client)
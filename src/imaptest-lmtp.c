@@ -85,7 +85,7 @@ imaptest_lmtp_data_callback(const struct smtp_reply *reply,
 			smtp_reply_log(reply));
 	} else {
 		counters[STATE_LMTP]++;
-		client_state_add_to_timer(STATE_LMTP, &d->tv_start);
+		client_state_add_to_timer(NULL, STATE_LMTP, &d->tv_start);
 	}
 }
 
@@ -18,10 +18,19 @@
 #include "imap-client.h"
 #include "user.h"
 #include "profile.h"
+#include "rawlog.h"
+#include "replay.h"
+#include "saturation.h"
 #include "checkpoint.h"
 #include "commands.h"
+#include "errors.h"
 #include "test-exec.h"
 #include "imaptest-lmtp.h"
+#include "selfmon.h"
+#include "stats.h"
+#include "transitions.h"
+#include "userfile.h"
+#include "workload.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,8 +44,15 @@ static struct ioloop *ioloop;
 static int return_value = 0;
 static time_t next_checkpoint_time;
 static struct ostream *results_output = NULL;
+static struct ostream *profile_output = NULL;
+static struct ostream *summary_output = NULL;
 static struct timeout *to_stop;
 static unsigned int final_wait_secs;
+static struct timeout *to_warmup;
+static unsigned int warmup_secs, duration_secs, cooldown_secs;
+static struct saturation *saturation = NULL;
+
+static void timeout_stop(void *context);
 
 #define STATE_IS_VISIBLE(state) \
 	(states[i].probability != 0)
@@ -52,11 +68,14 @@ static void print_results_header(void)
 		str_printfa(str, "\t%s count\t%s msecs",
 			    states[i].name, states[i].name);
 	}
+	str_append(str, "\tin bytes\tout bytes");
+	str_append(str, "\timaptest cpu%\timaptest lag msecs");
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
 }
 
-static void print_results(void)
+static void print_results(const struct selfmon_interval *selfmon,
+			  uint64_t bytes_received, uint64_t bytes_sent)
 {
 	string_t *str = t_str_new(128);
 	unsigned int i;
@@ -69,6 +88,9 @@ static void print_results(void)
 		timers[i] = 0;
 		timer_counts[i] = 0;
 	}
+	str_printfa(str, "\t%"PRIu64"\t%"PRIu64, bytes_received, bytes_sent);
+	str_printfa(str, "\t%u\t%u", selfmon->cpu_percent,
+		    selfmon->max_lag_msecs);
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
 }
@@ -149,20 +171,32 @@ static void print_stalled_imap_client(string_t *str, struct imap_client *client)
 static void print_timeout(void *context ATTR_UNUSED)
 {
 #define CLIENT_STALLED_SECS(c) \
-	(((c)->to != NULL || (c)->idling) ? 0 : \
+	(((c)->to != NULL || (c)->idling || (c)->sync_waiting) ? 0 : \
 	 (ioloop_time - (c)->last_io))
 	struct client *const *c;
+	struct selfmon_interval selfmon;
+	struct profile_load_stats load;
 	string_t *str;
         static int rowcount = 0;
 	unsigned int i, count, banner_waits, stall_count;
+	unsigned int logins, deliveries;
+	uint64_t bytes_sent, bytes_received;
+	bool have_load;
 
+	selfmon_interval_next(&selfmon);
+	stats_interval_bytes_next(&bytes_sent, &bytes_received);
 	if (results_output != NULL)
-		print_results();
+		print_results(&selfmon, bytes_received, bytes_sent);
 	if ((rowcount++ % 10) == 0) {
 		if (rowcount > 1 && results_output == NULL) print_timers();
 		print_header();
 	}
 
+	have_load = profile_load_stats_next(&load);
+	logins = counters[STATE_LOGIN] + counters[STATE_AUTHENTICATE];
+	deliveries = counters[STATE_LMTP];
+
+	stats_flush_counters();
         for (i = 1; i < STATE_COUNT; i++) {
 		if (!STATE_IS_VISIBLE(i))
 			continue;
@@ -170,6 +204,7 @@ static void print_timeout(void *context ATTR_UNUSED)
 		total_counters[i] += counters[i];
 		counters[i] = 0;
         }
+	stats_counters_reset();
 
 	stalled = FALSE;
 	banner_waits = 0;
@@ -191,6 +226,13 @@ static void print_timeout(void *context ATTR_UNUSED)
 			client_disconnect(c[i]);
         }
 
+	if (saturation != NULL && !disconnect_clients &&
+	    saturation_interval(saturation, stall_count, selfmon.saturated)) {
+		/* search finished, log out the clients */
+		final_wait_secs = cooldown_secs;
+		to_stop = timeout_add(0, timeout_stop, NULL);
+	}
+
 	printf("%3d/%3d", (clients_count - banner_waits), clients_count);
 	if (stall_count > 0)
 		printf(" (%u stalled >%us)", stall_count, SHORT_STALL_PRINT_SECS);
@@ -199,6 +241,23 @@ static void print_timeout(void *context ATTR_UNUSED)
 		printf(" [%d%%]", array_count(&clients) * 100 /
 		       conf.clients_count);
 	}
+	if (bytes_received > 0 || bytes_sent > 0) {
+		printf(" [in %.1f MB/s, out %.1f MB/s]",
+		       bytes_received / (1024.0*1024), bytes_sent / (1024.0*1024));
+	}
+	if (have_load) {
+		/* achieved/target - when the server can't keep up, the
+		   achieved counts fall behind */
+		printf(" [load %u%%: logins %u/%u, deliveries %u/%u]",
+		       load.target_percentage, logins, load.target_logins,
+		       deliveries, load.target_deliveries);
+	}
+	if (selfmon.saturated) {
+		/* latencies measured during this interval include our
+		   own delays */
+		printf(" [imaptest saturated: CPU %u%%, lag %u ms]",
+		       selfmon.cpu_percent, selfmon.max_lag_msecs);
+	}
 
 #define LONG_STALL_PRINT_SECS 15
 	printf("\n");
@@ -221,6 +280,7 @@ static void print_timeout(void *context ATTR_UNUSED)
                         printf("%s\n", str_c(str));
                 }
 	}
+	errors_print_interval();
 
 	if (ioloop_time >= next_checkpoint_time &&
 	    conf.checkpoint_interval > 0) {
@@ -236,22 +296,265 @@ static void print_timeout(void *context ATTR_UNUSED)
 	}
 }
 
+static void print_phase_counters(enum stats_phase phase)
+{
+	unsigned int i;
+
+        for (i = 1; i < STATE_COUNT; i++) {
+		if (!STATE_IS_VISIBLE(i))
+			continue;
+		printf("%4d ", stats_get_count(phase, i));
+	}
+}
+
+static void print_latency_header(const char *title)
+{
+	printf("\n%-12s %8s %8s %8s %8s %8s %8s %8s\n", title,
+	       "count", "avg", "p50", "p90", "p99", "p99.9", "max");
+}
+
+static void print_latency(const char *name, const struct stats_latency *latency)
+{
+	printf("%-12s %8u %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+	       name, latency->count,
+	       latency->avg / 1000.0, latency->p50 / 1000.0,
+	       latency->p90 / 1000.0, latency->p99 / 1000.0,
+	       latency->p999 / 1000.0, latency->max / 1000.0);
+}
+
+static void print_latencies(enum stats_phase phase)
+{
+	struct stats_latency latency;
+	unsigned int i;
+
+	print_latency_header("Latency (ms)");
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (!STATE_IS_VISIBLE(i))
+			continue;
+		stats_get_latency(phase, i, &latency);
+		if (latency.count == 0)
+			continue;
+		print_latency(states[i].name, &latency);
+	}
+}
+
+static void print_ttfbs(enum stats_phase phase)
+{
+	struct stats_latency latency;
+	unsigned int i;
+
+	/* time from sending the command to the first byte of its reply.
+	   If it's close to the latency, the server was slow to start
+	   replying, otherwise it was slow to send the reply. */
+	print_latency_header("TTFB (ms)");
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (!STATE_IS_VISIBLE(i))
+			continue;
+		stats_get_ttfb(phase, i, &latency);
+		if (latency.count == 0)
+			continue;
+		print_latency(states[i].name, &latency);
+	}
+}
+
+static void print_bytes_line(const char *name, const struct stats_bytes *bytes,
+			     unsigned int secs)
+{
+	printf("%-12s %8u %10.0f %10.0f %10.1f %10.1f %10.2f %10.2f\n",
+	       name, bytes->commands,
+	       bytes->commands == 0 ? 0.0 :
+	       (double)bytes->sent / bytes->commands,
+	       bytes->commands == 0 ? 0.0 :
+	       (double)bytes->received / bytes->commands,
+	       bytes->sent / (1024.0*1024), bytes->received / (1024.0*1024),
+	       secs == 0 ? 0.0 : bytes->sent / (1024.0*1024) / secs,
+	       secs == 0 ? 0.0 : bytes->received / (1024.0*1024) / secs);
+}
+
+static void print_bytes(enum stats_phase phase)
+{
+	struct stats_bytes bytes;
+	struct stats_connection_bytes conn;
+	unsigned int i, secs = stats_get_phase_secs(phase);
+	bool have_bytes = FALSE;
+
+	for (i = 1; i < STATE_COUNT; i++) {
+		stats_get_bytes(phase, i, &bytes);
+		if (bytes.commands == 0)
+			continue;
+		if (!have_bytes) {
+			printf("\n%-12s %8s %10s %10s %10s %10s %10s %10s\n",
+			       "Bytes", "count", "out/cmd", "in/cmd",
+			       "out MB", "in MB", "out MB/s", "in MB/s");
+			have_bytes = TRUE;
+		}
+		print_bytes_line(states[i].name, &bytes, secs);
+	}
+	if (!have_bytes)
+		return;
+	stats_get_other_bytes(phase, &bytes);
+	if (bytes.sent > 0 || bytes.received > 0)
+		print_bytes_line("(other)", &bytes, secs);
+
+	stats_get_connection_bytes(&conn);
+	if (conn.count > 0) {
+		printf("Per connection: %.0f bytes out, %.0f bytes in on average, "
+		       "max %"PRIu64" out, %"PRIu64" in (%u connections)\n",
+		       (double)conn.sent / conn.count,
+		       (double)conn.received / conn.count,
+		       conn.max_sent, conn.max_received, conn.count);
+	}
+}
+
+static void print_group_latencies(void)
+{
+	struct stats_latency latency;
+	unsigned int group, group_count = stats_get_group_count();
+	unsigned int i;
+
+	for (group = 0; group < group_count; group++) {
+		printf("\n%s:", stats_get_group_name(group));
+		print_latency_header("Latency (ms)");
+		for (i = 1; i < STATE_COUNT; i++) {
+			stats_get_group_latency(group, i, &latency);
+			if (latency.count == 0)
+				continue;
+			print_latency(states[i].name, &latency);
+		}
+	}
+}
+
+static void print_pipeline_depths(void)
+{
+	unsigned long long usecs;
+	unsigned int depth, commands, max_depth;
+
+	max_depth = stats_get_pipeline_max_depth();
+	if (max_depth <= 1)
+		return;
+
+	printf("\nPipeline depth:\n");
+	printf("%5s %10s %10s %14s\n", "depth", "conn secs", "cmds",
+	       "cmds/sec/conn");
+	for (depth = 1; depth <= max_depth; depth++) {
+		stats_get_pipeline_depth(depth, &usecs, &commands);
+		if (usecs == 0)
+			continue;
+		printf("%5u %10.1f %10u %14.1f\n", depth, usecs / 1000000.0,
+		       commands, commands * 1000000.0 / usecs);
+	}
+}
+
+static void print_profile_output(void)
+{
+	struct stats_latency latency;
+	unsigned int group, group_count = stats_get_group_count();
+	unsigned int i;
+	string_t *str = t_str_new(256);
+
+	str_append(str, "profile\tstate\tcount\tavg msecs\tp50 msecs"
+		   "\tp90 msecs\tp99 msecs\tp99.9 msecs\tmax msecs\n");
+	for (group = 0; group < group_count; group++) {
+		for (i = 1; i < STATE_COUNT; i++) {
+			stats_get_group_latency(group, i, &latency);
+			if (latency.count == 0)
+				continue;
+			str_printfa(str, "%s\t%s\t%u\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+				    stats_get_group_name(group),
+				    states[i].name, latency.count,
+				    latency.avg / 1000.0, latency.p50 / 1000.0,
+				    latency.p90 / 1000.0, latency.p99 / 1000.0,
+				    latency.p999 / 1000.0, latency.max / 1000.0);
+		}
+	}
+	o_stream_nsend(profile_output, str_data(str), str_len(str));
+}
+
+static void print_summary_output(void)
+{
+	struct stats_latency latency, ttfb;
+	struct stats_bytes bytes;
+	unsigned int i, secs = stats_get_phase_secs(STATS_PHASE_STEADY);
+	string_t *str = t_str_new(256);
+
+	str_append(str, "state\tsecs\tcount\tcmds/sec\tavg msecs"
+		   "\tp50 msecs\tp90 msecs\tp99 msecs\tp99.9 msecs"
+		   "\tmax msecs\tout bytes/cmd\tin bytes/cmd"
+		   "\tttfb p50 msecs\tttfb p99 msecs\n");
+	for (i = 1; i < STATE_COUNT; i++) {
+		stats_get_latency(STATS_PHASE_STEADY, i, &latency);
+		if (latency.count == 0)
+			continue;
+		stats_get_bytes(STATS_PHASE_STEADY, i, &bytes);
+		stats_get_ttfb(STATS_PHASE_STEADY, i, &ttfb);
+		str_printfa(str, "%s\t%u\t%u\t%.2f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.0f\t%.0f\t%.1f\t%.1f\n",
+			    states[i].name, secs, latency.count,
+			    secs == 0 ? 0.0 : (double)latency.count / secs,
+			    latency.avg / 1000.0, latency.p50 / 1000.0,
+			    latency.p90 / 1000.0, latency.p99 / 1000.0,
+			    latency.p999 / 1000.0, latency.max / 1000.0,
+			    bytes.commands == 0 ? 0.0 :
+			    (double)bytes.sent / bytes.commands,
+			    bytes.commands == 0 ? 0.0 :
+			    (double)bytes.received / bytes.commands,
+			    ttfb.p50 / 1000.0, ttfb.p99 / 1000.0);
+	}
+	o_stream_nsend(summary_output, str_data(str), str_len(str));
+}
+
 static void print_total(void)
 {
 	unsigned int i;
 
+	stats_flush_counters();
 	print_timers();
-	printf("\nTotals:\n");
+	if (!stats_phases_enabled)
+		printf("\nTotals:\n");
+	else {
+		printf("\nTotals (%s, %u secs):\n",
+		       stats_phase_names[STATS_PHASE_STEADY],
+		       stats_get_phase_secs(STATS_PHASE_STEADY));
+	}
 	print_header();
 
-        for (i = 1; i < STATE_COUNT; i++) {
-		if (!STATE_IS_VISIBLE(i))
-			continue;
+	if (!stats_phases_enabled) {
+		for (i = 1; i < STATE_COUNT; i++) {
+			if (!STATE_IS_VISIBLE(i))
+				continue;
 
-		total_counters[i] += counters[i];
-		printf("%4d ", total_counters[i]);
+			total_counters[i] += counters[i];
+			printf("%4d ", total_counters[i]);
+		}
+	} else {
+		/* only the steady state is used for the headline numbers,
+		   the other phases are shown separately */
+		print_phase_counters(STATS_PHASE_STEADY);
+		printf("\n");
+		print_phase_counters(STATS_PHASE_WARMUP);
+		printf(" (%s, %u secs)\n", stats_phase_names[STATS_PHASE_WARMUP],
+		       stats_get_phase_secs(STATS_PHASE_WARMUP));
+		print_phase_counters(STATS_PHASE_COOLDOWN);
+		printf(" (%s, %u secs)", stats_phase_names[STATS_PHASE_COOLDOWN],
+		       stats_get_phase_secs(STATS_PHASE_COOLDOWN));
 	}
 	printf("\n");
+	print_latencies(STATS_PHASE_STEADY);
+	print_ttfbs(STATS_PHASE_STEADY);
+	print_bytes(STATS_PHASE_STEADY);
+	print_group_latencies();
+	print_pipeline_depths();
+	if (conf.transitions != NULL)
+		transitions_print_total(conf.transitions);
+	if (conf.replay != NULL)
+		replay_print_total(conf.replay);
+	errors_print_total();
+	if (saturation != NULL)
+		saturation_print_total(saturation);
+	if (profile_output != NULL)
+		print_profile_output();
+	if (summary_output != NULL)
+		print_summary_output();
+	selfmon_print_total();
 }
 
 static void fix_probabilities(void)
@@ -260,12 +563,36 @@ static void fix_probabilities(void)
 
 	if (states[STATE_IDLE].probability > 0)
 		i_fatal("idle isn't currently supported with stress testing");
+	/* profiles set these only to show them in the stats */
+	if (!profile_running &&
+	    (states[STATE_ENABLE].probability > 0 ||
+	     states[STATE_NOTIFY].probability > 0))
+		i_fatal("enable and notify are only supported with profiles");
+	if (!profile_running && states[STATE_LIST_STATUS].probability > 0)
+		i_fatal("list-status is only supported with profiles");
 	if (conf.copy_dest == NULL)
 		states[STATE_COPY].probability = 0;
 	if (conf.checkpoint_interval == 0)
 		states[STATE_CHECKPOINT].probability = 0;
 	else
 		states[STATE_CHECKPOINT].probability = 100;
+	if (conf.transitions != NULL) {
+		/* the transitions decide how often the states are used, but
+		   keep them visible in the stats */
+		for (i = STATE_LIST; i <= STATE_LOGOUT; i++) {
+			if (states[i].probability == 0 &&
+			    (i != STATE_COPY || conf.copy_dest != NULL) &&
+			    transitions_have_target(conf.transitions, i))
+				states[i].probability = 100;
+		}
+	}
+	if (conf.replay != NULL) {
+		/* show the latencies of the replayed commands */
+		for (i = STATE_LIST; i <= STATE_LOGOUT; i++) {
+			if (replay_have_state(conf.replay, i))
+				states[i].probability = 100;
+		}
+	}
 
 	if (conf.master_user != NULL) {
 		states[STATE_AUTHENTICATE].probability = 100;
@@ -303,6 +630,7 @@ static void sig_die(const siginfo_t *si ATTR_UNUSED, void *context ATTR_UNUSED)
 			io_loop_stop(ioloop);
 		}
 		disconnect_clients = TRUE;
+		stats_set_phase(STATS_PHASE_COOLDOWN);
 	} else {
 		/* second time, die now */
 		i_info("Received second SIGINT - stopping immediately");
@@ -317,6 +645,7 @@ static void timeout_stop(void *context)
 		io_loop_stop(ioloop);
 	else if (!disconnect_clients) {
 		disconnect_clients = TRUE;
+		stats_set_phase(STATS_PHASE_COOLDOWN);
 		timeout_remove(&to_stop);
 		to_stop = timeout_add(final_wait_secs * 1000,
 				      timeout_stop, context);
@@ -326,16 +655,10 @@ static void timeout_stop(void *context)
 	}
 }
 
-static struct state *state_find(const char *name)
+static void timeout_warmup_end(void *context ATTR_UNUSED)
 {
-	unsigned int i;
-
-	for (i = 0; i < STATE_COUNT; i++) {
-		if (strcasecmp(states[i].name, name) == 0 ||
-		    strcasecmp(states[i].short_name, name) == 0)
-			return &states[i];
-	}
-	return NULL;
+	timeout_remove(&to_warmup);
+	stats_set_phase(STATS_PHASE_STEADY);
 }
 
 static void clients_unref(void)
@@ -352,10 +675,7 @@ static void clients_unref(void)
 
 static struct mailbox_source *imaptest_mailbox_source(void)
 {
-	struct state *state;
-
-	state = state_find("APPEND");
-	if (state->probability == 0) {
+	if (states[STATE_APPEND].probability == 0) {
 		/* we're not going to append anything, don't give an error
 		   if mbox_path doesn't exist. */
 		return mailbox_source_new_random(0);
@@ -372,6 +692,18 @@ static void imaptest_run(void)
 	unsigned int i;
 
 	next_checkpoint_time = ioloop_time + conf.checkpoint_interval;
+	selfmon_init();
+	if (warmup_secs > 0) {
+		to_warmup = timeout_add(warmup_secs * 1000,
+					timeout_warmup_end, NULL);
+	} else {
+		stats_set_phase(STATS_PHASE_STEADY);
+	}
+	if (duration_secs > 0) {
+		final_wait_secs = cooldown_secs;
+		to_stop = timeout_add((warmup_secs + duration_secs) * 1000,
+				      timeout_stop, NULL);
+	}
 	to = timeout_add(1000, print_timeout, NULL);
 	if (!profile_running) {
 		for (i = 0; i < INIT_CLIENT_COUNT && i < conf.clients_count; i++)
@@ -381,6 +713,9 @@ static void imaptest_run(void)
         io_loop_run(ioloop);
 
 	timeout_remove(&to);
+	if (to_warmup != NULL)
+		timeout_remove(&to_warmup);
+	selfmon_deinit();
 	clients_unref();
 
 	print_total();
@@ -406,42 +741,29 @@ static void imaptest_run_tests(const char *path)
 	test_parser_deinit(&test_parser);
 }
 
-static void conf_read_usernames(const char *path)
-{
-	struct istream *input;
-	int fd;
-	const char *line;
-
-	i_array_init(&conf.usernames, 32);
-	fd = open(path, O_RDONLY);
-	if (fd == -1)
-		i_fatal("open(%s) failed: %m", path);
-	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
-	i_stream_set_return_partial_line(input, TRUE);
-	while ((line = i_stream_read_next_line(input)) != NULL) {
-		if (*line != '\0' && *line != ':') {
-			line = i_strdup(line);
-			array_append(&conf.usernames, &line, 1);
-		}
-	}
-	i_stream_destroy(&input);
-
-	if (array_count(&conf.usernames) == 0)
-		i_fatal("No usernames in file %s", path);
-}
-
 static void print_help(void)
 {
 	printf(
 "imaptest [user=USER] [users=RANGE] [domains=RANGE] [userfile=FILE]\n"
+"         [userfile_compile=BINFILE]\n"
 "         [master=USER] [pass=PASSWORD] [mech=MECH] [seed=SEED]\n"
 "         [host=HOST] [port=PORT] [mbox=MBOX] [clients=CC] [msgs=NMSG]\n"
 "         [box=MAILBOX] [copybox=DESTBOX] [-] [<state>[=<n%%>[,<m%%>]]]\n"
 "         [random] [no_pipelining] [no_tracking] [checkpoint=<secs>]\n"
+"         [error_quit] [error_log_rate=<n>]\n"
+"         [pipeline_depth=<n>|adaptive[:<max>]] [workload=<path>]\n"
+"         [transitions=<path>] [replay=<path>]\n"
+"         [rawlog] [rawlog_shared=<path> [rawlog_on_error]] [rawlog_sample=<n%%>]\n"
+"         [warmup=<secs>] [duration=<secs>] [cooldown=<secs>]\n"
+"         [saturation=<min>-<max> [saturation_step=<secs>]\n"
+"          [slo=<state>:p<n>:<msecs>[,...]]]\n"
+"         [profile=<path> [time_scale=<factor>] [profile_output=<path>]]\n"
+"         [output=<path>] [summary_output=<path>]\n"
 "\n"
 " USER = username (and domain) template, e.g. \"u%%04d\" or \"u%%04d@d%%04d\"\n"
 " RANGE = range for templated usernames [1-%u] or domain names [1-%u]\n"
 " FILE = file of username:passwd pairs (instead of user/users/domains)\n"
+" BINFILE = write FILE in binary format to BINFILE for faster loading\n"
 " MBOX = path to mbox from which we read mails to append.\n"
 " MAILBOX = Mailbox name where to do all the work (default = INBOX).\n"
 " DESTBOX = Mailbox name where to copy messages.\n"
@@ -520,9 +842,12 @@ bool username_format_is_valid(const char *s, const char **error_r)
 int main(int argc ATTR_UNUSED, char *argv[])
 {
 	struct state *state;
+	enum client_state state_idx;
 	struct profile *profile = NULL;
 	const char *error, *key, *value, *testpath = NULL;
-	unsigned int i;
+	const char *userfile_compile_path = NULL;
+	const char *saturation_range = NULL, *slos = NULL;
+	unsigned int i, saturation_step_secs = 0;
 	int ret, fd;
 
 	lib_init();
@@ -544,7 +869,12 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	conf.domains_rand_start = 1;
 	conf.domains_rand_count = DOMAIN_RAND;
 	conf.mech = "LOGIN";
+	conf.time_scale = 1;
+	conf.rawlog_sample_percent = 100;
+	conf.error_log_rate = 10;
+	conf.pipeline_depth = MAX_COMMAND_QUEUE_LEN;
 	to_stop = NULL;
+	cooldown_secs = 30;
 
 	for (argv++; *argv != NULL; argv++) {
 		value = strchr(*argv, '=');
@@ -571,6 +901,25 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			to_stop = timeout_add(secs * 1000, timeout_stop, NULL);
 			continue;
 		}
+		if (strcmp(key, "warmup") == 0) {
+			if (str_to_uint(value, &warmup_secs) < 0)
+				i_fatal("Invalid warmup: %s", value);
+			stats_phases_enabled = TRUE;
+			continue;
+		}
+		if (strcmp(key, "duration") == 0) {
+			if (str_to_uint(value, &duration_secs) < 0 ||
+			    duration_secs == 0)
+				i_fatal("Invalid duration: %s", value);
+			stats_phases_enabled = TRUE;
+			continue;
+		}
+		if (strcmp(key, "cooldown") == 0) {
+			if (str_to_uint(value, &cooldown_secs) < 0)
+				i_fatal("Invalid cooldown: %s", value);
+			stats_phases_enabled = TRUE;
+			continue;
+		}
 		if (strcmp(key, "seed") == 0) {
 			srand(atoi(value));
 			continue;
@@ -584,11 +933,11 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			continue;
 		}
 
-		state = state_find(key);
-		if (state != NULL) {
+		if (state_find(key, &state_idx)) {
 			/* [<probability>[,<probability_again>]] */
 			const char *p;
 
+			state = &states[state_idx];
 			if (value == NULL) {
 				state->probability = 100;
 				continue;
@@ -627,6 +976,10 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.rawlog = TRUE;
 			continue;
 		}
+		if (strcmp(*argv, "rawlog_on_error") == 0) {
+			conf.rawlog_on_error = TRUE;
+			continue;
+		}
 		if (strcmp(*argv, "own_msgs") == 0) {
 			conf.own_msgs = TRUE;
 			continue;
@@ -694,6 +1047,27 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.checkpoint_interval = atoi(value);
 			continue;
 		}
+		/* saturation=<min>-<max> */
+		if (strcmp(key, "saturation") == 0) {
+			saturation_range = value;
+			continue;
+		}
+		if (strcmp(key, "saturation_step") == 0) {
+			if (str_to_uint(value, &saturation_step_secs) < 0)
+				i_fatal("Invalid saturation_step: %s", value);
+			continue;
+		}
+		/* slo=<state>:p<n>:<msecs>[,...] */
+		if (strcmp(key, "slo") == 0) {
+			slos = value;
+			continue;
+		}
+		/* error_log_rate=<n> */
+		if (strcmp(key, "error_log_rate") == 0) {
+			if (str_to_uint(value, &conf.error_log_rate) < 0)
+				i_fatal("Invalid error_log_rate: %s", value);
+			continue;
+		}
 		/* stalled_disconnect_timeout=secs */
 		if (strcmp(key, "stalled_disconnect_timeout") == 0) {
 			conf.stalled_disconnect_timeout = atoi(value);
@@ -710,6 +1084,47 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			testpath = value;
 			continue;
 		}
+		/* pipeline_depth=n|adaptive[:max] */
+		if (strcmp(key, "pipeline_depth") == 0) {
+			if (str_begins(value, "adaptive", &value)) {
+				conf.pipeline_adaptive = TRUE;
+				conf.pipeline_depth = PIPELINE_ADAPTIVE_MAX_DEPTH;
+				if (*value == ':')
+					value++;
+				else if (*value == '\0')
+					continue;
+			}
+			if (str_to_uint(value, &conf.pipeline_depth) < 0 ||
+			    conf.pipeline_depth == 0)
+				i_fatal("Invalid pipeline_depth: %s", *argv);
+			continue;
+		}
+		/* time_scale=factor */
+		if (strcmp(key, "time_scale") == 0) {
+			char *end;
+
+			conf.time_scale = strtod(value, &end);
+			if (*end != '\0' || !(conf.time_scale > 0))
+				i_fatal("Invalid time_scale: %s", value);
+			continue;
+		}
+		/* rawlog_shared=path */
+		if (strcmp(key, "rawlog_shared") == 0) {
+			conf.rawlog_shared_path = value;
+			continue;
+		}
+		/* rawlog_sample=<n>% */
+		if (strcmp(key, "rawlog_sample") == 0) {
+			char *end;
+
+			conf.rawlog_sample_percent = strtod(value, &end);
+			if (*end == '%')
+				end++;
+			if (*end != '\0' || !(conf.rawlog_sample_percent > 0) ||
+			    conf.rawlog_sample_percent > 100)
+				i_fatal("Invalid rawlog_sample: %s", value);
+			continue;
+		}
 		/* profile=path */
 		if (strcmp(key, "profile") == 0) {
 			profile = profile_parse(value);
@@ -733,7 +1148,31 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			continue;
 		}
 		if (strcmp(key, "userfile") == 0) {
-			conf_read_usernames(value);
+			if (conf.userfile != NULL)
+				userfile_close(&conf.userfile);
+			conf.userfile = userfile_open(value);
+			continue;
+		}
+		if (strcmp(key, "userfile_compile") == 0) {
+			userfile_compile_path = value;
+			continue;
+		}
+		if (strcmp(key, "replay") == 0) {
+			if (conf.replay != NULL)
+				replay_deinit(&conf.replay);
+			conf.replay = replay_parse(value);
+			continue;
+		}
+		if (strcmp(key, "transitions") == 0) {
+			if (conf.transitions != NULL)
+				transitions_deinit(&conf.transitions);
+			conf.transitions = transitions_parse(value);
+			continue;
+		}
+		if (strcmp(key, "workload") == 0) {
+			if (conf.workload != NULL)
+				workload_deinit(&conf.workload);
+			conf.workload = workload_parse(value);
 			continue;
 		}
 		if (strcmp(key, "master") == 0) {
@@ -755,6 +1194,20 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			results_output = o_stream_create_fd_file_autoclose(&fd, 0);
 			continue;
 		}
+		if (strcmp(key, "profile_output") == 0) {
+			fd = creat(value, 0600);
+			if (fd == -1)
+				i_fatal("creat(%s) failed: %m", value);
+			profile_output = o_stream_create_fd_file_autoclose(&fd, 0);
+			continue;
+		}
+		if (strcmp(key, "summary_output") == 0) {
+			fd = creat(value, 0600);
+			if (fd == -1)
+				i_fatal("creat(%s) failed: %m", value);
+			summary_output = o_stream_create_fd_file_autoclose(&fd, 0);
+			continue;
+		}
 		if (strcmp(key, "ssl") == 0) {
 			conf.ssl = TRUE;
 			if (value == NULL)
@@ -768,6 +1221,21 @@ int main(int argc ATTR_UNUSED, char *argv[])
 
 		i_fatal("Unknown arg: %s", *argv);
 	}
+	if (userfile_compile_path != NULL) {
+		if (conf.userfile == NULL)
+			i_fatal("userfile_compile requires userfile");
+		if (userfile_write_binary(conf.userfile, userfile_compile_path,
+					  &error) < 0)
+			i_fatal("%s", error);
+		printf("Wrote %u users to %s\n",
+		       userfile_get_count(conf.userfile),
+		       userfile_compile_path);
+		userfile_close(&conf.userfile);
+		lib_signals_deinit();
+		io_loop_destroy(&ioloop);
+		lib_deinit();
+		return 0;
+	}
 	if (conf.mailbox == NULL)
 		conf.mailbox = testpath == NULL ? "INBOX" : "imaptest";
 
@@ -775,6 +1243,36 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		i_fatal("Missing username");
 	if (testpath != NULL && strchr(conf.username_template, '%') != NULL)
 		i_fatal("Don't use %% in username with tests");
+	if (duration_secs > 0 && to_stop != NULL)
+		i_fatal("secs and duration can't be used together");
+	if (testpath != NULL) {
+		/* every error matters when running the test scripts */
+		conf.error_log_rate = 0;
+	}
+	if (conf.rawlog_on_error && conf.rawlog_shared_path == NULL)
+		i_fatal("rawlog_on_error requires rawlog_shared");
+	if (conf.replay != NULL) {
+		if (profile != NULL || testpath != NULL)
+			i_fatal("replay can't be used with profile or test");
+		/* the recorded commands don't match what the state
+		   tracking expects */
+		conf.no_tracking = TRUE;
+	}
+
+	if (conf.workload != NULL)
+		workload_check_settings(conf.workload);
+
+	if (saturation_range != NULL) {
+		if (profile != NULL || testpath != NULL)
+			i_fatal("saturation can't be used with profile or test");
+		if (to_stop != NULL || duration_secs > 0)
+			i_fatal("saturation can't be used with secs or duration");
+		saturation = saturation_init(saturation_range, slos,
+					     saturation_step_secs);
+		conf.clients_count = saturation_get_first_clients(saturation);
+	} else if (slos != NULL || saturation_step_secs != 0) {
+		i_fatal("slo and saturation_step require saturation");
+	}
 
 	if ((ret = net_gethostbyname(conf.host, &conf.ips,
 				     &conf.ips_count)) != 0) {
@@ -793,10 +1291,16 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	dsasl_clients_init();
 
 	i_array_init(&clients, CLIENTS_COUNT);
+	stats_init();
+	errors_init();
+	rawlog_init();
 	if (testpath == NULL)
 		imaptest_run();
 	else
 		imaptest_run_tests(testpath);
+	rawlog_deinit();
+	errors_deinit();
+	stats_deinit();
 
 	imaptest_lmtp_delivery_deinit();
 	clients_deinit();
@@ -807,6 +1311,16 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		profile_deinit();
 	}
 	mailbox_source_unref(&mailbox_source);
+	if (conf.userfile != NULL)
+		userfile_close(&conf.userfile);
+	if (conf.workload != NULL)
+		workload_deinit(&conf.workload);
+	if (conf.transitions != NULL)
+		transitions_deinit(&conf.transitions);
+	if (conf.replay != NULL)
+		replay_deinit(&conf.replay);
+	if (saturation != NULL)
+		saturation_deinit(&saturation);
 
 	if (to_stop != NULL)
 		timeout_remove(&to_stop);
@@ -817,6 +1331,20 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		}
 		o_stream_destroy(&results_output);
 	}
+	if (profile_output != NULL) {
+		if (o_stream_flush(profile_output) < 0) {
+			i_error("Failed to write profile results: %s",
+				o_stream_get_error(profile_output));
+		}
+		o_stream_destroy(&profile_output);
+	}
+	if (summary_output != NULL) {
+		if (o_stream_flush(summary_output) < 0) {
+			i_error("Failed to write summary results: %s",
+				o_stream_get_error(summary_output));
+		}
+		o_stream_destroy(&summary_output);
+	}
 
 	dsasl_clients_deinit();
 	lib_signals_deinit();
@@ -623,9 +623,11 @@ struct mailbox_view *mailbox_view_new(struct mailbox_storage *storage)
 
 	view = i_new(struct mailbox_view, 1);
 	view->storage = storage;
-	i_array_init(&view->uidmap, 100);
-	i_array_init(&view->messages, 100);
-	i_array_init(&view->keywords, 128);
+	/* start small - most clients (especially with no_tracking) never
+	   fill these, and they grow as needed. */
+	i_array_init(&view->uidmap, 16);
+	i_array_init(&view->messages, 16);
+	i_array_init(&view->keywords, 8);
 	return view;
 }
 
@@ -14,20 +14,28 @@
 #include "profile.h"
 #include "pop3-client.h"
 #include "commands.h"
+#include "errors.h"
+#include "rawlog.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 
 int pop3_client_input_error(struct pop3_client *client, const char *fmt, ...)
 {
+	struct error_type *type;
 	va_list va;
 
-	va_start(va, fmt);
-	i_error("%s[%u]: %s: %s", client->client.user->username,
-		client->client.global_id, t_strdup_vprintf(fmt, va),
-		client->cur_line == NULL ? "" : client->cur_line);
-	va_end(va);
+	type = errors_add(ERROR_CLASS_INPUT, client->client.state, fmt);
+	if (type != NULL) {
+		va_start(va, fmt);
+		error_type_log(type, t_strdup_printf("%s[%u]: %s: %s",
+			client->client.user->username,
+			client->client.global_id, t_strdup_vprintf(fmt, va),
+			client->cur_line == NULL ? "" : client->cur_line));
+		va_end(va);
+	}
 
+	rawlog_client_error(&client->client);
 	client_disconnect(&client->client);
 	if (conf.error_quit)
 		lib_exit(2);
@@ -53,6 +61,8 @@ static void pop3_command_send(struct pop3_client *client, const char *cmdline,
 
 	o_stream_nsend_str(client->client.output, cmd->cmdline);
 	array_append(&client->commands, &cmd, 1);
+	client_pipeline_set_depth(&client->client,
+				  array_count(&client->commands));
 }
 
 static void
@@ -70,8 +80,15 @@ pop3_command_finish(struct pop3_client *client, struct pop3_command *cmd)
 	}
 	i_assert(i < count);
 
-	counters[cmd->state]++;
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	if (cmd->state != STATE_BANNER) {
+		/* CAPA is sent before login and isn't counted as a
+		   command, like the banner itself */
+		counters[cmd->state]++;
+		client_state_add_to_timer(&client->client, cmd->state,
+					  &cmd->tv_start);
+	}
+	client_pipeline_set_depth(&client->client,
+				  array_count(&client->commands));
 	pop3_command_free(cmd);
 }
 
@@ -131,6 +148,44 @@ static void pop3_client_connected(struct client *_client ATTR_UNUSED)
 {
 }
 
+/* Returns 1 when the multiline reply has ended, 0 if more lines are expected,
+   -1 on error. */
+static int pop3_client_read_multiline(struct pop3_client *client,
+				      const char *line, const char *cmd_name)
+{
+	if (!client->multiline_reading) {
+		if (line[0] != '+') {
+			pop3_client_input_error(client, "Invalid reply to %s",
+						cmd_name);
+			return -1;
+		}
+		client->multiline_reading = TRUE;
+		return 0;
+	} else if (strcmp(line, ".") != 0) {
+		return 0;
+	}
+	client->multiline_reading = FALSE;
+	return 1;
+}
+
+static int capa_callback(struct pop3_client *client,
+			 struct pop3_command *cmd ATTR_UNUSED,
+			 const char *line)
+{
+	client->capa_received = TRUE;
+	if (!client->multiline_reading && line[0] != '+') {
+		/* server doesn't support CAPA */
+		return 1;
+	}
+	if (client->multiline_reading) {
+		if (strcasecmp(line, "PIPELINING") == 0)
+			client->pipelining = TRUE;
+		else if (strcasecmp(line, "TOP") == 0)
+			client->top_supported = TRUE;
+	}
+	return pop3_client_read_multiline(client, line, "CAPA");
+}
+
 static void
 pop3_client_authenticated(struct pop3_client *client, struct pop3_command *cmd)
 {
@@ -256,6 +311,7 @@ static int uidl_callback(struct pop3_client *client,
 			return -1;
 		}
 		client->uidls_matched = FALSE;
+		client->uidl_received = FALSE;
 		return 0;
 	} else if (strcmp(line, ".") != 0) {
 		unsigned int idx = array_count(&client->uidls);
@@ -278,9 +334,26 @@ static int uidl_callback(struct pop3_client *client,
 		return 0;
 	}
 	client->uidls_matched = TRUE;
+	client->uidl_received = TRUE;
+	client->next_seq = client->prev_seq;
+	client->dele_seq = client->prev_seq;
 	return 1;
 }
 
+static int list_callback(struct pop3_client *client,
+			 struct pop3_command *cmd ATTR_UNUSED,
+			 const char *line)
+{
+	return pop3_client_read_multiline(client, line, "LIST");
+}
+
+static int top_callback(struct pop3_client *client,
+			struct pop3_command *cmd ATTR_UNUSED,
+			const char *line)
+{
+	return pop3_client_read_multiline(client, line, "TOP");
+}
+
 static int dele_callback(struct pop3_client *client,
 			 struct pop3_command *cmd ATTR_UNUSED,
 			 const char *line)
@@ -296,26 +369,16 @@ static int retr_callback(struct pop3_client *client,
 			 struct pop3_command *cmd ATTR_UNUSED,
 			 const char *line)
 {
-	if (!client->retr_reading) {
-		client->retr_reading = TRUE;
-		if (line[0] != '+') {
-			pop3_client_input_error(client, "Invalid reply to RETR");
-			return -1;
-		}
-		return 0;
-	} else if (strcmp(line, ".") != 0) {
-		return 0;
-	} else {
-		client->prev_seq++;
-		if (!client->pop3_keep_mails) {
-			client->client.state = STATE_EXPUNGE;
-			pop3_command_send(client,
-				t_strdup_printf("DELE %u", client->prev_seq),
-				dele_callback);
-		}
-		client->retr_reading = FALSE;
-		return 1;
-	}
+	int ret;
+
+	if ((ret = pop3_client_read_multiline(client, line, "RETR")) <= 0)
+		return ret;
+
+	/* replies come in the same order as the pipelined RETRs. the DELE
+	   is sent by pop3_client_send_more_commands() within the pipeline
+	   depth. */
+	client->prev_seq++;
+	return 1;
 }
 
 static int quit_callback(struct pop3_client *client,
@@ -330,31 +393,99 @@ static int quit_callback(struct pop3_client *client,
 	return -1;
 }
 
+static unsigned int pop3_client_get_max_commands(struct pop3_client *client)
+{
+	if (!client->pipelining)
+		return 1;
+	return client_get_pipeline_depth(&client->client);
+}
+
+static bool pop3_client_want_list(struct pop3_client *client)
+{
+	struct user_client *uc = client->client.user_client;
+
+	return uc != NULL ? uc->profile->pop3_list : do_rand(STATE_LIST);
+}
+
+static void pop3_client_send_next_mail(struct pop3_client *client)
+{
+	struct user_client *uc = client->client.user_client;
+	unsigned int seq;
+
+	if (client->retr_pending)
+		client->retr_pending = FALSE;
+	else {
+		seq = ++client->next_seq;
+		if (client->top_supported &&
+		    (uc != NULL ? uc->profile->pop3_top :
+		     do_rand(STATE_FETCH))) {
+			/* the RETR is sent separately, so that it's counted
+			   against the pipeline depth */
+			client->client.state = STATE_FETCH;
+			pop3_command_send(client, t_strdup_printf("TOP %u %u",
+				seq, uc == NULL ? 0 :
+				uc->profile->pop3_top_lines), top_callback);
+			client->retr_pending = TRUE;
+			return;
+		}
+	}
+	client->client.state = STATE_FETCH2;
+	pop3_command_send(client, t_strdup_printf("RETR %u", client->next_seq),
+			  retr_callback);
+}
+
 static int pop3_client_send_more_commands(struct client *_client)
 {
 	struct pop3_client *client = (struct pop3_client *)_client;
+	unsigned int max_commands = pop3_client_get_max_commands(client);
 
-	if (array_count(&client->commands) > 0)
+	if (array_count(&client->commands) > 0 &&
+	    (max_commands == 1 || !client->uidl_received))
 		return 0;
 
 	switch (client->client.login_state) {
 	case LSTATE_NONAUTH:
+		if (!client->capa_received) {
+			/* find out if the server supports PIPELINING and TOP */
+			_client->state = STATE_BANNER;
+			pop3_command_send(client, "CAPA", capa_callback);
+			break;
+		}
 		/* we begin with USER/AUTH commands */
 		pop3_client_login(client);
 		break;
 	case LSTATE_AUTH:
 	case LSTATE_SELECTED:
 		if (!array_is_created(&client->uidls)) {
+			if (!client->list_sent) {
+				client->list_sent = TRUE;
+				if (pop3_client_want_list(client)) {
+					_client->state = STATE_LIST;
+					pop3_command_send(client, "LIST",
+							  list_callback);
+					if (max_commands == 1)
+						break;
+				}
+			}
 			_client->state = STATE_SELECT;
 			pop3_command_send(client, "UIDL", uidl_callback);
-		} else if (client->prev_seq < array_count(&client->uidls)) {
-			_client->state = STATE_FETCH2;
-			pop3_command_send(client,
-				t_strdup_printf("RETR %u", client->prev_seq+1),
-				retr_callback);
-		} else {
-			client_logout(_client);
+			break;
+		}
+		while (array_count(&client->commands) < max_commands) {
+			if (!client->pop3_keep_mails &&
+			    client->dele_seq < client->prev_seq) {
+				_client->state = STATE_EXPUNGE;
+				pop3_command_send(client, t_strdup_printf(
+					"DELE %u", ++client->dele_seq),
+					dele_callback);
+			} else if (client->retr_pending ||
+				   client->next_seq < array_count(&client->uidls))
+				pop3_client_send_next_mail(client);
+			else
+				break;
 		}
+		if (array_count(&client->commands) == 0)
+			client_logout(_client);
 		break;
 	}
 	i_assert(_client->state <= STATE_LOGOUT);
@@ -28,13 +28,23 @@ struct pop3_client {
 
 	pool_t uidls_pool;
 	ARRAY_TYPE(const_string) uidls;
-	unsigned int prev_seq;
+	/* prev_seq is the last fully RETRed message, next_seq the last
+	   message that has been requested with pipelining and dele_seq the
+	   last message that has been DELEd */
+	unsigned int prev_seq, next_seq, dele_seq;
 
 	bool seen_banner:1;
 	bool auth_reply_sent:1;
-	bool retr_reading:1;
+	bool multiline_reading:1;
+	bool capa_received:1;
+	bool pipelining:1;
+	bool top_supported:1;
+	bool list_sent:1;
+	bool uidl_received:1;
 	bool uidls_matched:1;
 	bool pop3_keep_mails:1;
+	/* TOP next_seq has been sent, but not its RETR yet */
+	bool retr_pending:1;
 };
 
 static inline struct pop3_client *pop3_client(struct client *client)
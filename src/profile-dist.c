@@ -0,0 +1,247 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "str-parse.h"
+#include "profile-dist.h"
+
+#include <math.h>
+
+enum profile_dist_type {
+	PROFILE_DIST_EXPONENTIAL,
+	PROFILE_DIST_LOGNORMAL,
+	PROFILE_DIST_PARETO,
+	PROFILE_DIST_EMPIRICAL
+};
+
+struct profile_dist_bucket {
+	/* the bucket's upper bound in seconds */
+	double value;
+	/* sum of the weights up to and including this bucket */
+	double cumulative_weight;
+};
+
+struct profile_dist {
+	enum profile_dist_type type;
+	/* exponential: mean, lognormal: median and sigma,
+	   pareto: minimum and alpha */
+	double param1, param2;
+	/* empirical: sorted by value */
+	ARRAY(struct profile_dist_bucket) buckets;
+};
+
+static double rand_uniform(void)
+{
+	/* 0 < n < 1 so it can be given to log() and pow() */
+	return (i_rand_limit(UINT32_MAX) + 1.0) / ((double)UINT32_MAX + 1);
+}
+
+static double rand_normal(void)
+{
+	/* Box-Muller */
+	return sqrt(-2 * log(rand_uniform())) *
+		cos(2 * M_PI * rand_uniform());
+}
+
+static int
+parse_secs(const char *value, double *secs_r, const char **error_r)
+{
+	unsigned int msecs;
+
+	if (str_parse_get_interval_msecs(value, &msecs, error_r) < 0)
+		return -1;
+	*secs_r = msecs / 1000.0;
+	return 0;
+}
+
+static int
+parse_positive_double(const char *value, double *num_r, const char **error_r)
+{
+	char *end;
+
+	*num_r = strtod(value, &end);
+	if (*end != '\0' || !(*num_r > 0)) {
+		*error_r = t_strdup_printf("Invalid positive number '%s'",
+					   value);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+profile_dist_read_empirical(struct profile_dist *dist, const char *path,
+			    const char **error_r)
+{
+	struct profile_dist_bucket bucket;
+	struct istream *input;
+	const char *const *args, *error;
+	const char *line;
+	unsigned int linenum = 0, weight;
+	double total = 0, prev_value = -1;
+	int ret = 0;
+
+	input = i_stream_create_file(path, (size_t)-1);
+	while (ret == 0 && (line = i_stream_read_next_line(input)) != NULL) {
+		linenum++;
+		args = t_strsplit_spaces(line, " \t");
+		if (args[0] == NULL || args[0][0] == '#')
+			continue;
+
+		if (str_array_length(args) != 2) {
+			error = "Expected <time> <weight>";
+			ret = -1;
+		} else if (parse_secs(args[0], &bucket.value, &error) < 0) {
+			ret = -1;
+		} else if (str_to_uint(args[1], &weight) < 0) {
+			error = t_strdup_printf("Invalid weight '%s'", args[1]);
+			ret = -1;
+		} else if (bucket.value <= prev_value) {
+			error = "Times must be increasing";
+			ret = -1;
+		} else {
+			prev_value = bucket.value;
+			total += weight;
+			bucket.cumulative_weight = total;
+			array_append(&dist->buckets, &bucket, 1);
+		}
+		if (ret < 0) {
+			*error_r = t_strdup_printf("%s line %u: %s",
+						   path, linenum, error);
+		}
+	}
+	if (ret == 0 && input->stream_errno != 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %s", path,
+					   i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+
+	if (ret == 0 && total == 0) {
+		*error_r = t_strdup_printf("%s: No weights in the histogram",
+					   path);
+		ret = -1;
+	}
+	return ret;
+}
+
+int profile_dist_parse(pool_t pool, const char *value,
+		       struct profile_dist **dist_r, const char **error_r)
+{
+	struct profile_dist *dist;
+	const char *const *args;
+	unsigned int count;
+	int ret;
+
+	args = t_strsplit_spaces(value, " ");
+	count = str_array_length(args);
+	if (count == 0)
+		return 0;
+
+	dist = p_new(pool, struct profile_dist, 1);
+	if (strcmp(args[0], "exponential") == 0) {
+		dist->type = PROFILE_DIST_EXPONENTIAL;
+		if (count != 2) {
+			*error_r = "Expected exponential <mean>";
+			return -1;
+		}
+		ret = parse_secs(args[1], &dist->param1, error_r);
+	} else if (strcmp(args[0], "lognormal") == 0) {
+		dist->type = PROFILE_DIST_LOGNORMAL;
+		if (count != 3) {
+			*error_r = "Expected lognormal <median> <sigma>";
+			return -1;
+		}
+		ret = parse_secs(args[1], &dist->param1, error_r) < 0 ||
+			parse_positive_double(args[2], &dist->param2,
+					      error_r) < 0 ? -1 : 0;
+	} else if (strcmp(args[0], "pareto") == 0) {
+		dist->type = PROFILE_DIST_PARETO;
+		if (count != 3) {
+			*error_r = "Expected pareto <min> <alpha>";
+			return -1;
+		}
+		ret = parse_secs(args[1], &dist->param1, error_r) < 0 ||
+			parse_positive_double(args[2], &dist->param2,
+					      error_r) < 0 ? -1 : 0;
+	} else if (strcmp(args[0], "empirical") == 0) {
+		dist->type = PROFILE_DIST_EMPIRICAL;
+		if (count != 2) {
+			*error_r = "Expected empirical <path>";
+			return -1;
+		}
+		p_array_init(&dist->buckets, pool, 16);
+		ret = profile_dist_read_empirical(dist, args[1], error_r);
+	} else {
+		return 0;
+	}
+	if (ret < 0)
+		return -1;
+	if (dist->type != PROFILE_DIST_EMPIRICAL && dist->param1 == 0) {
+		*error_r = "Time can't be 0";
+		return -1;
+	}
+	*dist_r = dist;
+	return 1;
+}
+
+static double
+profile_dist_empirical_quantile(const struct profile_dist *dist, double q)
+{
+	const struct profile_dist_bucket *buckets;
+	unsigned int idx, left_idx, right_idx, count;
+	double weight, prev_value, prev_weight;
+
+	buckets = array_get(&dist->buckets, &count);
+	weight = q * buckets[count-1].cumulative_weight;
+
+	/* find the first bucket whose cumulative weight reaches weight */
+	left_idx = 0; right_idx = count - 1;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (buckets[idx].cumulative_weight < weight)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	idx = left_idx;
+
+	/* pick uniformly within the bucket */
+	prev_value = idx == 0 ? 0 : buckets[idx-1].value;
+	prev_weight = idx == 0 ? 0 : buckets[idx-1].cumulative_weight;
+	if (buckets[idx].cumulative_weight == prev_weight)
+		return buckets[idx].value;
+	return prev_value + (buckets[idx].value - prev_value) *
+		(weight - prev_weight) /
+		(buckets[idx].cumulative_weight - prev_weight);
+}
+
+double profile_dist_sample(const struct profile_dist *dist)
+{
+	switch (dist->type) {
+	case PROFILE_DIST_EXPONENTIAL:
+		return -dist->param1 * log(rand_uniform());
+	case PROFILE_DIST_LOGNORMAL:
+		return dist->param1 * exp(dist->param2 * rand_normal());
+	case PROFILE_DIST_PARETO:
+		return dist->param1 / pow(rand_uniform(), 1 / dist->param2);
+	case PROFILE_DIST_EMPIRICAL:
+		return profile_dist_empirical_quantile(dist, rand_uniform());
+	}
+	i_unreached();
+}
+
+double profile_dist_get_median(const struct profile_dist *dist)
+{
+	switch (dist->type) {
+	case PROFILE_DIST_EXPONENTIAL:
+		return dist->param1 * M_LN2;
+	case PROFILE_DIST_LOGNORMAL:
+		return dist->param1;
+	case PROFILE_DIST_PARETO:
+		return dist->param1 * pow(2, 1 / dist->param2);
+	case PROFILE_DIST_EMPIRICAL:
+		return profile_dist_empirical_quantile(dist, 0.5);
+	}
+	i_unreached();
+}
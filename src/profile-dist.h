@@ -0,0 +1,26 @@
+#ifndef PROFILE_DIST_H
+#define PROFILE_DIST_H
+
+/* Random distributions for the profile's time intervals. The values are in
+   seconds. Supported specs are:
+
+   exponential <mean>
+   lognormal <median> <sigma>
+   pareto <min> <alpha>
+   empirical <path>
+
+   The empirical file has "<time> <weight>" lines, each describing a
+   histogram bucket from the previous line's time up to this line's time. */
+struct profile_dist;
+
+/* Returns 1 if the value was parsed as a distribution, 0 if it doesn't
+   look like one (it's a plain interval), -1 if it's invalid. */
+int profile_dist_parse(pool_t pool, const char *value,
+		       struct profile_dist **dist_r, const char **error_r);
+
+/* Returns a random value from the distribution in seconds. */
+double profile_dist_sample(const struct profile_dist *dist);
+/* Returns the distribution's median in seconds. */
+double profile_dist_get_median(const struct profile_dist *dist);
+
+#endif
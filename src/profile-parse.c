@@ -5,8 +5,12 @@
 #include "istream.h"
 #include "settings-parser.h"
 #include "str-parse.h"
+#include "settings.h"
 #include "client-state.h"
 #include "profile.h"
+#include "profile-dist.h"
+
+#include <stddef.h>
 
 enum parser_state {
 	STATE_ROOT,
@@ -35,18 +39,30 @@ static const struct setting_define profile_client_setting_defines[] = {
 	DEF(ENUM, protocol),
 	DEF(UINT, connection_max_count),
 	DEF(BOOL, pop3_keep_mails),
+	DEF(BOOL, pop3_list),
+	DEF(BOOL, pop3_top),
+	DEF(UINT, pop3_top_lines),
 	DEF(BOOL, imap_idle),
 	DEF(STR, imap_fetch_immediate),
 	DEF(STR, imap_fetch_manual),
 	DEF(TIME, imap_status_interval),
 	DEF(TIME, login_interval),
+	DEF(ENUM, imap_sync),
+	DEF(TIME, imap_poll_interval),
+	DEF(BOOL, imap_list_status),
 
 	SETTING_DEFINE_LIST_END
 };
 
 const struct profile_client profile_client_default_settings = {
 	.name = "",
-	.protocol = "imap:pop3"
+	.protocol = "imap:pop3",
+	.imap_sync = "idle:poll:full:condstore:qresync:notify",
+	.imap_poll_interval = 5*60
+};
+
+static const char *const profile_imap_sync_names[] = {
+	"idle", "poll", "full", "condstore", "qresync", "notify"
 };
 
 const struct setting_parser_info profile_client_setting_parser_info = {
@@ -83,12 +99,15 @@ static const struct setting_define profile_user_setting_defines[] = {
 	DEF(TIME, mail_action_repeat_delay),
 	DEF(TIME, mail_write_duration),
 	DEF(SIZE, mail_write_size),
+	DEF(UINT, mail_folder_count),
+	DEF(UINT, mail_folder_depth),
 
 	SETTING_DEFINE_LIST_END
 };
 
 const struct profile_user profile_user_default_settings = {
-	.name = ""
+	.name = "",
+	.mail_folder_depth = 1
 };
 
 const struct setting_parser_info profile_user_setting_parser_info = {
@@ -100,6 +119,22 @@ const struct setting_parser_info profile_user_setting_parser_info = {
 	.struct_size = sizeof(struct profile_user),
 };
 
+/* profile_user intervals that can be given as a distribution spec */
+#define DIST_DEF(name) \
+	{ #name, offsetof(struct profile_user, name##_dist) }
+static const struct {
+	const char *key;
+	size_t offset;
+} profile_user_dist_defines[] = {
+	DIST_DEF(mail_session_length),
+	DIST_DEF(mail_inbox_delivery_interval),
+	DIST_DEF(mail_spam_delivery_interval),
+	DIST_DEF(mail_send_interval),
+	DIST_DEF(mail_action_delay),
+	DIST_DEF(mail_action_repeat_delay),
+	DIST_DEF(mail_write_duration),
+};
+
 #define IS_WHITE(c) ((c) == ' ' || (c) == '\t')
 
 static char *line_remove_whitespace(char *line)
@@ -197,6 +232,87 @@ static void parser_add_user(struct profile_parser *parser)
 	user->username_start_index = 1;
 }
 
+static void
+parse_load_percentage(struct profile_parser *parser, const char *value,
+		      unsigned int *percentage_r)
+{
+	const char *p;
+
+	p = strchr(value, '%');
+	if (p == NULL || p[1] != '\0' ||
+	    str_to_uint(t_strdup_until(value, p), percentage_r) < 0 ||
+	    *percentage_r > 100) {
+		i_fatal("Invalid load_curve at line %u: "
+			"Invalid load '%s' - expected 0..100%%",
+			parser->linenum, value);
+	}
+}
+
+static unsigned int
+parse_load_time(struct profile_parser *parser, const char *value)
+{
+	unsigned int secs;
+	const char *error;
+
+	if (str_parse_get_interval(value, &secs, &error) < 0) {
+		i_fatal("Invalid load_curve at line %u: %s",
+			parser->linenum, error);
+	}
+	return secs;
+}
+
+static void
+profile_parse_load_curve(struct profile_parser *parser, const char *value)
+{
+	struct profile *profile = parser->profile;
+	struct profile_load_point point;
+	const struct profile_load_point *prev;
+	const char *const *args;
+	unsigned int i, count;
+
+	args = t_strsplit_spaces(value, " ,");
+	count = str_array_length(args);
+	if (count > 0 && strcmp(args[0], "sine") == 0) {
+		if (count != 4) {
+			i_fatal("Invalid load_curve at line %u: "
+				"Expected sine <period> <min>%% <max>%%",
+				parser->linenum);
+		}
+		profile->load_shape = PROFILE_LOAD_SHAPE_SINE;
+		profile->load_period = parse_load_time(parser, args[1]);
+		parse_load_percentage(parser, args[2],
+				      &profile->load_min_percentage);
+		parse_load_percentage(parser, args[3],
+				      &profile->load_max_percentage);
+		if (profile->load_period == 0) {
+			i_fatal("Invalid load_curve at line %u: "
+				"Period can't be 0", parser->linenum);
+		}
+		return;
+	}
+
+	if (count == 0 || count % 2 != 0) {
+		i_fatal("Invalid load_curve at line %u: "
+			"Expected <time> <load>%%[, <time> <load>%% ...]",
+			parser->linenum);
+	}
+	profile->load_shape = PROFILE_LOAD_SHAPE_POINTS;
+	p_array_init(&profile->load_points, profile->pool, count / 2);
+	for (i = 0; i < count; i += 2) {
+		point.time = parse_load_time(parser, args[i]);
+		parse_load_percentage(parser, args[i+1], &point.percentage);
+		if (i > 0) {
+			prev = array_idx(&profile->load_points, i/2 - 1);
+			if (point.time <= prev->time) {
+				i_fatal("Invalid load_curve at line %u: "
+					"Times must be increasing",
+					parser->linenum);
+			}
+		}
+		array_append(&profile->load_points, &point, 1);
+	}
+}
+
 static void profile_parse_line_root(struct profile_parser *parser, char *line)
 {
 	const char *key, *value, *error;
@@ -227,6 +343,8 @@ static void profile_parse_line_root(struct profile_parser *parser, char *line)
 				i_fatal("Invalid setting %s at line %u: %s",
 					key, parser->linenum, error);
 			}
+		} else if (strcmp(key, "load_curve") == 0) {
+			profile_parse_load_curve(parser, value);
 		} else {
 			i_fatal("Unknown setting at line %u: %s", parser->linenum, key);
 		}
@@ -270,6 +388,43 @@ static void parse_count(struct profile_parser *parser, const char *value,
 	}
 }
 
+static bool
+profile_parse_user_dist(struct profile_parser *parser,
+			const char *key, const char *value)
+{
+	struct profile_user *user;
+	struct profile_dist *dist;
+	const char *error;
+	unsigned int i, median;
+	int ret;
+
+	for (i = 0; i < N_ELEMENTS(profile_user_dist_defines); i++) {
+		if (strcmp(profile_user_dist_defines[i].key, key) == 0)
+			break;
+	}
+	if (i == N_ELEMENTS(profile_user_dist_defines))
+		return FALSE;
+
+	ret = profile_dist_parse(parser->profile->pool, value, &dist, &error);
+	if (ret == 0)
+		return FALSE;
+	if (ret < 0) {
+		i_fatal("Invalid value for setting '%s' at line %u: %s",
+			key, parser->linenum, error);
+	}
+	user = settings_parser_get_set(parser->cur_parser);
+	*(const struct profile_dist **)
+		PTR_OFFSET(user, profile_user_dist_defines[i].offset) = dist;
+
+	/* the setting itself is still used for checking whether the action
+	   is enabled and for spreading the initial timestamps */
+	median = (unsigned int)(profile_dist_get_median(dist) + 0.5);
+	if (settings_parse_keyvalue(parser->cur_parser, key,
+				    dec2str(I_MAX(median, 1))) != 1)
+		i_unreached();
+	return TRUE;
+}
+
 static void
 profile_parse_line_section(struct profile_parser *parser, char *line)
 {
@@ -284,9 +439,15 @@ profile_parse_line_section(struct profile_parser *parser, char *line)
 	if (!try_parse_keyvalue(line, &key, &value))
 		i_fatal("Invalid data at line %u: %s", parser->linenum, line);
 
-	if (strcmp(key, "count") == 0)
+	if (strcmp(key, "count") == 0) {
 		parse_count(parser, value, &parser->cur_count);
-	else if ((ret = settings_parse_keyvalue(parser->cur_parser, key, value)) < 0) {
+		return;
+	}
+	if (parser->state == STATE_USER &&
+	    profile_parse_user_dist(parser, key, value))
+		return;
+
+	if ((ret = settings_parse_keyvalue(parser->cur_parser, key, value)) < 0) {
 		i_fatal("Invalid value for setting '%s' at line %u: %s",
 			key, parser->linenum, value);
 	} else if (ret == 0) {
@@ -294,11 +455,50 @@ profile_parse_line_section(struct profile_parser *parser, char *line)
 	}
 }
 
+static void profile_user_init_folders(pool_t pool, struct profile_user *user)
+{
+	unsigned int i, parent, fanout, level_count, total;
+	const char *name, *const *names;
+
+	if (user->mail_folder_depth == 0)
+		i_fatal("mail_folder_depth must be at least 1");
+	p_array_init(&user->mail_folders, pool, user->mail_folder_count);
+	if (user->mail_folder_count == 0)
+		return;
+
+	/* find the smallest fanout that fits all the folders within the
+	   wanted depth */
+	for (fanout = 1;; fanout++) {
+		level_count = 1; total = 0;
+		for (i = 0; i < user->mail_folder_depth &&
+			    total < user->mail_folder_count; i++) {
+			level_count *= fanout;
+			total += level_count;
+		}
+		if (total >= user->mail_folder_count)
+			break;
+	}
+
+	/* folder n's parent is folder (n-1)/fanout, 0 being the root */
+	for (i = 1; i <= user->mail_folder_count; i++) {
+		parent = (i - 1) / fanout;
+		if (parent == 0)
+			name = p_strdup_printf(pool, "Folder%u", i);
+		else {
+			names = array_front(&user->mail_folders);
+			name = p_strdup_printf(pool, "%s%cFolder%u",
+					       names[parent-1],
+					       IMAP_HIERARCHY_SEP, i);
+		}
+		array_append(&user->mail_folders, &name, 1);
+	}
+}
+
 static void profile_finish(struct profile_parser *parser)
 {
 	struct profile_client *client;
 	struct profile_user *user;
-	unsigned int percentage_count;
+	unsigned int i, percentage_count;
 
 	if (parser->profile->lmtp_port == 0)
 		i_fatal("lmtp_port setting missing");
@@ -310,8 +510,27 @@ static void profile_finish(struct profile_parser *parser)
 		i_fatal("No user {} sections defined");
 
 	percentage_count = 0;
-	array_foreach_elem(&parser->clients, client)
+	array_foreach_elem(&parser->clients, client) {
+		for (i = 0; i < N_ELEMENTS(profile_imap_sync_names); i++) {
+			if (strcmp(client->imap_sync,
+				   profile_imap_sync_names[i]) == 0)
+				break;
+		}
+		i_assert(i < N_ELEMENTS(profile_imap_sync_names));
+		client->imap_sync_type = i;
+		if (client->imap_sync_type == PROFILE_IMAP_SYNC_POLL &&
+		    client->imap_poll_interval == 0)
+			i_fatal("imap_sync=poll requires imap_poll_interval");
+		/* show the used sync commands in the stats */
+		if (client->imap_sync_type == PROFILE_IMAP_SYNC_CONDSTORE ||
+		    client->imap_sync_type == PROFILE_IMAP_SYNC_QRESYNC)
+			states[STATE_ENABLE].probability = 100;
+		else if (client->imap_sync_type == PROFILE_IMAP_SYNC_NOTIFY)
+			states[STATE_NOTIFY].probability = 100;
+		if (client->imap_list_status)
+			states[STATE_LIST_STATUS].probability = 100;
 		percentage_count += client->percentage;
+	}
 	if (percentage_count < 100)
 		i_fatal("client { count } total must be at least 100%% (now is %u%%)", percentage_count);
 
@@ -321,6 +540,7 @@ static void profile_finish(struct profile_parser *parser)
 			i_fatal("Either username_format or userfile must be set");
 		user->user_count = parser->profile->total_user_count *
 			user->percentage / 100;
+		profile_user_init_folders(parser->profile->pool, user);
 		percentage_count += user->percentage;
 	}
 	if (percentage_count != 100)
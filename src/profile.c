@@ -2,7 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
-#include "istream.h"
+#include "priorityq.h"
 #include "str.h"
 #include "var-expand.h"
 #include "smtp-address.h"
@@ -13,7 +13,11 @@
 #include "mailbox-source.h"
 #include "commands.h"
 #include "imaptest-lmtp.h"
+#include "stats.h"
+#include "settings.h"
 #include "profile.h"
+#include "profile-dist.h"
+#include "userfile.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -22,23 +26,48 @@
 #define RANDN2(mu, sigma) \
 	(mu + (i_rand_limit(2) != 0 ? -1.0 : 1.0) * sigma * pow(-log(0.99999*RANDU), 0.5))
 #define weighted_rand(n) \
-	(int)RANDN2(n, n/2)
-
-static time_t users_min_timestamp = INT_MAX;
+	(long long)RANDN2(n, n/2)
+
+/* don't let heavy-tailed distributions overflow the timestamps */
+#define PROFILE_INTERVAL_MAX_MSECS (365LL*24*60*60*1000)
+/* how long to wait before retrying a user action that couldn't be done yet */
+#define USER_ACTION_RETRY_MSECS 500
+/* how often users that are inactive at the current load check whether they
+   should log in */
+#define USER_LOAD_RECHECK_SECS 300
+
+static struct profile *load_profile;
+static unsigned int load_target_logins, load_target_deliveries;
+static struct priorityq *users_queue;
 static struct timeout *to_users;
+static ARRAY(struct userfile *) profile_userfiles;
 
 static void user_mailbox_action_move(struct imap_client *client,
 				     const char *mailbox, uint32_t uid);
-static void user_set_min_timestamp(struct user *user, time_t min_timestamp);
+static void user_set_min_timestamp(struct user *user, long long min_timestamp);
 static void users_timeout_update(void);
 
+/* Returns a random interval in msecs, either from the distribution or
+   weighted around the interval (in secs). */
+static long long
+profile_interval_rand(unsigned int interval, const struct profile_dist *dist)
+{
+	double msecs;
+
+	if (dist == NULL)
+		return weighted_rand(user_time_interval(interval));
+	msecs = profile_dist_sample(dist) * 1000 / conf.time_scale;
+	return msecs < PROFILE_INTERVAL_MAX_MSECS ? (long long)msecs :
+		PROFILE_INTERVAL_MAX_MSECS;
+}
+
 static void client_profile_init_mailbox(struct imap_client *client)
 {
 	struct user_mailbox_cache *cache;
 
 	cache = user_get_mailbox_cache(client->client.user_client,
 				       client->storage->name);
-	if (cache->uidvalidity != 0)
+	if (cache->uidvalidity == client->storage->uidvalidity)
 		return;
 
 	cache->uidvalidity = client->storage->uidvalidity;
@@ -51,6 +80,9 @@ static void client_profile_init_mailbox(struct imap_client *client)
 static void
 client_profile_send_missing_creates(struct imap_client *client)
 {
+	const char *folder;
+	string_t *cmd;
+
 	if ((client->client.user->profile->mail_inbox_move_filter_percentage > 0 ||
 	     client->client.user->profile->mail_spam_delivery_interval > 0) &&
 	    imap_client_mailboxes_list_find(client, PROFILE_MAILBOX_SPAM) == NULL)
@@ -63,11 +95,158 @@ client_profile_send_missing_creates(struct imap_client *client)
 		if (imap_client_mailboxes_list_find(client, PROFILE_MAILBOX_SENT) == NULL)
 			command_send(client, "CREATE \""PROFILE_MAILBOX_SENT"\"", state_callback);
 	}
+
+	cmd = t_str_new(128);
+	array_foreach_elem(&client->client.user->profile->mail_folders, folder) {
+		if (imap_client_mailboxes_list_find(client, folder) != NULL)
+			continue;
+		str_truncate(cmd, 0);
+		str_append(cmd, "CREATE ");
+		imap_append_astring(cmd, folder);
+		command_send(client, str_c(cmd), state_callback);
+	}
+}
+
+static void client_profile_status_timeout(struct imap_client *client)
+{
+	const ARRAY_TYPE(const_string) *folders =
+		&client->client.user->profile->mail_folders;
+	const char *folder;
+	string_t *cmd;
+
+	/* don't pile up polls if the previous one hasn't finished yet */
+	if (client->client.disconnected || client->client.logout_sent ||
+	    array_count(&client->commands) > (client->client.idling ? 1 : 0))
+		return;
+
+	if (client->client.user_client->profile->imap_list_status &&
+	    (client->capabilities & CAP_LIST_STATUS) != 0) {
+		client->client.state = STATE_LIST_STATUS;
+		command_send(client, "LIST \"\" \"*\" RETURN (STATUS "
+			     "(MESSAGES UNSEEN UIDNEXT))", state_callback);
+		return;
+	}
+
+	cmd = t_str_new(128);
+	array_foreach_elem(folders, folder) {
+		str_truncate(cmd, 0);
+		str_append(cmd, "STATUS ");
+		imap_append_astring(cmd, folder);
+		str_append(cmd, " (MESSAGES UNSEEN UIDNEXT)");
+		client->client.state = STATE_STATUS;
+		command_send(client, str_c(cmd), state_callback);
+	}
+}
+
+static void client_profile_poll_timeout(struct imap_client *client)
+{
+	timeout_remove(&client->to_sync);
+	if (client->client.disconnected || !client->client.sync_waiting ||
+	    client->client.login_state != LSTATE_SELECTED)
+		return;
+
+	client->client.state = STATE_NOOP;
+	command_send(client, "NOOP", state_callback);
+}
+
+static enum profile_imap_sync
+client_profile_get_sync_type(struct imap_client *client)
+{
+	enum profile_imap_sync sync_type =
+		client->client.user_client->profile->imap_sync_type;
+
+	if (sync_type == PROFILE_IMAP_SYNC_NOTIFY &&
+	    (client->capabilities & CAP_NOTIFY) == 0) {
+		/* fall back to IDLE */
+		return PROFILE_IMAP_SYNC_IDLE;
+	}
+	return sync_type;
+}
+
+static bool
+client_profile_sync_need_enable(struct imap_client *client,
+				enum imap_capability *cap_r)
+{
+	switch (client->client.user_client->profile->imap_sync_type) {
+	case PROFILE_IMAP_SYNC_CONDSTORE:
+		*cap_r = CAP_CONDSTORE;
+		break;
+	case PROFILE_IMAP_SYNC_QRESYNC:
+		*cap_r = CAP_QRESYNC;
+		break;
+	default:
+		return FALSE;
+	}
+	return !client->profile_sync_enabled &&
+		(client->capabilities & *cap_r) != 0;
+}
+
+static void client_profile_send_select(struct imap_client *client,
+				       string_t *cmd)
+{
+	struct user_mailbox_cache *cache;
+
+	str_append(cmd, "SELECT ");
+	imap_append_astring(cmd, client->storage->name);
+	cache = user_get_mailbox_cache(client->client.user_client,
+				       client->storage->name);
+	if (client->qresync_enabled && cache->uidvalidity != 0 &&
+	    cache->highest_modseq != 0) {
+		str_printfa(cmd, " (QRESYNC (%u %llu))", cache->uidvalidity,
+			    (unsigned long long)cache->highest_modseq);
+	}
+	client->client.state = STATE_SELECT;
+}
+
+/* Returns TRUE if a resync command was added to cmd after SELECT. */
+static bool client_profile_send_resync(struct imap_client *client,
+				       string_t *cmd)
+{
+	struct user_mailbox_cache *cache;
+	uint64_t old_modseq;
+
+	if (client->profile_synced)
+		return FALSE;
+	client->profile_synced = TRUE;
+
+	cache = user_get_mailbox_cache(client->client.user_client,
+				       client->storage->name);
+	old_modseq = cache->uidvalidity != client->storage->uidvalidity ? 0 :
+		cache->highest_modseq;
+	client_profile_init_mailbox(client);
+	/* the next session continues from this session's state */
+	cache->highest_modseq = client->view->highest_modseq;
+
+	switch (client_profile_get_sync_type(client)) {
+	case PROFILE_IMAP_SYNC_IDLE:
+	case PROFILE_IMAP_SYNC_POLL:
+	case PROFILE_IMAP_SYNC_QRESYNC:
+		/* QRESYNC already synced with SELECT */
+		return FALSE;
+	case PROFILE_IMAP_SYNC_FULL:
+		str_append(cmd, "UID FETCH 1:* (FLAGS)");
+		break;
+	case PROFILE_IMAP_SYNC_CONDSTORE:
+		str_append(cmd, "UID FETCH 1:* (FLAGS)");
+		if (old_modseq != 0 && (client->capabilities & CAP_CONDSTORE) != 0)
+			str_printfa(cmd, " (CHANGEDSINCE %llu)",
+				    (unsigned long long)old_modseq);
+		break;
+	case PROFILE_IMAP_SYNC_NOTIFY:
+		str_append(cmd, "NOTIFY SET (selected (MessageNew "
+			   "MessageExpunge FlagChange))");
+		client->client.state = STATE_NOTIFY;
+		return TRUE;
+	}
+	client->client.state = STATE_UIDFETCH;
+	return TRUE;
 }
 
 int imap_client_profile_send_more_commands(struct client *_client)
 {
 	struct imap_client *client = (struct imap_client *)_client;
+	const struct profile_client *profile = _client->user_client->profile;
+	enum imap_capability cap;
 	string_t *cmd = t_str_new(128);
 
 	if (array_count(&client->commands) > 0)
@@ -86,15 +265,42 @@ int imap_client_profile_send_more_commands(struct client *_client)
 			str_append(cmd, "LIST \"\" *");
 			client->client.state = STATE_LIST;
 			imap_client_mailboxes_list_begin(client);
+		} else if (client_profile_sync_need_enable(client, &cap)) {
+			str_append(cmd, cap == CAP_QRESYNC ?
+				   "ENABLE QRESYNC" : "ENABLE CONDSTORE");
+			client->client.state = STATE_ENABLE;
+			client->profile_sync_enabled = TRUE;
 		} else {
 			client_profile_send_missing_creates(client);
-			str_append(cmd, "SELECT ");
-			imap_append_astring(cmd, client->storage->name);
-			client->client.state = STATE_SELECT;
+			client_profile_send_select(client, cmd);
 		}
 		break;
 	case LSTATE_SELECTED:
-		client_profile_init_mailbox(client);
+		if (client->to_status == NULL && profile->imap_status_interval > 0 &&
+		    array_count(&_client->user->profile->mail_folders) > 0) {
+			client->to_status = timeout_add(
+				user_time_interval(profile->imap_status_interval),
+				client_profile_status_timeout, client);
+		}
+		if (client_profile_send_resync(client, cmd))
+			break;
+		switch (client_profile_get_sync_type(client)) {
+		case PROFILE_IMAP_SYNC_POLL:
+			/* wait without IDLE and NOOP every poll interval */
+			client->client.sync_waiting = TRUE;
+			if (client->to_sync == NULL) {
+				client->to_sync = timeout_add(
+					user_time_interval(profile->imap_poll_interval),
+					client_profile_poll_timeout, client);
+			}
+			return 0;
+		case PROFILE_IMAP_SYNC_NOTIFY:
+			/* the server sends the changes without IDLE */
+			client->client.sync_waiting = TRUE;
+			return 0;
+		default:
+			break;
+		}
 		str_append(cmd, "IDLE");
 		client->idle_wait_cont = TRUE;
 		client->client.state = STATE_IDLE;
@@ -145,14 +351,23 @@ static void client_profile_handle_fetch(struct imap_client *client,
 
 			cache = user_get_mailbox_cache(client->client.user_client,
 						       client->storage->name);
-			if (cache->uidnext <= uid && cache->uidvalidity != 0)
+			if (cache->uidvalidity != 0) {
+				/* flag changes of the already seen mails
+				   come from resyncs and NOTIFY */
+				if (uid < cache->uidnext)
+					return;
 				cache->uidnext = uid+1;
+			}
 
 			if ((unsigned)i_rand() % 100 < client->client.user->profile->mail_inbox_move_filter_percentage)
 				user_mailbox_action_move(client, PROFILE_MAILBOX_SPAM, uid);
-			else if (cache->next_action_timestamp == (time_t)-1) {
-				cache->next_action_timestamp = ioloop_time +
-					weighted_rand(client->client.user->profile->mail_action_delay);
+			else if (cache->next_action_timestamp == -1) {
+				const struct profile_user *profile =
+					client->client.user->profile;
+
+				cache->next_action_timestamp = user_time_now() +
+					profile_interval_rand(profile->mail_action_delay,
+							      profile->mail_action_delay_dist);
 				user_set_min_timestamp(client->client.user, cache->next_action_timestamp);
 			}
 		}
@@ -210,15 +425,36 @@ user_get_timeout_interval(struct user *user, enum user_timestamp ts)
 	i_unreached();
 }
 
-static time_t
-user_get_next_timeout(struct user *user, time_t start_time,
+static const struct profile_dist *
+user_get_timeout_dist(struct user *user, enum user_timestamp ts)
+{
+	switch (ts) {
+	case USER_TIMESTAMP_LOGIN:
+		return NULL;
+	case USER_TIMESTAMP_INBOX_DELIVERY:
+		return user->profile->mail_inbox_delivery_interval_dist;
+	case USER_TIMESTAMP_SPAM_DELIVERY:
+		return user->profile->mail_spam_delivery_interval_dist;
+	case USER_TIMESTAMP_WRITE_MAIL:
+		return user->profile->mail_send_interval_dist;
+	case USER_TIMESTAMP_LOGOUT:
+		return user->profile->mail_session_length_dist;
+	case USER_TIMESTAMP_COUNT:
+		break;
+	}
+	i_unreached();
+}
+
+static long long
+user_get_next_timeout(struct user *user, long long start_time,
 		      enum user_timestamp ts)
 {
 	unsigned int interval = user_get_timeout_interval(user, ts);
 
 	if (interval == 0)
-		return (time_t)-1;
-	return start_time + weighted_rand(interval);
+		return -1;
+	return start_time +
+		profile_interval_rand(interval, user_get_timeout_dist(user, ts));
 }
 
 static void user_mailbox_action_delete(struct imap_client *client, uint32_t uid)
@@ -258,7 +494,7 @@ static void user_draft_callback(struct imap_client *client, struct command *cmd,
 {
 	const char *uidvalidity, *uidstr;
 	uint32_t uid;
-	time_t ts;
+	long long ts;
 
 	i_assert(cmd == client->client.user_client->draft_cmd);
 	client->client.user_client->draft_cmd = NULL;
@@ -279,7 +515,9 @@ static void user_draft_callback(struct imap_client *client, struct command *cmd,
 	i_assert(client->client.user_client->draft_uid == 0);
 	client->client.user_client->draft_uid = uid;
 
-	ts = ioloop_time + weighted_rand(client->client.user->profile->mail_write_duration);
+	ts = user_time_now() +
+		profile_interval_rand(client->client.user->profile->mail_write_duration,
+				      client->client.user->profile->mail_write_duration_dist);
 	client->client.user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = ts;
 	user_set_min_timestamp(client->client.user, ts);
 }
@@ -301,7 +539,7 @@ static bool user_write_mail(struct user_client *uc)
 			return TRUE;
 
 		/* disable WRITE_MAIL timeout until writing is finished */
-		uc->user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = (time_t)-1;
+		uc->user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = -1;
 		imap_client_append_full(client, PROFILE_MAILBOX_DRAFTS,
 					"\\Draft", "",
 					user_draft_callback, &uc->draft_cmd);
@@ -388,7 +626,8 @@ static void deliver_new_mail(struct user *user, const char *mailbox)
 	struct smtp_address *rcpt_to;
 	const char *error;
 
-	if (smtp_address_parse_username(pool_datastack_create(), user->username,
+	if (smtp_address_parse_username(pool_datastack_create(),
+					user_get_username(user),
 		&rcpt_to, &error) < 0) {
 		i_fatal("Username is not a valid e-mail address: %s", error);
 	}
@@ -398,6 +637,7 @@ static void deliver_new_mail(struct user *user, const char *mailbox)
 			t_strdup_printf("%s+%s", rcpt_to->localpart, mailbox);
 	}
 
+	load_target_deliveries++;
 	imaptest_lmtp_send(user->profile->profile->lmtp_port,
 			   user->profile->profile->lmtp_max_parallel_count,
 			   rcpt_to, mailbox_source);
@@ -420,14 +660,16 @@ static bool user_client_is_connected(struct user_client *uc)
 static void user_set_next_mailbox_action(struct user *user)
 {
 	struct user_mailbox_cache *mailbox;
+	long long now = user_time_now();
 
 	array_foreach_elem(&user->active_client->mailboxes, mailbox) {
-		if (mailbox->next_action_timestamp <= ioloop_time &&
-		    mailbox->next_action_timestamp != (time_t)-1) {
+		if (mailbox->next_action_timestamp <= now &&
+		    mailbox->next_action_timestamp != -1) {
 			mailbox->next_action_timestamp =
 				user_mailbox_action(user, mailbox) ?
-				(ioloop_time + weighted_rand(user->profile->mail_action_repeat_delay)) :
-				(time_t)-1;
+				(now + profile_interval_rand(user->profile->mail_action_repeat_delay,
+							     user->profile->mail_action_repeat_delay_dist)) :
+				-1;
 		}
 		user_set_min_timestamp(user, mailbox->next_action_timestamp);
 	}
@@ -445,12 +687,65 @@ static void user_logout(struct user_client *uc)
 	}
 }
 
+static double profile_get_load(const struct profile *profile)
+{
+	const struct profile_load_point *points;
+	unsigned int i, count;
+	double secs, pos;
+
+	/* the load curve runs in the simulated time */
+	secs = (user_time_now() - profile->start_time) *
+		conf.time_scale / 1000.0;
+	switch (profile->load_shape) {
+	case PROFILE_LOAD_SHAPE_FLAT:
+		return 1;
+	case PROFILE_LOAD_SHAPE_SINE:
+		/* starts from the minimum, peaks at the middle of the period */
+		return (profile->load_min_percentage +
+			((double)profile->load_max_percentage -
+			 profile->load_min_percentage) *
+			(1 - cos(2 * M_PI * secs / profile->load_period)) / 2) /
+			100.0;
+	case PROFILE_LOAD_SHAPE_POINTS:
+		points = array_get(&profile->load_points, &count);
+		if (points[count-1].time > 0)
+			secs = fmod(secs, points[count-1].time);
+		if (secs <= points[0].time)
+			return points[0].percentage / 100.0;
+		for (i = 1; i < count; i++) {
+			if (secs < points[i].time) {
+				pos = (secs - points[i-1].time) /
+					(points[i].time - points[i-1].time);
+				return (points[i-1].percentage +
+					((double)points[i].percentage -
+					 points[i-1].percentage) * pos) / 100.0;
+			}
+		}
+		return points[count-1].percentage / 100.0;
+	}
+	i_unreached();
+}
+
+static bool user_is_load_active(struct user *user)
+{
+	return user->load_rank < profile_get_load(user->profile->profile) * 100;
+}
+
+static bool profile_load_rand(const struct profile *profile)
+{
+	if (profile->load_shape == PROFILE_LOAD_SHAPE_FLAT)
+		return TRUE;
+	return i_rand_limit(1000) < profile_get_load(profile) * 1000;
+}
+
 static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 				 bool user_connected)
 {
-	if (user->timestamps[ts] > ioloop_time)
+	long long now = user_time_now();
+
+	if (user->timestamps[ts] > now)
 		return -1;
-	if (user->timestamps[ts] == (time_t)-1) {
+	if (user->timestamps[ts] == -1) {
 		if (ts == USER_TIMESTAMP_LOGIN) {
 			user->timestamps[ts] = user_get_next_login_time(user);
 			user_set_min_timestamp(user, user->timestamps[ts]);
@@ -458,7 +753,7 @@ static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 			/* have to have a logout timestamp when there are
 			   connected clients. */
 			user->timestamps[ts] =
-				user_get_next_timeout(user, ioloop_time, ts);
+				user_get_next_timeout(user, now, ts);
 			i_assert(user->timestamps[ts] > 0);
 		}
 		return -1;
@@ -468,13 +763,24 @@ static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 	case USER_TIMESTAMP_LOGIN:
 		if (user_connected)
 			return 0;
+		if (!user_is_load_active(user)) {
+			/* not logging in at the current load */
+			user->timestamps[ts] = now + 1 +
+				i_rand_limit(user_time_interval(USER_LOAD_RECHECK_SECS));
+			return -1;
+		}
+		load_target_logins++;
 		client_new_user(user);
 		return -1;
 	case USER_TIMESTAMP_INBOX_DELIVERY:
-		deliver_new_mail(user, "INBOX");
+		/* deliveries are scheduled at the full load's rate and
+		   thinned out to the current load */
+		if (profile_load_rand(user->profile->profile))
+			deliver_new_mail(user, "INBOX");
 		return 1;
 	case USER_TIMESTAMP_SPAM_DELIVERY:
-		deliver_new_mail(user, "Spam");
+		if (profile_load_rand(user->profile->profile))
+			deliver_new_mail(user, "Spam");
 		return 1;
 	case USER_TIMESTAMP_WRITE_MAIL:
 		if (!user_connected)
@@ -499,23 +805,28 @@ static void user_run_actions(struct user *user)
 	enum user_timestamp ts;
 	bool user_connected = user_client_is_connected(user->active_client);
 
+	if (user->scheduled) {
+		priorityq_remove(users_queue, &user->schedule_item);
+		user->scheduled = FALSE;
+	}
+	user->next_min_timestamp = USER_TIME_NEVER;
+
 	if (disconnect_clients) {
 		if (user_connected)
 			user_logout(user->active_client);
 		return;
 	}
 
-	user->next_min_timestamp = INT_MAX;
 	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++) {
 		switch (user_timestamp_handle(user, ts, user_connected)) {
 		case -1:
 			break;
 		case 0:
-			user->timestamps[ts] = (time_t)-1;
+			user->timestamps[ts] = -1;
 			break;
 		case 1:
 			user->timestamps[ts] =
-				user_get_next_timeout(user, ioloop_time, ts);
+				user_get_next_timeout(user, user_time_now(), ts);
 			break;
 		}
 		user_set_min_timestamp(user, user->timestamps[ts]);
@@ -524,34 +835,54 @@ static void user_run_actions(struct user *user)
 		user_set_next_mailbox_action(user);
 }
 
-static void user_fill_timestamps(struct user *user, time_t start_time)
+static void user_fill_timestamps(struct user *user, long long start_time)
 {
 	enum user_timestamp ts;
-	unsigned int interval;
+	long long interval;
 
 	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++) {
-		interval = user_get_timeout_interval(user, ts);
-		user->timestamps[ts] = interval == 0 ? (time_t)-1 :
-			(time_t)(start_time + i_rand_limit(interval));
+		interval = user_time_interval(user_get_timeout_interval(user, ts));
+		user->timestamps[ts] = interval == 0 ? -1 :
+			start_time + i_rand_limit(I_MIN(interval, INT_MAX));
 		user_set_min_timestamp(user, user->timestamps[ts]);
 	}
 	user->timestamps[USER_TIMESTAMP_LOGIN] = start_time;
 	user_set_min_timestamp(user, start_time);
 }
 
+static int user_min_timestamp_cmp(const void *p1, const void *p2)
+{
+	const struct user *user1 =
+		container_of(p1, const struct user, schedule_item);
+	const struct user *user2 =
+		container_of(p2, const struct user, schedule_item);
+
+	if (user1->next_min_timestamp < user2->next_min_timestamp)
+		return -1;
+	if (user1->next_min_timestamp > user2->next_min_timestamp)
+		return 1;
+	return 0;
+}
+
 static void users_timeout(void *context ATTR_UNUSED)
 {
-	const ARRAY_TYPE(user) *users = users_get_sort_by_min_timestamp();
+	struct priorityq_item *item;
 	struct user *user;
+	long long now = user_time_now();
 
 	timeout_remove(&to_users);
-	array_foreach_elem(users, user) {
-		if (ioloop_time < user->next_min_timestamp &&
-		    !disconnect_clients) {
-			/* wait for the next user's event */
-			break;
+	if (disconnect_clients) {
+		array_foreach_elem(users_get_all(), user)
+			user_run_actions(user);
+	} else {
+		while ((item = priorityq_peek(users_queue)) != NULL) {
+			user = container_of(item, struct user, schedule_item);
+			if (now < user->next_min_timestamp) {
+				/* wait for the next user's event */
+				break;
+			}
+			user_run_actions(user);
 		}
-		user_run_actions(user);
 	}
 	/* make sure a timeout is always set */
 	if (to_users == NULL)
@@ -560,32 +891,50 @@ static void users_timeout(void *context ATTR_UNUSED)
 
 static void users_timeout_update(void)
 {
+	struct priorityq_item *item;
+	const struct user *user;
+	long long msecs;
+
 	if (to_users != NULL)
 		timeout_remove(&to_users);
-	if (users_min_timestamp <= ioloop_time)
-		to_users = timeout_add_short(500, users_timeout, (void *)NULL);
+	item = priorityq_peek(users_queue);
+	if (item == NULL)
+		msecs = USER_ACTION_RETRY_MSECS;
 	else {
-		to_users = timeout_add((users_min_timestamp - ioloop_time) * 1000,
-				       users_timeout, (void *)NULL);
+		user = container_of(item, struct user, schedule_item);
+		msecs = user->next_min_timestamp - user_time_now();
+		if (msecs < 0)
+			msecs = 0;
+		else if (msecs > INT_MAX)
+			msecs = INT_MAX;
 	}
+	to_users = timeout_add_short(msecs, users_timeout, (void *)NULL);
 }
 
-static void user_set_min_timestamp(struct user *user, time_t min_timestamp)
+static void user_set_min_timestamp(struct user *user, long long min_timestamp)
 {
+	long long now = user_time_now(), retry_msecs;
+
 	if (min_timestamp <= 0)
 		return;
-	if (min_timestamp <= ioloop_time) {
-		/* always set timestamps to future so we don't run the timeout
-		   multiple times within second (which is bad if users are
-		   sorted multiple times a second) */
-		min_timestamp = ioloop_time;
-	}
-	if (user->next_min_timestamp > min_timestamp)
-		user->next_min_timestamp = min_timestamp;
-	if (users_min_timestamp > min_timestamp) {
-		users_min_timestamp = min_timestamp;
-		users_timeout_update();
+	if (min_timestamp <= now) {
+		/* always set timestamps to future so actions that can't be
+		   done yet don't keep the scheduler busy */
+		retry_msecs = (long long)(USER_ACTION_RETRY_MSECS /
+					  conf.time_scale);
+		min_timestamp = now + I_MAX(retry_msecs, 1);
 	}
+	if (user->scheduled) {
+		if (user->next_min_timestamp <= min_timestamp)
+			return;
+		priorityq_remove(users_queue, &user->schedule_item);
+	}
+	user->next_min_timestamp = min_timestamp;
+	priorityq_add(users_queue, &user->schedule_item);
+	user->scheduled = TRUE;
+
+	if (priorityq_peek(users_queue) == &user->schedule_item)
+		users_timeout_update();
 }
 
 static void
@@ -601,9 +950,9 @@ user_add_client_profile(struct user *user, struct profile_client *profile)
 	array_append(&user->clients, &uc, 1);
 }
 
-static void
-user_init_client_profiles(struct user *user, struct profile *profile)
+void profile_user_init_clients(struct user *user)
 {
+	struct profile *profile = user->profile->profile;
 	struct profile_client *client;
 
 	p_array_init(&user->clients, user->pool,
@@ -616,49 +965,25 @@ user_init_client_profiles(struct user *user, struct profile *profile)
 	}
 }
 
-static void
-get_next_username(const struct profile_user *user_profile,
-		  struct istream *users_input,
-		  string_t *username, string_t *password, unsigned int i)
+const char *
+profile_user_get_username(const struct profile_user *user_profile,
+			  unsigned int i)
 {
 	char num[10];
 	struct var_expand_table tab[] = {
 		{ 'n', num, NULL },
 		{ '\0', NULL, NULL }
 	};
-	const char *line, *error;
-
-	str_truncate(username, 0);
-	str_truncate(password, 0);
-
-	if (users_input == NULL) {
-		i_snprintf(num, sizeof(num), "%u",
-			   user_profile->username_start_index + i-1);
-		if (var_expand(username, user_profile->username_format, tab,
-			       &error) < 0)
-			i_error("var_expand(%s) failed: %s",
-				user_profile->username_format, error);
-		return;
-	}
-
-	while ((line = i_stream_read_next_line(users_input)) != NULL) {
-		if (*line != '\0' && *line != ':') {
-			const char *p = strchr(line, ':');
-			if (p == NULL)
-				str_append(username, line);
-			else {
-				str_append_data(username, line, p-line);
-				str_append(password, p+1);
-			}
-			return;
-		}
-	}
+	string_t *username = t_str_new(64);
+	const char *error;
 
-	if (users_input->stream_errno != 0)
-		i_fatal("Failed to read userfile %s: failed: %s",
-			user_profile->userfile, i_stream_get_error(users_input));
-	i_fatal("userfile %s ends too early - must have at least user_count=%u users",
-		user_profile->userfile, user_profile->user_count);
+	i_snprintf(num, sizeof(num), "%u",
+		   user_profile->username_start_index + i-1);
+	if (var_expand(username, user_profile->username_format, tab,
+		       &error) < 0)
+		i_error("var_expand(%s) failed: %s",
+			user_profile->username_format, error);
+	return str_c(username);
 }
 
 static void
@@ -667,49 +992,110 @@ users_add_from_user_profile(const struct profile_user *user_profile,
 			    struct mailbox_source *source)
 {
 	struct user *user;
-	struct istream *users_input;
-	string_t *username = t_str_new(64);
-	string_t *password = t_str_new(64);
+	struct userfile *userfile;
+	const char *username, *password;
 	unsigned int i;
-	time_t start_time;
+	long long start_time, now = user_time_now();
 
 	if (user_profile->userfile == NULL)
-		users_input = NULL;
+		userfile = NULL;
 	else {
-		users_input = i_stream_create_file(user_profile->userfile, (size_t)-1);
-		i_stream_set_return_partial_line(users_input, TRUE);
+		userfile = userfile_open(user_profile->userfile);
+		if (userfile_get_count(userfile) < user_profile->user_count) {
+			i_fatal("userfile %s ends too early - must have at least user_count=%u users",
+				user_profile->userfile, user_profile->user_count);
+		}
+		/* the users point to the userfile's memory */
+		array_append(&profile_userfiles, &userfile, 1);
 	}
 
 	for (i = 1; i <= user_profile->user_count; i++) {
-		start_time = ioloop_time + profile->rampup_time *
+		start_time = now + user_time_interval(profile->rampup_time) *
 			i / user_profile->user_count;
 
-		get_next_username(user_profile, users_input,
-				  username, password, i);
-
-		user = user_get(str_c(username), source);
-		if (str_len(password) > 0)
-			user->password = p_strdup(user->pool, str_c(password));
-		user->profile = user_profile;
-		user_init_client_profiles(user, profile);
+		if (userfile == NULL) {
+			/* username is generated only when it's needed */
+			user = user_new_profile(user_profile, i, NULL, NULL,
+						source);
+		} else {
+			userfile_get(userfile, i-1, &username, &password);
+			if (password != NULL && *password == '\0')
+				password = NULL;
+			user = user_new_profile(user_profile, 0, username,
+						password, source);
+		}
+		user->load_rank = i_rand_limit(100);
 		user_fill_timestamps(user, start_time);
 		array_append(users, &user, 1);
 	}
-	i_stream_unref(&users_input);
+}
+
+static const char *profile_get_stats_name(const char *type, const char *name,
+					  unsigned int idx)
+{
+	if (name[0] != '\0')
+		return t_strdup_printf("%s %s", type, name);
+	return t_strdup_printf("%s #%u", type, idx + 1);
 }
 
 void profile_add_users(struct profile *profile, ARRAY_TYPE(user) *users,
 		       struct mailbox_source *source)
 {
+	struct profile_client *client;
 	struct profile_user *user;
+	unsigned int i;
 
+	load_profile = profile;
+	profile->start_time = user_time_now();
+	for (i = 0; i < array_count(&profile->clients); i++) {
+		client = array_idx_elem(&profile->clients, i);
+		client->stats_group = stats_group_register(
+			profile_get_stats_name("client", client->name, i));
+	}
+	for (i = 0; i < array_count(&profile->users); i++) {
+		user = array_idx_elem(&profile->users, i);
+		user->stats_group = stats_group_register(
+			profile_get_stats_name("user", user->name, i));
+	}
 	i_array_init(users, 128);
+	i_array_init(&profile_userfiles, 4);
+	users_queue = priorityq_init(user_min_timestamp_cmp, 128);
 	array_foreach_elem(&profile->users, user)
 		users_add_from_user_profile(user, profile, users, source);
+	if (array_count(users) > 0) {
+		printf("%u profile users, %zu bytes/user before login\n",
+		       array_count(users),
+		       users_get_profile_memory_used() / array_count(users));
+	}
+}
+
+bool profile_load_stats_next(struct profile_load_stats *stats_r)
+{
+	if (load_profile == NULL ||
+	    load_profile->load_shape == PROFILE_LOAD_SHAPE_FLAT)
+		return FALSE;
+
+	stats_r->target_percentage =
+		(unsigned int)(profile_get_load(load_profile) * 100 + 0.5);
+	stats_r->target_logins = load_target_logins;
+	stats_r->target_deliveries = load_target_deliveries;
+	load_target_logins = 0;
+	load_target_deliveries = 0;
+	return TRUE;
 }
 
 void profile_deinit(void)
 {
+	struct userfile **userfilep;
+
 	if (to_users != NULL)
 		timeout_remove(&to_users);
+	if (users_queue != NULL)
+		priorityq_deinit(&users_queue);
+	load_profile = NULL;
+	if (array_is_created(&profile_userfiles)) {
+		array_foreach_modifiable(&profile_userfiles, userfilep)
+			userfile_close(userfilep);
+		array_free(&profile_userfiles);
+	}
 }
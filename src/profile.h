@@ -9,6 +9,24 @@
 
 struct imap_arg;
 struct imap_client;
+struct profile_dist;
+
+enum profile_imap_sync {
+	/* IDLE, fetch new mails on EXISTS */
+	PROFILE_IMAP_SYNC_IDLE = 0,
+	/* NOOP every imap_poll_interval */
+	PROFILE_IMAP_SYNC_POLL,
+	/* fetch all flags after SELECT, then IDLE */
+	PROFILE_IMAP_SYNC_FULL,
+	/* ENABLE CONDSTORE, fetch flags CHANGEDSINCE the previous session's
+	   HIGHESTMODSEQ after SELECT, then IDLE */
+	PROFILE_IMAP_SYNC_CONDSTORE,
+	/* ENABLE QRESYNC, SELECT with the previous session's UIDVALIDITY and
+	   HIGHESTMODSEQ, then IDLE */
+	PROFILE_IMAP_SYNC_QRESYNC,
+	/* NOTIFY SET for the selected mailbox and wait */
+	PROFILE_IMAP_SYNC_NOTIFY
+};
 
 struct profile_client {
 	const char *name;
@@ -16,11 +34,23 @@ struct profile_client {
 	unsigned int percentage;
 	unsigned int connection_max_count;
 	bool pop3_keep_mails;
+	bool pop3_list;
+	bool pop3_top;
+	unsigned int pop3_top_lines;
 	bool imap_idle;
 	const char *imap_fetch_immediate;
 	const char *imap_fetch_manual;
 	unsigned int imap_status_interval;
 	unsigned int login_interval;
+	const char *imap_sync;
+	unsigned int imap_poll_interval;
+	bool imap_list_status;
+
+	/* parsed imap_sync */
+	enum profile_imap_sync imap_sync_type;
+
+	/* stats_group_register() index for the per-profile breakdown */
+	unsigned int stats_group;
 };
 ARRAY_DEFINE_TYPE(profile_client, struct profile_client *);
 
@@ -64,9 +94,44 @@ struct profile_user {
 	unsigned int mail_write_duration;
 	/* How large mails does the user typically write */
 	uoff_t mail_write_size;
+	/* How many folders the user has in addition to INBOX and the special
+	   folders, and how deep the folder tree is */
+	unsigned int mail_folder_count;
+	unsigned int mail_folder_depth;
+	/* the generated folder names, parents before their children */
+	ARRAY_TYPE(const_string) mail_folders;
+
+	/* Random distributions for the intervals above, if they were given
+	   as a distribution spec (see profile-dist.h). NULL means the
+	   default distribution around the setting's value. */
+	const struct profile_dist *mail_session_length_dist;
+	const struct profile_dist *mail_inbox_delivery_interval_dist;
+	const struct profile_dist *mail_spam_delivery_interval_dist;
+	const struct profile_dist *mail_send_interval_dist;
+	const struct profile_dist *mail_action_delay_dist;
+	const struct profile_dist *mail_action_repeat_delay_dist;
+	const struct profile_dist *mail_write_duration_dist;
+
+	/* stats_group_register() index for the per-profile breakdown */
+	unsigned int stats_group;
 };
 ARRAY_DEFINE_TYPE(profile_user, struct profile_user *);
 
+enum profile_load_shape {
+	/* full load all the time (after rampup_time) */
+	PROFILE_LOAD_SHAPE_FLAT = 0,
+	/* linearly interpolated between load_points */
+	PROFILE_LOAD_SHAPE_POINTS,
+	/* sine wave between load_min/max_percentage */
+	PROFILE_LOAD_SHAPE_SINE
+};
+
+struct profile_load_point {
+	/* seconds since the start of the test */
+	unsigned int time;
+	unsigned int percentage;
+};
+
 struct profile {
 	pool_t pool;
 	const char *path;
@@ -77,6 +142,24 @@ struct profile {
 	unsigned int lmtp_max_parallel_count;
 	unsigned int total_user_count;
 	unsigned int rampup_time;
+
+	/* load_curve setting. The load scales the fraction of users that
+	   log in and the rate of mail deliveries. */
+	enum profile_load_shape load_shape;
+	/* sorted by time, the curve repeats after the last point */
+	ARRAY(struct profile_load_point) load_points;
+	unsigned int load_period;
+	unsigned int load_min_percentage, load_max_percentage;
+	/* user_time_now() when the users were added */
+	long long start_time;
+};
+
+struct profile_load_stats {
+	/* the load_curve's current load */
+	unsigned int target_percentage;
+	/* how many logins and deliveries the load curve started since the
+	   previous call */
+	unsigned int target_logins, target_deliveries;
 };
 
 struct profile *profile_parse(const char *path);
@@ -86,6 +169,16 @@ int imap_client_profile_handle_untagged(struct imap_client *client,
 
 void profile_add_users(struct profile *profile, ARRAY_TYPE(user) *users,
 		       struct mailbox_source *source);
+/* Create the user's clients based on the profile. */
+void profile_user_init_clients(struct user *user);
+/* Generate the i'th (1..user_count) username from username_format. */
+const char *
+profile_user_get_username(const struct profile_user *user_profile,
+			  unsigned int i);
+
+/* Returns FALSE if there's no load_curve. Otherwise returns the load stats
+   and resets the counters. */
+bool profile_load_stats_next(struct profile_load_stats *stats_r);
 
 void profile_deinit(void);
 
@@ -0,0 +1,190 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "iostream-rawlog.h"
+#include "settings.h"
+#include "client.h"
+#include "rawlog.h"
+
+/* rawlog_on_error keeps this much of each connection's latest traffic */
+#define RAWLOG_ERROR_BUFFER_SIZE (1024*64)
+#define RAWLOG_FLUSH_INTERVAL_MSECS 1000
+
+struct rawlog_client {
+	unsigned int global_id;
+	/* the connection's own file, or a memory buffer with rawlog_shared */
+	struct ostream *output;
+	buffer_t *buf;
+
+	bool error:1;
+};
+
+static struct ostream *rawlog_shared_output;
+static struct timeout *to_rawlog_flush;
+
+static void rawlog_client_flush(struct rawlog_client *rc, bool partial)
+{
+	const unsigned char *data = rc->buf->data, *p;
+	size_t pos = 0, end, size = rc->buf->used;
+	const char *prefix;
+
+	prefix = t_strdup_printf("%u ", rc->global_id);
+	while (pos < size) {
+		p = memchr(data + pos, '\n', size - pos);
+		if (p == NULL && !partial)
+			break;
+		end = p == NULL ? size : (size_t)(p - data) + 1;
+		o_stream_nsend_str(rawlog_shared_output, prefix);
+		o_stream_nsend(rawlog_shared_output, data + pos, end - pos);
+		if (p == NULL)
+			o_stream_nsend(rawlog_shared_output, "\n", 1);
+		pos = end;
+	}
+	buffer_delete(rc->buf, 0, pos);
+}
+
+static void rawlog_client_trim(struct rawlog_client *rc)
+{
+	const unsigned char *data = rc->buf->data, *p;
+	size_t skip;
+
+	if (rc->buf->used <= RAWLOG_ERROR_BUFFER_SIZE)
+		return;
+
+	/* drop the oldest lines */
+	skip = rc->buf->used - RAWLOG_ERROR_BUFFER_SIZE;
+	p = memchr(data + skip, '\n', rc->buf->used - skip);
+	buffer_delete(rc->buf, 0, p == NULL ? rc->buf->used :
+		      (size_t)(p - data) + 1);
+}
+
+static void rawlog_flush_timeout(void *context ATTR_UNUSED)
+{
+	struct client *client;
+
+	o_stream_cork(rawlog_shared_output);
+	array_foreach_elem(&clients, client) {
+		if (client == NULL || client->rawlog == NULL)
+			continue;
+		if (!conf.rawlog_on_error || client->rawlog->error)
+			rawlog_client_flush(client->rawlog, FALSE);
+		else
+			rawlog_client_trim(client->rawlog);
+	}
+	o_stream_uncork(rawlog_shared_output);
+}
+
+void rawlog_init(void)
+{
+	if (conf.rawlog_shared_path == NULL)
+		return;
+
+	rawlog_shared_output = o_stream_create_file(conf.rawlog_shared_path,
+						    0, 0600, 0);
+	if (rawlog_shared_output->stream_errno != 0) {
+		i_fatal("rawlog_shared: %s",
+			o_stream_get_error(rawlog_shared_output));
+	}
+	to_rawlog_flush = timeout_add(RAWLOG_FLUSH_INTERVAL_MSECS,
+				      rawlog_flush_timeout, NULL);
+}
+
+void rawlog_deinit(void)
+{
+	if (rawlog_shared_output == NULL)
+		return;
+
+	timeout_remove(&to_rawlog_flush);
+	if (o_stream_finish(rawlog_shared_output) < 0) {
+		i_error("write(%s) failed: %s", conf.rawlog_shared_path,
+			o_stream_get_error(rawlog_shared_output));
+	}
+	o_stream_destroy(&rawlog_shared_output);
+}
+
+void rawlog_client_init(struct client *client)
+{
+	struct rawlog_client *rc;
+	const char *path;
+
+	if (!conf.rawlog && conf.rawlog_shared_path == NULL)
+		return;
+	if (conf.rawlog_sample_percent < 100 &&
+	    i_rand_limit(10000) >= conf.rawlog_sample_percent * 100)
+		return;
+
+	rc = i_new(struct rawlog_client, 1);
+	rc->global_id = client->global_id;
+	if (conf.rawlog_shared_path != NULL) {
+		rc->buf = buffer_create_dynamic(default_pool, 1024);
+		rc->output = o_stream_create_buffer(rc->buf);
+	} else {
+		path = t_strdup_printf("rawlog.%u", client->global_id);
+		rc->output = o_stream_create_file(path, 0, 0600, 0);
+		if (rc->output->stream_errno != 0) {
+			i_error("rawlog: %s", o_stream_get_error(rc->output));
+			o_stream_destroy(&rc->output);
+			i_free(rc);
+			return;
+		}
+	}
+	o_stream_set_no_error_handling(rc->output, TRUE);
+	/* the rawlog streams take the reference, keep our own for the
+	   notes */
+	o_stream_ref(rc->output);
+	iostream_rawlog_create_from_stream(rc->output, &client->input,
+					   &client->output);
+	client->rawlog = rc;
+}
+
+void rawlog_client_deinit(struct client *client)
+{
+	struct rawlog_client *rc = client->rawlog;
+
+	if (rc == NULL)
+		return;
+
+	client->rawlog = NULL;
+	/* the connection's streams are already destroyed, so this was the
+	   last reference */
+	o_stream_unref(&rc->output);
+	if (rc->buf != NULL) {
+		if (!conf.rawlog_on_error || rc->error)
+			rawlog_client_flush(rc, TRUE);
+		buffer_free(&rc->buf);
+	}
+	i_free(rc);
+}
+
+bool rawlog_client_is_logged(struct client *client)
+{
+	return client->rawlog != NULL;
+}
+
+void rawlog_client_write(struct client *client, const void *data, size_t size)
+{
+	if (client->rawlog != NULL)
+		o_stream_nsend(client->rawlog->output, data, size);
+}
+
+void rawlog_client_error(struct client *client)
+{
+	struct rawlog_client *rc = client->rawlog;
+	const char *line;
+
+	if (rc == NULL || rc->buf == NULL || rc->error)
+		return;
+
+	rc->error = TRUE;
+	if (!conf.rawlog_on_error)
+		return;
+
+	line = t_strdup_printf("%u ** %s: error, the preceding traffic:\n",
+			       client->global_id, client->user->username);
+	o_stream_nsend_str(rawlog_shared_output, line);
+	rawlog_client_flush(rc, TRUE);
+}
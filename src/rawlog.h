@@ -0,0 +1,28 @@
+#ifndef RAWLOG_H
+#define RAWLOG_H
+
+struct client;
+
+/* Connection rawlogs. By default each logged connection writes its own
+   rawlog.<id> file. With rawlog_shared=<path> all the connections are
+   buffered in memory and written to a single file once a second, each line
+   prefixed with the connection's global ID. With rawlog_on_error only the
+   connection's latest RAWLOG_ERROR_BUFFER_SIZE bytes are kept, and they're
+   written to the shared file only if the connection hits an error. */
+
+void rawlog_init(void);
+void rawlog_deinit(void);
+
+/* Start logging the connection's input and output, if it's sampled. */
+void rawlog_client_init(struct client *client);
+/* Flush and free the connection's rawlog. */
+void rawlog_client_deinit(struct client *client);
+/* Returns TRUE if the connection is being logged. */
+bool rawlog_client_is_logged(struct client *client);
+/* Add imaptest's own notes to the connection's rawlog. */
+void rawlog_client_write(struct client *client, const void *data, size_t size);
+/* The connection hit an error. Write its buffered rawlog and keep logging
+   it from now on. */
+void rawlog_client_error(struct client *client);
+
+#endif
@@ -0,0 +1,606 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "ioloop.h"
+#include "imap-arg.h"
+#include "imap-quote.h"
+#include "settings.h"
+#include "mailbox.h"
+#include "imap-client.h"
+#include "commands.h"
+#include "user.h"
+#include "replay.h"
+
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+struct replay {
+	pool_t pool;
+	ARRAY(struct replay_session) sessions;
+	unsigned int next_session_idx;
+
+	unsigned int sessions_started;
+	unsigned int commands_sent, commands_failed, commands_skipped;
+};
+
+struct replay_line {
+	/* offset in the client data */
+	size_t offset;
+	/* absolute timestamp, 0 if none */
+	unsigned long long msecs;
+};
+ARRAY_DEFINE_TYPE(replay_line, struct replay_line);
+
+struct replay_state_name {
+	const char *name;
+	enum client_state state;
+};
+
+static const struct replay_state_name replay_state_names[] = {
+	{ "LIST", STATE_LIST },
+	{ "LSUB", STATE_LIST },
+	{ "XLIST", STATE_LIST },
+	{ "CREATE", STATE_MCREATE },
+	{ "DELETE", STATE_MDELETE },
+	{ "SUBSCRIBE", STATE_MSUBS },
+	{ "UNSUBSCRIBE", STATE_MSUBS },
+	{ "STATUS", STATE_STATUS },
+	{ "SELECT", STATE_SELECT },
+	{ "EXAMINE", STATE_SELECT },
+	{ "SEARCH", STATE_SEARCH },
+	{ "SORT", STATE_SORT },
+	{ "THREAD", STATE_THREAD },
+	{ "COPY", STATE_COPY },
+	{ "MOVE", STATE_COPY },
+	{ "EXPUNGE", STATE_EXPUNGE },
+	{ "APPEND", STATE_APPEND },
+	{ "NOOP", STATE_NOOP },
+	{ "IDLE", STATE_IDLE },
+	{ "CHECK", STATE_CHECK },
+	{ "ENABLE", STATE_ENABLE },
+	{ "NOTIFY", STATE_NOTIFY }
+};
+
+/* commands that imaptest does itself or that would break the connection */
+static const char *const replay_skip_commands[] = {
+	"LOGIN", "AUTHENTICATE", "LOGOUT", "STARTTLS", "COMPRESS"
+};
+
+static unsigned long long replay_parse_timestamp(const char **_line)
+{
+	const char *line = *_line, *p;
+	uint64_t secs, usecs;
+
+	if (str_parse_uint64(line, &secs, &p) < 0 || *p != '.' ||
+	    str_parse_uint64(p + 1, &usecs, &p) < 0 || *p != ' ')
+		return 0;
+	*_line = p + 1;
+	return secs * 1000 + usecs / 1000;
+}
+
+static void
+replay_read_client_data(const buffer_t *file, buffer_t *data,
+			ARRAY_TYPE(replay_line) *lines)
+{
+	const unsigned char *p = file->data, *end = p + file->used;
+	const unsigned char *eol;
+	struct replay_line *line;
+	const char *str;
+	unsigned long long msecs;
+	size_t prefix_len;
+	bool partial = FALSE, prev_partial = FALSE;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol == NULL ? end : eol + 1;
+
+		/* the timestamp and direction prefixes are plain text */
+		str = t_strndup(p, I_MIN(eol - p, 64));
+		prefix_len = strlen(str);
+		msecs = replay_parse_timestamp(&str);
+		if (str_begins_with(str, "I: ") || str_begins_with(str, "I> ")) {
+			/* imaptest rawlog: server output */
+			p = eol;
+			continue;
+		}
+		if (str_begins_with(str, "O: ") || str_begins_with(str, "O> ")) {
+			partial = str[1] == '>';
+			str += 3;
+		}
+		prefix_len -= strlen(str);
+
+		if (!prev_partial) {
+			line = array_append_space(lines);
+			line->offset = data->used;
+			line->msecs = msecs;
+		}
+		if (partial && eol[-1] == '\n')
+			buffer_append(data, p + prefix_len, eol - p - prefix_len - 1);
+		else
+			buffer_append(data, p + prefix_len, eol - p - prefix_len);
+		prev_partial = partial;
+		partial = FALSE;
+		p = eol;
+	}
+}
+
+static bool
+replay_line_get_literal_size(const unsigned char *line, size_t len,
+			     uoff_t *size_r)
+{
+	const unsigned char *p;
+	uoff_t size = 0, mul = 1;
+
+	if (len > 0 && line[len-1] == '\n')
+		len--;
+	if (len > 0 && line[len-1] == '\r')
+		len--;
+	if (len < 3 || line[len-1] != '}')
+		return FALSE;
+	p = line + len - 2;
+	if (*p == '+')
+		p--;
+	if (p <= line || !i_isdigit(*p))
+		return FALSE;
+	for (; p > line && i_isdigit(*p); p--) {
+		size += (*p - '0') * mul;
+		mul *= 10;
+	}
+	if (*p != '{')
+		return FALSE;
+	*size_r = size;
+	return TRUE;
+}
+
+static enum client_state
+replay_command_get_state(const char *name, const char *args)
+{
+	unsigned int i;
+
+	args = t_str_ucase(args);
+	if (strcmp(name, "FETCH") == 0) {
+		/* FETCH2 is imaptest's body fetching */
+		if (strstr(args, "BODY[") != NULL ||
+		    strstr(args, "BODY.PEEK[") != NULL ||
+		    strstr(args, "BINARY") != NULL ||
+		    strstr(args, "RFC822 ") != NULL ||
+		    strstr(args, "RFC822)") != NULL ||
+		    strstr(args, "RFC822.TEXT") != NULL)
+			return STATE_FETCH2;
+		return STATE_FETCH;
+	}
+	if (strcmp(name, "STORE") == 0) {
+		return strstr(args, "\\DELETED") != NULL ?
+			STATE_STORE_DEL : STATE_STORE;
+	}
+	if (strcmp(name, "LIST") == 0 && strstr(args, "RETURN") != NULL &&
+	    strstr(args, "STATUS") != NULL)
+		return STATE_LIST_STATUS;
+
+	for (i = 0; i < N_ELEMENTS(replay_state_names); i++) {
+		if (strcmp(replay_state_names[i].name, name) == 0)
+			return replay_state_names[i].state;
+	}
+	/* CAPABILITY, NAMESPACE, ID, CLOSE, etc. */
+	return STATE_NOOP;
+}
+
+static void
+replay_session_add_command(struct replay *replay,
+			   struct replay_session *session,
+			   const unsigned char *data, size_t size,
+			   unsigned int msecs)
+{
+	struct replay_command *cmd;
+	const unsigned char *eol;
+	const char *first_line, *p, *name, *args, *set;
+	char *line;
+	unsigned int i, tag_len;
+	bool uid = FALSE;
+
+	eol = memchr(data, '\n', size);
+	first_line = t_strndup(data, eol == NULL ? size : (size_t)(eol - data));
+	if (eol != NULL && first_line[0] != '\0' &&
+	    first_line[strlen(first_line)-1] == '\r')
+		first_line = t_strndup(first_line, strlen(first_line) - 1);
+
+	/* <tag> <command> [<args>] - skips also IDLE's DONE and SASL
+	   continuations */
+	p = strchr(first_line, ' ');
+	if (p == NULL || p == first_line || p[1] == '\0')
+		return;
+	tag_len = p - first_line + 1;
+	args = p + 1;
+	p = strchr(args, ' ');
+	name = t_str_ucase(p == NULL ? args : t_strdup_until(args, p));
+	args = p == NULL ? "" : p + 1;
+	if (strcmp(name, "UID") == 0) {
+		uid = TRUE;
+		p = strchr(args, ' ');
+		name = t_str_ucase(p == NULL ? args : t_strdup_until(args, p));
+		args = p == NULL ? "" : p + 1;
+	}
+	for (i = 0; i < N_ELEMENTS(replay_skip_commands); i++) {
+		if (strcmp(name, replay_skip_commands[i]) == 0)
+			return;
+	}
+
+	cmd = array_append_space(&session->commands);
+	cmd->msecs = msecs;
+	cmd->state = replay_command_get_state(name, args);
+	cmd->line_len = size - tag_len;
+	line = p_malloc(replay->pool, cmd->line_len + 1);
+	memcpy(line, data + tag_len, cmd->line_len);
+	cmd->line = line;
+	cmd->literal = eol != NULL;
+	cmd->uid = uid;
+
+	if (strcmp(name, "FETCH") == 0 || strcmp(name, "STORE") == 0 ||
+	    strcmp(name, "COPY") == 0 || strcmp(name, "MOVE") == 0 ||
+	    (uid && strcmp(name, "EXPUNGE") == 0)) {
+		set = t_strcut(args, ' ');
+		if (*set != '\0') {
+			cmd->set_pos = args - first_line - tag_len;
+			cmd->set_len = strlen(set);
+		}
+	}
+}
+
+static void
+replay_parse_session(struct replay *replay, const char *path,
+		     const buffer_t *file)
+{
+	struct replay_session *session;
+	ARRAY_TYPE(replay_line) lines;
+	const struct replay_line *line;
+	const unsigned char *data, *eol;
+	buffer_t *client_data;
+	unsigned long long base_msecs = 0, msecs;
+	size_t pos, end, size, cmd_size;
+	unsigned int line_idx = 0, line_count;
+	uoff_t literal_size;
+	bool truncated;
+
+	client_data = t_buffer_create(file->used);
+	t_array_init(&lines, 64);
+	replay_read_client_data(file, client_data, &lines);
+	line = array_get(&lines, &line_count);
+
+	session = array_append_space(&replay->sessions);
+	session->path = p_strdup(replay->pool, path);
+	p_array_init(&session->commands, replay->pool, 16);
+
+	data = client_data->data;
+	size = client_data->used;
+	for (pos = 0; pos < size; pos = end) {
+		eol = memchr(data + pos, '\n', size - pos);
+		end = eol == NULL ? size : (size_t)(eol - data) + 1;
+		truncated = FALSE;
+		while (replay_line_get_literal_size(data + pos, end - pos,
+						    &literal_size)) {
+			/* the command continues after the literal */
+			if (literal_size >= size - end) {
+				/* the session ends within or right after the
+				   literal. a partial literal can't be sent. */
+				truncated = literal_size > size - end;
+				end = size;
+				eol = NULL;
+				break;
+			}
+			end += literal_size;
+			eol = memchr(data + end, '\n', size - end);
+			end = eol == NULL ? size : (size_t)(eol - data) + 1;
+		}
+		if (truncated)
+			break;
+
+		/* strip only the final CRLF. anything before it may be
+		   a part of a literal. */
+		cmd_size = end - pos;
+		if (eol != NULL) {
+			cmd_size--;
+			if (cmd_size > 0 && data[pos + cmd_size - 1] == '\r')
+				cmd_size--;
+		}
+
+		while (line_idx + 1 < line_count &&
+		       line[line_idx + 1].offset <= pos)
+			line_idx++;
+		msecs = line_count == 0 ? 0 : line[line_idx].msecs;
+		if (base_msecs == 0)
+			base_msecs = msecs;
+		T_BEGIN {
+			replay_session_add_command(replay, session,
+				data + pos, cmd_size,
+				msecs < base_msecs ? 0 : msecs - base_msecs);
+		} T_END;
+	}
+}
+
+static void replay_read_file(struct replay *replay, const char *path)
+{
+	struct istream *input;
+	const unsigned char *data;
+	buffer_t *file;
+	size_t size;
+	int ret;
+
+	file = t_buffer_create(1024*16);
+	input = i_stream_create_file(path, (size_t)-1);
+	while ((ret = i_stream_read_more(input, &data, &size)) > 0) {
+		buffer_append(file, data, size);
+		i_stream_skip(input, size);
+	}
+	i_assert(ret == -1);
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_destroy(&input);
+
+	replay_parse_session(replay, path, file);
+}
+
+struct replay *replay_parse(const char *path)
+{
+	struct replay *replay;
+	struct stat st;
+	struct dirent *d;
+	DIR *dir;
+
+	replay = i_new(struct replay, 1);
+	replay->pool = pool_alloconly_create("replay", 1024*64);
+	p_array_init(&replay->sessions, replay->pool, 64);
+
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	if (!S_ISDIR(st.st_mode)) {
+		T_BEGIN {
+			replay_read_file(replay, path);
+		} T_END;
+	} else {
+		dir = opendir(path);
+		if (dir == NULL)
+			i_fatal("opendir(%s) failed: %m", path);
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] == '.')
+				continue;
+			T_BEGIN {
+				replay_read_file(replay, t_strdup_printf(
+					"%s/%s", path, d->d_name));
+			} T_END;
+		}
+		if (closedir(dir) < 0)
+			i_error("closedir(%s) failed: %m", path);
+	}
+	if (array_count(&replay->sessions) == 0)
+		i_fatal("replay %s: No sessions found", path);
+	return replay;
+}
+
+void replay_deinit(struct replay **_replay)
+{
+	struct replay *replay = *_replay;
+
+	*_replay = NULL;
+	pool_unref(&replay->pool);
+	i_free(replay);
+}
+
+const struct replay_session *replay_get_next_session(struct replay *replay)
+{
+	const struct replay_session *session;
+
+	session = array_idx(&replay->sessions, replay->next_session_idx);
+	if (++replay->next_session_idx == array_count(&replay->sessions))
+		replay->next_session_idx = 0;
+	replay->sessions_started++;
+	return session;
+}
+
+bool replay_have_state(const struct replay *replay, enum client_state state)
+{
+	const struct replay_session *session;
+	const struct replay_command *cmd;
+
+	array_foreach(&replay->sessions, session) {
+		array_foreach(&session->commands, cmd) {
+			if (cmd->state == state)
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static uint32_t replay_remap_num(uint32_t num, uint32_t max)
+{
+	return (num - 1) % max + 1;
+}
+
+static void
+replay_append_remapped_set(string_t *dest, const char *set, uint32_t max)
+{
+	const char *const *ranges, *p;
+	uint32_t num1, num2;
+	unsigned int i;
+
+	ranges = t_strsplit(set, ",");
+	for (i = 0; ranges[i] != NULL; i++) {
+		if (i > 0)
+			str_append_c(dest, ',');
+		p = strchr(ranges[i], ':');
+		if (p == NULL) {
+			if (str_to_uint32(ranges[i], &num1) < 0 || num1 == 0)
+				str_append(dest, ranges[i]);
+			else
+				str_printfa(dest, "%u", replay_remap_num(num1, max));
+			continue;
+		}
+		if (str_to_uint32(t_strdup_until(ranges[i], p), &num1) < 0 ||
+		    num1 == 0) {
+			str_append(dest, ranges[i]);
+			continue;
+		}
+		if (strcmp(p + 1, "*") == 0) {
+			str_printfa(dest, "%u:*", replay_remap_num(num1, max));
+		} else if (str_to_uint32(p + 1, &num2) < 0 || num2 == 0) {
+			str_append(dest, ranges[i]);
+		} else if ((num1 < num2 ? num2 - num1 : num1 - num2) >= max - 1) {
+			/* the range covers the whole mailbox */
+			str_append(dest, "1:*");
+		} else {
+			str_printfa(dest, "%u:%u", replay_remap_num(num1, max),
+				    replay_remap_num(num2, max));
+		}
+	}
+}
+
+static const char *
+replay_command_get_line(struct imap_client *client,
+			const struct replay_command *rcmd,
+			unsigned int *len_r)
+{
+	const struct mailbox_view *view = client->view;
+	string_t *str;
+	uint32_t max;
+
+	/* map the recorded UIDs and sequences into the test mailbox's
+	   ranges */
+	max = !rcmd->uid ? array_count(&view->uidmap) :
+		(view->select_uidnext > 1 ? view->select_uidnext - 1 : 0);
+	if (rcmd->set_len == 0 || max == 0) {
+		*len_r = rcmd->line_len;
+		return rcmd->line;
+	}
+
+	str = t_str_new(rcmd->line_len + 32);
+	str_append_data(str, rcmd->line, rcmd->set_pos);
+	replay_append_remapped_set(str, t_strndup(rcmd->line + rcmd->set_pos,
+						  rcmd->set_len), max);
+	str_append_data(str, rcmd->line + rcmd->set_pos + rcmd->set_len,
+			rcmd->line_len - rcmd->set_pos - rcmd->set_len);
+	*len_r = str_len(str);
+	return str_c(str);
+}
+
+static void replay_callback(struct imap_client *client, struct command *cmd,
+			    const struct imap_arg *args,
+			    enum command_reply reply)
+{
+	if (reply == REPLY_CONT) {
+		if (client->idle_wait_cont) {
+			client->idle_wait_cont = FALSE;
+			return;
+		}
+		/* synchronizing literals are sent only with LITERAL+ */
+		imap_client_input_error(client, "%s: Unexpected continuation",
+					states[cmd->state].name);
+		client_disconnect(&client->client);
+		return;
+	}
+
+	if (reply == REPLY_OK)
+		counters[cmd->state]++;
+	else {
+		/* recorded commands may refer to mailboxes and messages
+		   that don't exist in the test accounts */
+		conf.replay->commands_failed++;
+	}
+	if (cmd->state == STATE_IDLE) {
+		client->client.idling = FALSE;
+		client->idle_done_sent = FALSE;
+	}
+	imap_client_handle_tagged_reply(client, cmd, args + 1, reply);
+}
+
+static void replay_timeout(struct imap_client *client)
+{
+	timeout_remove(&client->to_replay);
+	if (client_send_more_commands(&client->client) < 0)
+		client_disconnect(&client->client);
+}
+
+static void replay_send_login(struct imap_client *client)
+{
+	string_t *cmd = t_str_new(128);
+
+	str_append(cmd, "LOGIN ");
+	imap_append_astring(cmd, client->client.user->username);
+	str_append_c(cmd, ' ');
+	imap_append_astring(cmd, client->client.user->password);
+	client->client.state = STATE_LOGIN;
+	command_send(client, str_c(cmd), state_callback);
+	client->replay_start_msecs = user_time_now();
+}
+
+int imap_client_replay_send_more_commands(struct client *_client)
+{
+	struct imap_client *client = (struct imap_client *)_client;
+	const struct replay_command *rcmd;
+	struct command *cmd;
+	const char *line;
+	unsigned int count, line_len;
+	long long due, now;
+
+	/* the sessions are replayed one command at a time, except that
+	   IDLE is running while waiting for the next command */
+	if (client->to_replay != NULL)
+		return 0;
+	if (array_count(&client->commands) > (_client->idling ? 1 : 0))
+		return 0;
+
+	if (_client->login_state == LSTATE_NONAUTH) {
+		if (array_count(&client->commands) == 0)
+			replay_send_login(client);
+		return 0;
+	}
+
+	count = array_count(&client->replay_session->commands);
+	for (;;) {
+		if (client->replay_idx == count) {
+			client_logout(_client);
+			return 0;
+		}
+		rcmd = array_idx(&client->replay_session->commands,
+				 client->replay_idx);
+
+		due = client->replay_start_msecs +
+			(long long)(rcmd->msecs / conf.time_scale);
+		now = user_time_now();
+		if (due > now) {
+			client->to_replay = timeout_add(due - now,
+							replay_timeout, client);
+			_client->sync_waiting = TRUE;
+			return 0;
+		}
+		client->replay_idx++;
+
+		if (!rcmd->literal ||
+		    (client->capabilities & CAP_LITERALPLUS) != 0)
+			break;
+		/* synchronizing literals aren't supported */
+		conf.replay->commands_skipped++;
+	}
+
+	line = replay_command_get_line(client, rcmd, &line_len);
+	_client->state = rcmd->state;
+	cmd = command_send_binary(client, line, line_len, replay_callback);
+	cmd->expect_bad = TRUE;
+	conf.replay->commands_sent++;
+	if (rcmd->state == STATE_IDLE) {
+		client->idle_wait_cont = TRUE;
+		_client->idling = TRUE;
+	}
+	return 0;
+}
+
+void replay_print_total(const struct replay *replay)
+{
+	printf("Replay: %u sessions from %u files, %u commands, "
+	       "%u failed, %u skipped\n", replay->sessions_started,
+	       array_count(&replay->sessions), replay->commands_sent,
+	       replay->commands_failed, replay->commands_skipped);
+}
@@ -0,0 +1,45 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "client-state.h"
+
+struct client;
+
+/* Replay recorded IMAP sessions. The path is a session file or a directory
+   of them. Each file contains the client input of a single session, e.g.
+   Dovecot's server side *.in rawlogs or imaptest's own rawlog.* files (only
+   the "O:" lines are used). Lines may have "<secs>.<usecs> " timestamp
+   prefixes, which are used for the inter-command timing. */
+
+struct replay_command {
+	/* milliseconds since the session's first command */
+	unsigned int msecs;
+	enum client_state state;
+	/* command line without the tag, possibly with literals */
+	const char *line;
+	unsigned int line_len;
+	/* position of the message set in the line, set_len=0 if none */
+	unsigned int set_pos, set_len;
+
+	bool uid:1;
+	bool literal:1;
+};
+ARRAY_DEFINE_TYPE(replay_command, struct replay_command);
+
+struct replay_session {
+	const char *path;
+	ARRAY_TYPE(replay_command) commands;
+};
+
+struct replay *replay_parse(const char *path);
+void replay_deinit(struct replay **replay);
+
+/* Returns the next session to replay. The sessions are used in turns. */
+const struct replay_session *replay_get_next_session(struct replay *replay);
+/* Returns TRUE if any of the sessions use the state. */
+bool replay_have_state(const struct replay *replay, enum client_state state);
+
+int imap_client_replay_send_more_commands(struct client *client);
+void replay_print_total(const struct replay *replay);
+
+#endif
@@ -0,0 +1,299 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "client.h"
+#include "client-state.h"
+#include "stats.h"
+#include "saturation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SATURATION_DEFAULT_STEP_SECS 60
+/* stop the binary search when the range is within 5% */
+#define SATURATION_RESOLUTION_PERCENT 5
+/* a step fails if adding clients gives less than 10% of the expected
+   linear throughput growth */
+#define SATURATION_MIN_SCALING_PERCENT 10
+
+struct saturation_slo {
+	enum client_state state;
+	unsigned int permille;
+	unsigned int msecs;
+};
+
+struct saturation_step {
+	unsigned int clients;
+	unsigned int cmds_per_sec;
+	/* max stalled clients during the measurement */
+	unsigned int stalls;
+	/* indexed by the SLO */
+	unsigned long long *slo_usecs;
+	/* NULL if the step passed */
+	const char *failure;
+};
+
+struct saturation {
+	unsigned int min_clients, max_clients;
+	unsigned int step_secs, settle_secs;
+	ARRAY(struct saturation_slo) slos;
+	ARRAY(struct saturation_step) steps;
+
+	/* the current step */
+	unsigned int clients, elapsed_secs, max_stalls;
+	bool imaptest_saturated;
+
+	/* highest passed and lowest failed client counts, 0 if none yet */
+	unsigned int pass_clients, fail_clients;
+	unsigned int pass_cmds_per_sec;
+	bool finished;
+};
+
+static void saturation_parse_slo(struct saturation *sat, const char *str)
+{
+	struct saturation_slo *slo;
+	const char *const *args;
+	double percentile;
+	char *end;
+
+	args = t_strsplit(str, ":");
+	if (str_array_length(args) != 3 || args[1][0] != 'p')
+		i_fatal("Invalid slo: %s (expected <state>:p<n>:<msecs>)", str);
+
+	slo = array_append_space(&sat->slos);
+	if (!state_find(args[0], &slo->state))
+		i_fatal("Invalid slo: %s: Unknown state %s", str, args[0]);
+	percentile = strtod(args[1] + 1, &end);
+	slo->permille = (unsigned int)(percentile * 10 + 0.5);
+	if (*end != '\0' || slo->permille == 0 || slo->permille > 1000 ||
+	    slo->permille != percentile * 10)
+		i_fatal("Invalid slo: %s: Invalid percentile %s", str, args[1]);
+	if (str_to_uint(args[2], &slo->msecs) < 0)
+		i_fatal("Invalid slo: %s: Invalid msecs %s", str, args[2]);
+}
+
+struct saturation *
+saturation_init(const char *range, const char *slos, unsigned int step_secs)
+{
+	struct saturation *sat;
+	const char *p, *const *tmp;
+
+	sat = i_new(struct saturation, 1);
+	if (str_parse_uint(range, &sat->min_clients, &p) < 0 || *p != '-' ||
+	    str_to_uint(p + 1, &sat->max_clients) < 0 ||
+	    sat->min_clients == 0 || sat->min_clients > sat->max_clients)
+		i_fatal("Invalid saturation: %s (expected <min>-<max>)", range);
+	sat->step_secs = step_secs == 0 ? SATURATION_DEFAULT_STEP_SECS :
+		step_secs;
+	if (sat->step_secs < 4)
+		i_fatal("saturation_step must be at least 4 seconds");
+	sat->settle_secs = sat->step_secs / 4;
+
+	i_array_init(&sat->slos, 4);
+	i_array_init(&sat->steps, 16);
+	if (slos != NULL) {
+		for (tmp = t_strsplit(slos, ","); *tmp != NULL; tmp++)
+			saturation_parse_slo(sat, *tmp);
+	}
+	sat->clients = sat->min_clients;
+	return sat;
+}
+
+void saturation_deinit(struct saturation **_sat)
+{
+	struct saturation *sat = *_sat;
+	struct saturation_step *step;
+
+	*_sat = NULL;
+	array_foreach_modifiable(&sat->steps, step)
+		i_free(step->slo_usecs);
+	array_free(&sat->steps);
+	array_free(&sat->slos);
+	i_free(sat);
+}
+
+unsigned int saturation_get_first_clients(const struct saturation *sat)
+{
+	return sat->min_clients;
+}
+
+static void
+saturation_step_check_slos(struct saturation *sat,
+			   struct saturation_step *step)
+{
+	const struct saturation_slo *slos;
+	unsigned int i, count;
+
+	slos = array_get(&sat->slos, &count);
+	step->slo_usecs = i_new(unsigned long long, I_MAX(count, 1));
+	for (i = 0; i < count; i++) {
+		step->slo_usecs[i] =
+			stats_get_window_percentile(slos[i].state,
+						    slos[i].permille);
+		if (step->slo_usecs[i] > slos[i].msecs * 1000ULL &&
+		    step->failure == NULL)
+			step->failure = "SLO exceeded";
+	}
+}
+
+static bool saturation_step_scaled(struct saturation *sat,
+				   const struct saturation_step *step)
+{
+	unsigned long long expected_growth, growth;
+
+	if (sat->pass_clients == 0 || step->clients <= sat->pass_clients)
+		return TRUE;
+
+	/* compare the throughput growth to what it would have been if it
+	   grew linearly with the client count */
+	expected_growth = (unsigned long long)sat->pass_cmds_per_sec *
+		(step->clients - sat->pass_clients) / sat->pass_clients;
+	if (step->cmds_per_sec <= sat->pass_cmds_per_sec)
+		return expected_growth == 0;
+	growth = step->cmds_per_sec - sat->pass_cmds_per_sec;
+	return growth * 100 >= expected_growth * SATURATION_MIN_SCALING_PERCENT;
+}
+
+static void saturation_step_finish(struct saturation *sat)
+{
+	struct saturation_step *step;
+	struct stats_latency latency;
+	const struct saturation_slo *slo;
+	unsigned long long commands = 0;
+	unsigned int i;
+
+	step = array_append_space(&sat->steps);
+	step->clients = sat->clients;
+	step->stalls = sat->max_stalls;
+	for (i = 1; i < STATE_COUNT; i++) {
+		stats_get_window_latency(i, &latency);
+		commands += latency.count;
+	}
+	step->cmds_per_sec = commands / (sat->step_secs - sat->settle_secs);
+
+	saturation_step_check_slos(sat, step);
+	if (step->failure != NULL) {
+		/* SLO exceeded */
+	} else if (step->stalls > 0)
+		step->failure = "clients stalled";
+	else if (sat->imaptest_saturated)
+		step->failure = "imaptest saturated";
+	else if (!saturation_step_scaled(sat, step))
+		step->failure = "throughput didn't grow";
+
+	printf("Saturation: %u clients: %u cmds/s", step->clients,
+	       step->cmds_per_sec);
+	i = 0;
+	array_foreach(&sat->slos, slo) {
+		printf(", %s p%g %llu ms", states[slo->state].name,
+		       slo->permille / 10.0, (step->slo_usecs[i++] + 999) / 1000);
+	}
+	if (step->stalls > 0)
+		printf(", %u stalled", step->stalls);
+	printf(": %s\n", step->failure == NULL ? "ok" : step->failure);
+
+	if (step->failure == NULL) {
+		sat->pass_clients = step->clients;
+		sat->pass_cmds_per_sec = step->cmds_per_sec;
+	} else {
+		sat->fail_clients = step->clients;
+	}
+}
+
+static unsigned int saturation_next_clients(struct saturation *sat)
+{
+	unsigned int resolution;
+
+	if (sat->pass_clients == 0) {
+		/* even the minimum failed */
+		return 0;
+	}
+	if (sat->fail_clients == 0) {
+		if (sat->pass_clients == sat->max_clients)
+			return 0;
+		return I_MIN(sat->pass_clients * 2, sat->max_clients);
+	}
+
+	resolution = I_MAX(sat->pass_clients *
+			   SATURATION_RESOLUTION_PERCENT / 100, 1);
+	if (sat->fail_clients - sat->pass_clients <= resolution)
+		return 0;
+	return sat->pass_clients + (sat->fail_clients - sat->pass_clients) / 2;
+}
+
+bool saturation_interval(struct saturation *sat, unsigned int stall_count,
+			 bool imaptest_saturated)
+{
+	if (++sat->elapsed_secs <= sat->settle_secs) {
+		if (sat->elapsed_secs == sat->settle_secs) {
+			/* settled, start measuring */
+			stats_window_reset();
+			sat->max_stalls = 0;
+			sat->imaptest_saturated = FALSE;
+		}
+		return FALSE;
+	}
+
+	sat->max_stalls = I_MAX(sat->max_stalls, stall_count);
+	if (imaptest_saturated)
+		sat->imaptest_saturated = TRUE;
+	if (sat->elapsed_secs < sat->step_secs)
+		return FALSE;
+
+	saturation_step_finish(sat);
+	sat->clients = saturation_next_clients(sat);
+	if (sat->clients == 0) {
+		sat->finished = TRUE;
+		return TRUE;
+	}
+
+	sat->elapsed_secs = 0;
+	clients_set_count(sat->clients);
+	return FALSE;
+}
+
+void saturation_print_total(const struct saturation *sat)
+{
+	const struct saturation_step *step;
+	const struct saturation_slo *slo;
+	unsigned int i;
+
+	printf("\nSaturation search:\n");
+	if (array_count(&sat->steps) == 0) {
+		printf("No steps finished\n");
+		return;
+	}
+	printf("clients  cmds/s");
+	array_foreach(&sat->slos, slo) {
+		printf(" %*s", 14, t_strdup_printf("%s p%g",
+			states[slo->state].name, slo->permille / 10.0));
+	}
+	printf(" stalled  result\n");
+
+	array_foreach(&sat->steps, step) {
+		printf("%7u %7u", step->clients, step->cmds_per_sec);
+		for (i = 0; i < array_count(&sat->slos); i++)
+			printf(" %11llu ms", (step->slo_usecs[i] + 999) / 1000);
+		printf(" %7u  %s\n", step->stalls,
+		       step->failure == NULL ? "ok" : step->failure);
+	}
+
+	if (!sat->finished) {
+		printf("Search interrupted, highest passed: %u clients\n",
+		       sat->pass_clients);
+	} else if (sat->pass_clients == 0) {
+		printf("Knee not found: %u clients already failed\n",
+		       sat->min_clients);
+	} else if (sat->fail_clients == 0 &&
+		   sat->pass_clients == sat->max_clients) {
+		printf("Knee not found: all steps passed up to %u clients, "
+		       "%u cmds/s\n", sat->pass_clients,
+		       sat->pass_cmds_per_sec);
+	} else {
+		printf("Knee: %u clients, %u cmds/s\n",
+		       sat->pass_clients, sat->pass_cmds_per_sec);
+	}
+}
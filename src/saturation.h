@@ -0,0 +1,29 @@
+#ifndef SATURATION_H
+#define SATURATION_H
+
+/* Saturation search: find the highest number of clients the server can
+   handle within the latency SLOs. Each step runs the stress test with a
+   fixed client count, lets it settle for the first quarter of the step and
+   measures the rest. The client count is doubled while the steps pass, and
+   after the first failure it's binary searched between the highest passing
+   and the lowest failing count.
+
+   A step fails if any SLO's latency percentile is exceeded, if any client
+   was stalled, if imaptest itself was saturated or if the throughput
+   stopped growing with the client count (the knee of the curve). */
+
+/* range is "<min>-<max>" clients, slos is a comma-separated list of
+   "<state>:p<percentile>:<msecs>", or NULL. */
+struct saturation *
+saturation_init(const char *range, const char *slos, unsigned int step_secs);
+void saturation_deinit(struct saturation **sat);
+
+/* Returns the client count for the first step. */
+unsigned int saturation_get_first_clients(const struct saturation *sat);
+/* Called once a second with the number of clients that were stalled.
+   Returns TRUE when the search is finished. */
+bool saturation_interval(struct saturation *sat, unsigned int stall_count,
+			 bool imaptest_saturated);
+void saturation_print_total(const struct saturation *sat);
+
+#endif
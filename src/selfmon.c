@@ -0,0 +1,196 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "strnum.h"
+#include "client.h"
+#include "stats.h"
+#include "selfmon.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* How often the lag probe runs */
+#define SELFMON_PROBE_MSECS 100
+/* imaptest is considered saturated if the ioloop lags this much */
+#define SELFMON_SATURATED_LAG_MSECS 100
+/* .. or if it uses this much CPU */
+#define SELFMON_SATURATED_CPU_PERCENT 90
+
+struct selfmon_totals {
+	unsigned int intervals, saturated_intervals;
+	unsigned long long cpu_usecs, wall_usecs;
+	unsigned int max_lag_msecs, max_cpu_percent;
+};
+
+static struct timeout *to_probe;
+static struct timeval probe_expected;
+
+/* current interval */
+static struct timeval interval_start;
+static unsigned long long interval_cpu_start;
+static long long interval_lag_max;
+static unsigned int interval_lag_count;
+
+static struct selfmon_totals totals;
+static uoff_t rss_baseline_kb, rss_peak_kb;
+static unsigned int rss_peak_clients_count;
+
+static unsigned long long selfmon_get_cpu_usecs(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		i_fatal("getrusage() failed: %m");
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+uoff_t selfmon_get_rss_kb(void)
+{
+	/* /proc/self/statm: size resident shared text lib data dt
+	   (in pages) */
+	char buf[128], *p;
+	unsigned long long resident;
+	ssize_t ret;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY);
+	if (fd == -1)
+		return 0;
+	ret = read(fd, buf, sizeof(buf)-1);
+	i_close_fd(&fd);
+	if (ret <= 0)
+		return 0;
+	buf[ret] = '\0';
+
+	p = strchr(buf, ' ');
+	if (p == NULL || str_to_ullong(t_strcut(p + 1, ' '), &resident) < 0)
+		return 0;
+	return resident * getpagesize() / 1024;
+}
+
+static void selfmon_probe_timeout(void *context ATTR_UNUSED)
+{
+	struct timeval now;
+	long long lag;
+
+	/* the timeout should have run SELFMON_PROBE_MSECS after the previous
+	   run. anything beyond that was spent processing other events. */
+	i_gettimeofday(&now);
+	lag = timeval_diff_usecs(&now, &probe_expected);
+	if (lag < 0)
+		lag = 0;
+	if (lag > interval_lag_max)
+		interval_lag_max = lag;
+	interval_lag_count++;
+
+	probe_expected = now;
+	timeval_add_msecs(&probe_expected, SELFMON_PROBE_MSECS);
+}
+
+void selfmon_interval_next(struct selfmon_interval *interval_r)
+{
+	struct timeval now;
+	unsigned long long cpu_usecs, cpu_now;
+	long long wall_usecs;
+
+	i_zero(interval_r);
+
+	i_gettimeofday(&now);
+	cpu_now = selfmon_get_cpu_usecs();
+	wall_usecs = timeval_diff_usecs(&now, &interval_start);
+	cpu_usecs = cpu_now - interval_cpu_start;
+	if (wall_usecs > 0)
+		interval_r->cpu_percent = cpu_usecs * 100 / wall_usecs;
+
+	/* the probe may not have run at all if the whole interval was spent
+	   in a single callback */
+	if (interval_lag_count == 0)
+		interval_lag_max = timeval_diff_usecs(&now, &probe_expected);
+	if (interval_lag_max > 0)
+		interval_r->max_lag_msecs = interval_lag_max / 1000;
+
+	interval_r->rss_kb = selfmon_get_rss_kb();
+	if (clients_count > 0 &&
+	    (unsigned int)clients_count > rss_peak_clients_count) {
+		rss_peak_clients_count = clients_count;
+		rss_peak_kb = interval_r->rss_kb;
+	}
+
+	interval_r->saturated =
+		interval_r->max_lag_msecs >= SELFMON_SATURATED_LAG_MSECS ||
+		interval_r->cpu_percent >= SELFMON_SATURATED_CPU_PERCENT;
+
+	/* warmup and cooldown aren't part of the results, so saturation
+	   during them doesn't matter */
+	if (stats_phase == STATS_PHASE_STEADY) {
+		totals.intervals++;
+		if (interval_r->saturated)
+			totals.saturated_intervals++;
+	}
+	if (wall_usecs > 0) {
+		totals.cpu_usecs += cpu_usecs;
+		totals.wall_usecs += wall_usecs;
+	}
+	if (totals.max_lag_msecs < interval_r->max_lag_msecs)
+		totals.max_lag_msecs = interval_r->max_lag_msecs;
+	if (totals.max_cpu_percent < interval_r->cpu_percent)
+		totals.max_cpu_percent = interval_r->cpu_percent;
+
+	interval_start = now;
+	interval_cpu_start = cpu_now;
+	interval_lag_max = 0;
+	interval_lag_count = 0;
+}
+
+void selfmon_print_total(void)
+{
+	if (totals.wall_usecs == 0)
+		return;
+
+	printf("imaptest: CPU %llu%% avg, %u%% max; ioloop lag %u ms max\n",
+	       totals.cpu_usecs * 100 / totals.wall_usecs,
+	       totals.max_cpu_percent, totals.max_lag_msecs);
+	if (rss_peak_clients_count > 0 && rss_peak_kb > rss_baseline_kb &&
+	    rss_baseline_kb > 0) {
+		printf("Memory: %"PRIuUOFF_T" kB RSS with %u connections, "
+		       "~%"PRIuUOFF_T" bytes/connection\n", rss_peak_kb,
+		       rss_peak_clients_count,
+		       (rss_peak_kb - rss_baseline_kb) * 1024 /
+		       rss_peak_clients_count);
+	}
+	if (totals.saturated_intervals == 0)
+		return;
+
+	printf("WARNING: imaptest itself was saturated during %u/%u "
+	       "steady state seconds "
+	       "(CPU >= %u%% or ioloop lag >= %u ms). The results are INVALID, "
+	       "because the latencies include imaptest's own delays. "
+	       "Use fewer clients or run multiple imaptest processes.\n",
+	       totals.saturated_intervals, totals.intervals,
+	       SELFMON_SATURATED_CPU_PERCENT, SELFMON_SATURATED_LAG_MSECS);
+}
+
+void selfmon_init(void)
+{
+	i_zero(&totals);
+	rss_baseline_kb = selfmon_get_rss_kb();
+	rss_peak_kb = 0;
+	rss_peak_clients_count = 0;
+
+	i_gettimeofday(&interval_start);
+	interval_cpu_start = selfmon_get_cpu_usecs();
+
+	probe_expected = interval_start;
+	timeval_add_msecs(&probe_expected, SELFMON_PROBE_MSECS);
+	to_probe = timeout_add_short(SELFMON_PROBE_MSECS,
+				     selfmon_probe_timeout, (void *)NULL);
+}
+
+void selfmon_deinit(void)
+{
+	timeout_remove(&to_probe);
+}
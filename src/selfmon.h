@@ -0,0 +1,32 @@
+#ifndef SELFMON_H
+#define SELFMON_H
+
+/* Monitoring of imaptest's own health. If the ioloop can't keep up or the
+   process is using all of its CPU, the latencies measured for the server
+   include imaptest's own scheduling delays and the results aren't valid. */
+
+struct selfmon_interval {
+	/* CPU (user+system) used by imaptest since the previous interval,
+	   as percentage of a single core */
+	unsigned int cpu_percent;
+	/* Largest delay between the lag probe timeout's scheduled and
+	   actual run time */
+	unsigned int max_lag_msecs;
+	uoff_t rss_kb;
+
+	bool saturated;
+};
+
+/* Finish the current interval and start a new one. */
+void selfmon_interval_next(struct selfmon_interval *interval_r);
+/* Returns the current RSS in kB, or 0 if it's unknown. */
+uoff_t selfmon_get_rss_kb(void);
+
+/* Print a summary of the whole run, including a warning that the results
+   are invalid if imaptest was saturated during it. */
+void selfmon_print_total(void);
+
+void selfmon_init(void);
+void selfmon_deinit(void);
+
+#endif
@@ -33,6 +33,8 @@
 
 #define DELAY_MSECS 1000
 #define MAX_COMMAND_QUEUE_LEN 10
+/* pipeline_depth=adaptive's default upper limit */
+#define PIPELINE_ADAPTIVE_MAX_DEPTH 100
 #define MAX_INLINE_LITERAL_SIZE (1024*32)
 
 struct settings {
@@ -42,19 +44,39 @@ struct settings {
 	const char *mech;
 	unsigned int port;
 
-	ARRAY_TYPE(const_string) usernames;
+	struct userfile *userfile;
+	/* FETCH/STORE/SEARCH templates, NULL if not given */
+	struct workload *workload;
+	/* from-state -> to-state weights, NULL if not given */
+	struct transitions *transitions;
+	/* recorded sessions to replay, NULL if not given */
+	struct replay *replay;
 
 	unsigned int clients_count;
 	unsigned int message_count_threshold;
 	unsigned int checkpoint_interval;
 	unsigned int random_msg_size;
 	unsigned int stalled_disconnect_timeout;
+	/* max commands in flight per connection. With pipeline_adaptive the
+	   window grows and shrinks within 1..pipeline_depth */
+	unsigned int pipeline_depth;
+	bool pipeline_adaptive;
+	/* profile mode time runs this many times faster than wall clock */
+	double time_scale;
 
 	unsigned int users_rand_start, users_rand_count;
 	unsigned int domains_rand_start, domains_rand_count;
 
 	bool random_states, no_pipelining, disconnect_quit;
 	bool no_tracking, rawlog, error_quit, own_msgs, own_flags, qresync;
+	/* single buffered rawlog file for all the connections, and
+	   whether it gets only the connections that hit errors */
+	const char *rawlog_shared_path;
+	bool rawlog_on_error;
+	/* percentage of the connections that are logged */
+	double rawlog_sample_percent;
+	/* max. errors logged in full per second, 0 = unlimited */
+	unsigned int error_log_rate;
 
 	struct ip_addr *ips;
 	unsigned int ip_idx, ips_count;
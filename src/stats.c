@@ -0,0 +1,400 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "bits.h"
+#include "ioloop.h"
+#include "stats.h"
+
+/* Latencies are stored in a log-linear histogram: values below
+   2^(SUB_BITS+1) usecs have their own buckets, after that each power of two
+   is split into 2^SUB_BITS buckets. This keeps the percentiles within
+   12.5% of the real value. */
+#define STATS_HISTOGRAM_SUB_BITS 3
+#define STATS_HISTOGRAM_SUB_COUNT (1 << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_LINEAR_COUNT (STATS_HISTOGRAM_SUB_COUNT * 2)
+/* up to 2^40 usecs = ~12 days */
+#define STATS_HISTOGRAM_MAX_BITS 40
+#define STATS_HISTOGRAM_BUCKETS \
+	((STATS_HISTOGRAM_MAX_BITS - STATS_HISTOGRAM_SUB_BITS + 1) * \
+	 STATS_HISTOGRAM_SUB_COUNT)
+
+struct stats_histogram {
+	unsigned int count;
+	unsigned long long sum, max;
+	unsigned int buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+struct stats_phase_data {
+	time_t start_time, end_time;
+	unsigned int counters[STATE_COUNT];
+	struct stats_histogram latencies[STATE_COUNT];
+	/* time to the first byte of the reply */
+	struct stats_histogram ttfbs[STATE_COUNT];
+
+	/* bytes of the finished commands */
+	unsigned int byte_commands[STATE_COUNT];
+	uint64_t bytes_sent[STATE_COUNT], bytes_received[STATE_COUNT];
+	/* bytes outside commands, e.g. the banner or IDLE notifications */
+	uint64_t other_bytes_sent, other_bytes_received;
+};
+
+struct stats_group {
+	char *name;
+	struct stats_histogram latencies[STATE_COUNT];
+};
+
+struct stats_pipeline_depth {
+	unsigned long long usecs;
+	unsigned int commands;
+};
+
+enum stats_phase stats_phase;
+bool stats_phases_enabled = FALSE;
+
+const char *const stats_phase_names[STATS_PHASE_COUNT] = {
+	"Warmup", "Steady state", "Cooldown"
+};
+
+static struct stats_phase_data *phases;
+/* how much of counters[] was already added to the current phase */
+static unsigned int counters_flushed[STATE_COUNT];
+/* groups can be registered before stats_init() */
+static ARRAY(struct stats_group *) groups;
+/* indexed by depth-1 */
+static ARRAY(struct stats_pipeline_depth) pipeline_depths;
+/* latencies since the last stats_window_reset(), regardless of the phase */
+static struct stats_histogram *window_latencies;
+/* bytes since the last stats_interval_bytes_next() */
+static uint64_t interval_bytes_sent, interval_bytes_received;
+static struct stats_connection_bytes connection_bytes;
+
+static unsigned int stats_histogram_idx(unsigned long long value)
+{
+	unsigned int msb, idx;
+
+	if (value < STATS_HISTOGRAM_LINEAR_COUNT)
+		return value;
+
+	msb = bits_required64(value) - 1;
+	idx = (msb - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB_COUNT +
+		((value >> (msb - STATS_HISTOGRAM_SUB_BITS)) &
+		 (STATS_HISTOGRAM_SUB_COUNT - 1));
+	return I_MIN(idx, STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+static unsigned long long stats_histogram_idx_max_value(unsigned int idx)
+{
+	unsigned int msb, sub;
+
+	if (idx < STATS_HISTOGRAM_LINEAR_COUNT)
+		return idx;
+
+	msb = idx / STATS_HISTOGRAM_SUB_COUNT + STATS_HISTOGRAM_SUB_BITS - 1;
+	sub = idx % STATS_HISTOGRAM_SUB_COUNT;
+	return ((unsigned long long)(STATS_HISTOGRAM_SUB_COUNT + sub + 1) <<
+		(msb - STATS_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static unsigned long long
+stats_histogram_percentile(const struct stats_histogram *hist,
+			   unsigned int permille)
+{
+	unsigned long long wanted, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	/* the smallest value that has at least permille/1000 of the
+	   values below or at it */
+	wanted = ((unsigned long long)hist->count * permille + 999) / 1000;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= wanted)
+			return I_MIN(stats_histogram_idx_max_value(i), hist->max);
+	}
+	return hist->max;
+}
+
+void stats_set_phase(enum stats_phase phase)
+{
+	if (!stats_phases_enabled || phase <= stats_phase)
+		return;
+
+	stats_flush_counters();
+	phases[stats_phase].end_time = ioloop_time;
+	while (++stats_phase < phase) {
+		/* skipped phase */
+		phases[stats_phase].start_time = ioloop_time;
+		phases[stats_phase].end_time = ioloop_time;
+	}
+	phases[stats_phase].start_time = ioloop_time;
+}
+
+static void
+stats_histogram_add(struct stats_histogram *hist, unsigned long long usecs)
+{
+	hist->count++;
+	hist->sum += usecs;
+	if (hist->max < usecs)
+		hist->max = usecs;
+	hist->buckets[stats_histogram_idx(usecs)]++;
+}
+
+static void
+stats_histogram_get_latency(const struct stats_histogram *hist,
+			    struct stats_latency *latency_r)
+{
+	i_zero(latency_r);
+	if (hist->count == 0)
+		return;
+
+	latency_r->count = hist->count;
+	latency_r->avg = hist->sum / hist->count;
+	latency_r->max = hist->max;
+	latency_r->p50 = stats_histogram_percentile(hist, 500);
+	latency_r->p90 = stats_histogram_percentile(hist, 900);
+	latency_r->p99 = stats_histogram_percentile(hist, 990);
+	latency_r->p999 = stats_histogram_percentile(hist, 999);
+}
+
+void stats_add_latency(enum client_state state, unsigned long long usecs)
+{
+	stats_histogram_add(&phases[stats_phase].latencies[state], usecs);
+	stats_histogram_add(&window_latencies[state], usecs);
+}
+
+void stats_add_ttfb(enum client_state state, long long usecs)
+{
+	if (usecs < 0)
+		usecs = 0;
+	stats_histogram_add(&phases[stats_phase].ttfbs[state], usecs);
+}
+
+void stats_flush_counters(void)
+{
+	unsigned int i;
+
+	/* counters[] may also be decreased, so just let the unsigned
+	   integers wrap */
+	for (i = 0; i < STATE_COUNT; i++) {
+		phases[stats_phase].counters[i] +=
+			counters[i] - counters_flushed[i];
+		counters_flushed[i] = counters[i];
+	}
+}
+
+void stats_counters_reset(void)
+{
+	memset(counters_flushed, 0, sizeof(counters_flushed));
+}
+
+unsigned int stats_get_count(enum stats_phase phase, enum client_state state)
+{
+	return phases[phase].counters[state];
+}
+
+unsigned int stats_get_phase_secs(enum stats_phase phase)
+{
+	time_t end_time;
+
+	if (phase > stats_phase)
+		return 0;
+	end_time = phase == stats_phase ? ioloop_time : phases[phase].end_time;
+	return end_time - phases[phase].start_time;
+}
+
+void stats_get_latency(enum stats_phase phase, enum client_state state,
+		       struct stats_latency *latency_r)
+{
+	stats_histogram_get_latency(&phases[phase].latencies[state], latency_r);
+}
+
+void stats_add_transfer(uoff_t sent, uoff_t received)
+{
+	interval_bytes_sent += sent;
+	interval_bytes_received += received;
+}
+
+void stats_interval_bytes_next(uint64_t *sent_r, uint64_t *received_r)
+{
+	*sent_r = interval_bytes_sent;
+	*received_r = interval_bytes_received;
+	interval_bytes_sent = 0;
+	interval_bytes_received = 0;
+}
+
+void stats_add_command_bytes(enum client_state state,
+			     uoff_t sent, uoff_t received)
+{
+	struct stats_phase_data *phase = &phases[stats_phase];
+
+	phase->byte_commands[state]++;
+	phase->bytes_sent[state] += sent;
+	phase->bytes_received[state] += received;
+}
+
+void stats_add_other_bytes(uoff_t sent, uoff_t received)
+{
+	phases[stats_phase].other_bytes_sent += sent;
+	phases[stats_phase].other_bytes_received += received;
+}
+
+void stats_get_bytes(enum stats_phase phase, enum client_state state,
+		     struct stats_bytes *bytes_r)
+{
+	bytes_r->commands = phases[phase].byte_commands[state];
+	bytes_r->sent = phases[phase].bytes_sent[state];
+	bytes_r->received = phases[phase].bytes_received[state];
+}
+
+void stats_get_other_bytes(enum stats_phase phase,
+			   struct stats_bytes *bytes_r)
+{
+	bytes_r->commands = 0;
+	bytes_r->sent = phases[phase].other_bytes_sent;
+	bytes_r->received = phases[phase].other_bytes_received;
+}
+
+void stats_add_connection_bytes(uoff_t sent, uoff_t received)
+{
+	connection_bytes.count++;
+	connection_bytes.sent += sent;
+	connection_bytes.received += received;
+	if (connection_bytes.max_sent < sent)
+		connection_bytes.max_sent = sent;
+	if (connection_bytes.max_received < received)
+		connection_bytes.max_received = received;
+}
+
+void stats_get_connection_bytes(struct stats_connection_bytes *bytes_r)
+{
+	*bytes_r = connection_bytes;
+}
+
+void stats_window_reset(void)
+{
+	memset(window_latencies, 0, sizeof(*window_latencies) * STATE_COUNT);
+}
+
+void stats_get_window_latency(enum client_state state,
+			      struct stats_latency *latency_r)
+{
+	stats_histogram_get_latency(&window_latencies[state], latency_r);
+}
+
+unsigned long long
+stats_get_window_percentile(enum client_state state, unsigned int permille)
+{
+	return stats_histogram_percentile(&window_latencies[state], permille);
+}
+
+void stats_get_ttfb(enum stats_phase phase, enum client_state state,
+		    struct stats_latency *latency_r)
+{
+	stats_histogram_get_latency(&phases[phase].ttfbs[state], latency_r);
+}
+
+unsigned int stats_group_register(const char *name)
+{
+	struct stats_group *group;
+
+	if (!array_is_created(&groups))
+		i_array_init(&groups, 8);
+	group = i_new(struct stats_group, 1);
+	group->name = i_strdup(name);
+	array_append(&groups, &group, 1);
+	return array_count(&groups) - 1;
+}
+
+void stats_add_group_latency(unsigned int group_idx, enum client_state state,
+			     unsigned long long usecs)
+{
+	struct stats_group *group = array_idx_elem(&groups, group_idx);
+
+	if (stats_phase != STATS_PHASE_STEADY)
+		return;
+	stats_histogram_add(&group->latencies[state], usecs);
+}
+
+unsigned int stats_get_group_count(void)
+{
+	return array_is_created(&groups) ? array_count(&groups) : 0;
+}
+
+const char *stats_get_group_name(unsigned int group_idx)
+{
+	return array_idx_elem(&groups, group_idx)->name;
+}
+
+void stats_get_group_latency(unsigned int group_idx, enum client_state state,
+			     struct stats_latency *latency_r)
+{
+	struct stats_group *group = array_idx_elem(&groups, group_idx);
+
+	stats_histogram_get_latency(&group->latencies[state], latency_r);
+}
+
+static struct stats_pipeline_depth *
+stats_pipeline_depth_get(unsigned int depth)
+{
+	i_assert(depth > 0);
+	return array_idx_get_space(&pipeline_depths, depth - 1);
+}
+
+void stats_add_pipeline_time(unsigned int depth, unsigned long long usecs)
+{
+	if (stats_phase != STATS_PHASE_STEADY)
+		return;
+	stats_pipeline_depth_get(depth)->usecs += usecs;
+}
+
+void stats_add_pipeline_command(unsigned int depth)
+{
+	if (stats_phase != STATS_PHASE_STEADY || depth == 0)
+		return;
+	stats_pipeline_depth_get(depth)->commands++;
+}
+
+unsigned int stats_get_pipeline_max_depth(void)
+{
+	return array_count(&pipeline_depths);
+}
+
+void stats_get_pipeline_depth(unsigned int depth, unsigned long long *usecs_r,
+			      unsigned int *commands_r)
+{
+	const struct stats_pipeline_depth *pd =
+		array_idx(&pipeline_depths, depth - 1);
+
+	*usecs_r = pd->usecs;
+	*commands_r = pd->commands;
+}
+
+void stats_init(void)
+{
+	phases = i_new(struct stats_phase_data, STATS_PHASE_COUNT);
+	window_latencies = i_new(struct stats_histogram, STATE_COUNT);
+	i_array_init(&pipeline_depths, 16);
+	memset(counters_flushed, 0, sizeof(counters_flushed));
+	stats_phase = stats_phases_enabled ?
+		STATS_PHASE_WARMUP : STATS_PHASE_STEADY;
+	phases[stats_phase].start_time = ioloop_time;
+}
+
+void stats_deinit(void)
+{
+	struct stats_group *group;
+
+	if (array_is_created(&groups)) {
+		array_foreach_elem(&groups, group) {
+			i_free(group->name);
+			i_free(group);
+		}
+		array_free(&groups);
+	}
+	array_free(&pipeline_depths);
+	i_free(window_latencies);
+	i_free(phases);
+}
@@ -0,0 +1,114 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "client-state.h"
+
+/* Run phases. Counters and latencies are kept separately for each phase,
+   so that the connection ramp-up at startup and the logout storm at
+   shutdown don't affect the steady state results. */
+enum stats_phase {
+	STATS_PHASE_WARMUP = 0,
+	STATS_PHASE_STEADY,
+	STATS_PHASE_COOLDOWN,
+
+	STATS_PHASE_COUNT
+};
+
+struct stats_latency {
+	unsigned int count;
+	/* all in microseconds */
+	unsigned long long avg, max;
+	unsigned long long p50, p90, p99, p999;
+};
+
+struct stats_bytes {
+	unsigned int commands;
+	uint64_t sent, received;
+};
+
+struct stats_connection_bytes {
+	unsigned int count;
+	uint64_t sent, received;
+	uint64_t max_sent, max_received;
+};
+
+extern enum stats_phase stats_phase;
+/* TRUE if warmup/duration/cooldown was configured. Otherwise everything
+   is counted as steady state. */
+extern bool stats_phases_enabled;
+
+extern const char *const stats_phase_names[STATS_PHASE_COUNT];
+
+/* Switch to the given phase. Phases can only move forward. */
+void stats_set_phase(enum stats_phase phase);
+
+/* Add a finished command's latency to the current phase. */
+void stats_add_latency(enum client_state state, unsigned long long usecs);
+/* Add a finished command's time from sending it to the first byte of its
+   reply. */
+void stats_add_ttfb(enum client_state state, long long usecs);
+/* Add the global counters[] to the current phase's totals. Called before
+   counters[] is reset and before changing the phase. */
+void stats_flush_counters(void);
+/* counters[] was reset to 0. */
+void stats_counters_reset(void);
+
+unsigned int stats_get_count(enum stats_phase phase, enum client_state state);
+/* Returns the number of seconds spent in the phase so far. */
+unsigned int stats_get_phase_secs(enum stats_phase phase);
+void stats_get_latency(enum stats_phase phase, enum client_state state,
+		       struct stats_latency *latency_r);
+void stats_get_ttfb(enum stats_phase phase, enum client_state state,
+		    struct stats_latency *latency_r);
+
+/* Bytes sent or received just now, for the per-second bandwidth. */
+void stats_add_transfer(uoff_t sent, uoff_t received);
+/* Return the bytes since the previous call. */
+void stats_interval_bytes_next(uint64_t *sent_r, uint64_t *received_r);
+/* Add a finished command's bytes, including its literals and the untagged
+   replies received while it was running. */
+void stats_add_command_bytes(enum client_state state,
+			     uoff_t sent, uoff_t received);
+/* Add bytes that weren't part of any command. */
+void stats_add_other_bytes(uoff_t sent, uoff_t received);
+void stats_get_bytes(enum stats_phase phase, enum client_state state,
+		     struct stats_bytes *bytes_r);
+void stats_get_other_bytes(enum stats_phase phase,
+			   struct stats_bytes *bytes_r);
+/* Add a disconnected connection's total bytes. */
+void stats_add_connection_bytes(uoff_t sent, uoff_t received);
+void stats_get_connection_bytes(struct stats_connection_bytes *bytes_r);
+
+/* The window has the latencies of all the commands since the last reset,
+   regardless of the phase. It's used for measuring each saturation search
+   step separately. */
+void stats_window_reset(void);
+void stats_get_window_latency(enum client_state state,
+			      struct stats_latency *latency_r);
+unsigned long long
+stats_get_window_percentile(enum client_state state, unsigned int permille);
+
+/* Groups break down the steady state latencies further, e.g. per profile.
+   A command can be added to multiple groups. Returns the group's index. */
+unsigned int stats_group_register(const char *name);
+void stats_add_group_latency(unsigned int group_idx, enum client_state state,
+			     unsigned long long usecs);
+unsigned int stats_get_group_count(void);
+const char *stats_get_group_name(unsigned int group_idx);
+void stats_get_group_latency(unsigned int group_idx, enum client_state state,
+			     struct stats_latency *latency_r);
+
+/* Pipelining: how long the connections have had depth commands in flight
+   and how many commands finished meanwhile. Only the steady state is
+   counted. */
+void stats_add_pipeline_time(unsigned int depth, unsigned long long usecs);
+void stats_add_pipeline_command(unsigned int depth);
+/* Returns the highest depth with any stats, 0 if none. */
+unsigned int stats_get_pipeline_max_depth(void);
+void stats_get_pipeline_depth(unsigned int depth, unsigned long long *usecs_r,
+			      unsigned int *commands_r);
+
+void stats_init(void);
+void stats_deinit(void);
+
+#endif
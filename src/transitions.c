@@ -0,0 +1,169 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "istream.h"
+#include "transitions.h"
+
+#include <stdio.h>
+
+struct transitions {
+	unsigned int weights[STATE_COUNT][STATE_COUNT];
+	unsigned int counts[STATE_COUNT][STATE_COUNT];
+};
+
+static bool transitions_is_valid_from(enum client_state state)
+{
+	return state == STATE_AUTHENTICATE || state == STATE_LOGIN ||
+		(state >= STATE_LIST && state < STATE_LOGOUT);
+}
+
+static bool transitions_is_valid_to(enum client_state state)
+{
+	switch (state) {
+	case STATE_IDLE:
+	case STATE_ENABLE:
+	case STATE_NOTIFY:
+	case STATE_LIST_STATUS:
+		/* not supported by the stress testing */
+		return FALSE;
+	default:
+		return state >= STATE_LIST && state <= STATE_LOGOUT;
+	}
+}
+
+static const char *
+transitions_parse_line(struct transitions *transitions, const char *line)
+{
+	const char *const *args;
+	enum client_state from, to;
+	unsigned int weight;
+
+	args = t_strsplit_spaces(line, " \t");
+	if (args[0] == NULL || args[0][0] == '#')
+		return NULL;
+	if (str_array_length(args) != 3)
+		return "Expected <from state> <to state> <weight>";
+
+	if (!state_find(args[0], &from))
+		return t_strdup_printf("Unknown state: %s", args[0]);
+	if (!state_find(args[1], &to))
+		return t_strdup_printf("Unknown state: %s", args[1]);
+	if (!transitions_is_valid_from(from))
+		return t_strdup_printf("Invalid from state: %s", args[0]);
+	if (!transitions_is_valid_to(to))
+		return t_strdup_printf("Invalid to state: %s", args[1]);
+	if (str_to_uint(args[2], &weight) < 0)
+		return t_strdup_printf("Invalid weight: %s", args[2]);
+	transitions->weights[from][to] = weight;
+	return NULL;
+}
+
+struct transitions *transitions_parse(const char *path)
+{
+	struct transitions *transitions;
+	struct istream *input;
+	const char *line, *error;
+	unsigned int linenum = 0;
+
+	transitions = i_new(struct transitions, 1);
+	input = i_stream_create_file(path, (size_t)-1);
+	while ((line = i_stream_read_next_line(input)) != NULL) T_BEGIN {
+		linenum++;
+		error = transitions_parse_line(transitions, line);
+		if (error != NULL) {
+			i_fatal("Invalid transitions %s at line %u: %s",
+				path, linenum, error);
+		}
+	} T_END;
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_destroy(&input);
+	return transitions;
+}
+
+void transitions_deinit(struct transitions **_transitions)
+{
+	struct transitions *transitions = *_transitions;
+
+	*_transitions = NULL;
+	i_free(transitions);
+}
+
+bool transitions_have_target(const struct transitions *transitions,
+			     enum client_state state)
+{
+	unsigned int from;
+
+	for (from = 0; from < STATE_COUNT; from++) {
+		if (transitions->weights[from][state] > 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+bool transitions_pick(const struct transitions *transitions,
+		      enum client_state from,
+		      const bool allowed[STATE_COUNT],
+		      enum client_state *to_r)
+{
+	const unsigned int *weights = transitions->weights[from];
+	unsigned int to, total = 0, weight;
+
+	for (to = 0; to < STATE_COUNT; to++) {
+		if (allowed[to])
+			total += weights[to];
+	}
+	if (total == 0)
+		return FALSE;
+
+	weight = i_rand_limit(total);
+	for (to = 0; to < STATE_COUNT; to++) {
+		if (!allowed[to])
+			continue;
+		if (weight < weights[to])
+			break;
+		weight -= weights[to];
+	}
+	i_assert(to < STATE_COUNT);
+	*to_r = to;
+	return TRUE;
+}
+
+void transitions_count(struct transitions *transitions,
+		       enum client_state from, enum client_state to)
+{
+	transitions->counts[from][to]++;
+}
+
+void transitions_print_total(const struct transitions *transitions)
+{
+	unsigned int from, to, weight_total, count_total;
+
+	printf("\nTransitions:\n");
+	printf("%-12s %-12s %10s %8s %8s\n", "from", "to", "count",
+	       "actual", "config");
+	for (from = 0; from < STATE_COUNT; from++) {
+		weight_total = count_total = 0;
+		for (to = 0; to < STATE_COUNT; to++) {
+			weight_total += transitions->weights[from][to];
+			count_total += transitions->counts[from][to];
+		}
+		if (count_total == 0)
+			continue;
+
+		for (to = 0; to < STATE_COUNT; to++) {
+			unsigned int count = transitions->counts[from][to];
+			unsigned int weight = transitions->weights[from][to];
+
+			if (count == 0 && weight == 0)
+				continue;
+			printf("%-12s %-12s %10u %7.1f%% ", states[from].name,
+			       states[to].name, count,
+			       count * 100.0 / count_total);
+			if (weight_total == 0)
+				printf("%8s\n", "-");
+			else
+				printf("%7.1f%%\n", weight * 100.0 / weight_total);
+		}
+	}
+}
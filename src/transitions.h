@@ -0,0 +1,32 @@
+#ifndef TRANSITIONS_H
+#define TRANSITIONS_H
+
+#include "client-state.h"
+
+/* Transition files replace the independent state probabilities with a
+   weighted from-state -> to-state matrix. Each line is:
+
+   <from state> <to state> <weight>
+
+   for example "SELECT FETCH 80" or "FETCH FETCH2 60". The state names are
+   the ones shown in the stats output. utils/rawlog_transitions.py can
+   generate the file from a corpus of rawlogs. */
+
+struct transitions *transitions_parse(const char *path);
+void transitions_deinit(struct transitions **transitions);
+
+/* Returns TRUE if the state is used as a transition target. */
+bool transitions_have_target(const struct transitions *transitions,
+			     enum client_state state);
+/* Pick a random next state among the allowed ones based on the weights.
+   Returns FALSE if the from state has no allowed transitions. */
+bool transitions_pick(const struct transitions *transitions,
+		      enum client_state from,
+		      const bool allowed[STATE_COUNT],
+		      enum client_state *to_r);
+/* Count a transition that was done. */
+void transitions_count(struct transitions *transitions,
+		       enum client_state from, enum client_state to);
+void transitions_print_total(const struct transitions *transitions);
+
+#endif
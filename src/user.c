@@ -12,12 +12,15 @@
 #include "mailbox.h"
 #include "mailbox-source.h"
 #include "user.h"
+#include "userfile.h"
 #include "var-expand.h"
 
 #include <stdlib.h>
 
 static HASH_TABLE(const char *, struct user *) users_hash;
 static ARRAY_TYPE(user) users = ARRAY_INIT;
+/* profile users and their strings. these are never freed individually. */
+static pool_t users_profile_pool;
 static struct profile *users_profile;
 
 static inline const char *
@@ -63,30 +66,65 @@ struct user *user_get(const char *username, struct mailbox_source *source)
 	user->password = conf.password;
 	user->mailbox_source = source;
 	mailbox_source_ref(user->mailbox_source);
-	user->next_min_timestamp = INT_MAX;
+	user->next_min_timestamp = USER_TIME_NEVER;
 	p_array_init(&user->clients, user->pool, 2);
 	hash_table_insert(users_hash, user->username, user);
 	return user;
 }
 
+struct user *user_new_profile(const struct profile_user *profile,
+			      unsigned int username_idx, const char *username,
+			      const char *password,
+			      struct mailbox_source *source)
+{
+	struct user *user;
+
+	user = p_new(users_profile_pool, struct user, 1);
+	user->username = username;
+	user->username_idx = username_idx;
+	user->password = password == NULL ? conf.password : password;
+	user->profile = profile;
+	user->mailbox_source = source;
+	mailbox_source_ref(user->mailbox_source);
+	user->next_min_timestamp = USER_TIME_NEVER;
+	return user;
+}
+
+const char *user_get_username(struct user *user)
+{
+	if (user->username == NULL) {
+		user->username = p_strdup(users_profile_pool,
+			profile_user_get_username(user->profile,
+						  user->username_idx));
+	}
+	return user->username;
+}
+
+void user_init_lazy(struct user *user)
+{
+	if (user->pool != NULL)
+		return;
+
+	(void)user_get_username(user);
+	user->pool = pool_alloconly_create("user", 1024*2);
+	profile_user_init_clients(user);
+}
+
 static struct user *user_get_random_from_conf(struct mailbox_source *source)
 {
 	static int prev_user = 0, prev_domain = 0;
-	const char *const *userp, *p, *username;
+	const char *username, *password;
 	struct user *user;
 	unsigned int i;
 
-	if (array_is_created(&conf.usernames)) {
-		i = i_rand_limit(array_count(&conf.usernames));
-		userp = array_idx(&conf.usernames, i);
-		p = strchr(*userp, ':');
-		if (p == NULL) {
-			user = user_get(*userp, source);
-		} else {
-			user = user_get(t_strdup_until(*userp, p), source);
-			if (strncmp(p + 1, "{PLAIN}", 7) == 0)
-				p += 7;
-			user->password = p_strdup(user->pool, p+1);
+	if (conf.userfile != NULL) {
+		i = i_rand_limit(userfile_get_count(conf.userfile));
+		userfile_get(conf.userfile, i, &username, &password);
+		user = user_get(username, source);
+		if (password != NULL) {
+			if (strncmp(password, "{PLAIN}", 7) == 0)
+				password += 7;
+			user->password = password;
 		}
 	} else {
 		prev_user = random() % conf.users_rand_count + conf.users_rand_start;
@@ -99,25 +137,27 @@ static struct user *user_get_random_from_conf(struct mailbox_source *source)
 	return user;
 }
 
-#define USER_CLIENT_CAN_CONNECT(uc) \
+#define USER_CLIENT_CAN_CONNECT(uc, now) \
 	((uc->last_logout <= 0 ? \
-	 (ioloop_time >= uc->user->timestamps[USER_TIMESTAMP_LOGIN]) : \
-	 (ioloop_time - uc->last_logout >= (time_t)uc->profile->login_interval)) && \
+	 (now >= uc->user->timestamps[USER_TIMESTAMP_LOGIN]) : \
+	 (now - uc->last_logout >= user_time_interval(uc->profile->login_interval))) && \
 	array_count(&uc->clients) < uc->profile->connection_max_count)
 
 
 static bool user_can_connect_clients(struct user *user)
 {
-	struct user_client *const *clients;
-	unsigned int i, count;
-	bool ret = FALSE;
+	struct user_client *uc;
+	long long now = user_time_now();
 
-	clients = array_get(&user->clients, &count);
-	for (i = 0; i < count; i++) {
-		if (USER_CLIENT_CAN_CONNECT(clients[i]))
-			ret = TRUE;
+	if (!array_is_created(&user->clients)) {
+		/* not logged in yet */
+		return now >= user->timestamps[USER_TIMESTAMP_LOGIN];
 	}
-	return ret;
+	array_foreach_elem(&user->clients, uc) {
+		if (USER_CLIENT_CAN_CONNECT(uc, now))
+			return TRUE;
+	}
+	return FALSE;
 }
 
 bool user_get_random(struct mailbox_source *source, struct user **user_r)
@@ -145,7 +185,8 @@ bool user_get_random(struct mailbox_source *source, struct user **user_r)
 static void user_free(struct user *user)
 {
 	mailbox_source_unref(&user->mailbox_source);
-	pool_unref(&user->pool);
+	if (user->pool != NULL)
+		pool_unref(&user->pool);
 }
 
 void user_add_client(struct user *user, struct client *client)
@@ -201,16 +242,18 @@ bool user_get_new_client_profile(struct user *user,
 {
 	struct user_client *const *user_clients, *lowest_uc = NULL;
 	unsigned int i, uc_count, lowest_count = UINT_MAX;
+	long long now = user_time_now();
 
 	*user_client_r = NULL;
 	if (user->profile == NULL)
 		return TRUE;
+	user_init_lazy(user);
 
 	/* find the user_client with the lowest connection count.
 	   we also must be able to connect to it. */
 	user_clients = array_get(&user->clients, &uc_count);
 	for (i = 0; i < uc_count; i++) {
-		if (USER_CLIENT_CAN_CONNECT(user_clients[i]) &&
+		if (USER_CLIENT_CAN_CONNECT(user_clients[i], now) &&
 		    lowest_count > array_count(&user_clients[i]->clients)) {
 			lowest_count = array_count(&user_clients[i]->clients);
 			lowest_uc = user_clients[i];
@@ -222,25 +265,27 @@ bool user_get_new_client_profile(struct user *user,
 	return TRUE;
 }
 
-time_t user_get_next_login_time(struct user *user)
+long long user_get_next_login_time(struct user *user)
 {
 	struct user_client *const *user_clients;
 	unsigned int i, uc_count;
-	time_t next_login, lowest_next_login_time = INT_MAX;
+	long long next_login, lowest_next_login_time = USER_TIME_NEVER;
 
 	if (user->profile == NULL)
-		return ioloop_time;
+		return user_time_now();
+	if (!array_is_created(&user->clients))
+		return user->timestamps[USER_TIMESTAMP_LOGIN];
 
 	user_clients = array_get(&user->clients, &uc_count);
 	for (i = 0; i < uc_count; i++) {
 		if (user_clients[i]->last_logout <= 0)
 			continue;
 		next_login = user_clients[i]->last_logout +
-			user_clients[i]->profile->login_interval;
+			user_time_interval(user_clients[i]->profile->login_interval);
 		if (lowest_next_login_time > next_login)
 			lowest_next_login_time = next_login;
 	}
-	if (lowest_next_login_time == INT_MAX) {
+	if (lowest_next_login_time == USER_TIME_NEVER) {
 		/* first login for user */
 		return user->timestamps[USER_TIMESTAMP_LOGIN];
 	}
@@ -299,23 +344,36 @@ user_get_mailbox_cache(struct user_client *uc, const char *name)
 	}
 	mailbox = p_new(uc->user->pool, struct user_mailbox_cache, 1);
 	mailbox->mailbox_name = p_strdup(uc->user->pool, name);
-	mailbox->next_action_timestamp = (time_t)-1;
+	mailbox->next_action_timestamp = -1;
 	array_append(&uc->mailboxes, &mailbox, 1);
 	return mailbox;
 }
 
-static int users_min_timestamp_cmp(struct user *const *u1,
-				   struct user *const *u2)
+size_t users_get_profile_memory_used(void)
 {
-	return (*u1)->next_min_timestamp - (*u2)->next_min_timestamp;
+	if (users_profile_pool == NULL)
+		return 0;
+	return pool_alloconly_get_total_used_size(users_profile_pool) +
+		array_count(&users) * sizeof(struct user *);
 }
 
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void)
+const ARRAY_TYPE(user) *users_get_all(void)
 {
-	array_sort(&users, users_min_timestamp_cmp);
 	return &users;
 }
 
+long long user_time_now(void)
+{
+	return ioloop_timeval.tv_sec * 1000LL + ioloop_timeval.tv_usec / 1000;
+}
+
+long long user_time_interval(unsigned int secs)
+{
+	long long msecs = (long long)(secs * 1000.0 / conf.time_scale);
+
+	return secs > 0 && msecs == 0 ? 1 : msecs;
+}
+
 void users_free_all(void)
 {
 	const char *username;
@@ -328,8 +386,12 @@ void users_free_all(void)
 	hash_table_iterate_deinit(&iter);
 
 	hash_table_clear(users_hash, FALSE);
-	if (array_is_created(&users))
+	if (array_is_created(&users)) {
+		/* profile users aren't in users_hash */
+		array_foreach_elem(&users, user)
+			user_free(user);
 		array_clear(&users);
+	}
 }
 
 void users_init(struct profile *profile, struct mailbox_source *source)
@@ -337,8 +399,11 @@ void users_init(struct profile *profile, struct mailbox_source *source)
 	hash_table_create(&users_hash, default_pool, 0, str_hash, strcmp);
 	users_profile = profile;
 
-	if (profile != NULL)
+	if (profile != NULL) {
+		users_profile_pool =
+			pool_alloconly_create("profile users", 1024*1024);
 		profile_add_users(profile, &users, source);
+	}
 }
 
 void users_deinit(void)
@@ -348,4 +413,6 @@ void users_deinit(void)
 	hash_table_destroy(&users_hash);
 	if (array_is_created(&users))
 		array_free(&users);
+	if (users_profile_pool != NULL)
+		pool_unref(&users_profile_pool);
 }
@@ -1,16 +1,24 @@
 #ifndef USER_H
 #define USER_H
 
+#include "priorityq.h"
+
 struct profile;
 struct profile_user;
 
+/* Profile timestamps are in wall clock milliseconds (user_time_now()).
+   In user->timestamps[] and next_action_timestamp -1 means the action isn't
+   scheduled. USER_TIME_NEVER is used for the earliest of the timestamps
+   (next_min_timestamp) when none of them are set, so that it sorts last. */
+#define USER_TIME_NEVER LLONG_MAX
+
 struct user_mailbox_cache {
 	const char *mailbox_name;
 	uint32_t uidvalidity;
 	uint32_t uidnext;
 	uint64_t highest_modseq;
 
-	time_t next_action_timestamp;
+	long long next_action_timestamp;
 	uint32_t last_action_uid;
 	bool last_action_uid_body_fetched;
 };
@@ -28,7 +36,7 @@ enum user_timestamp {
 struct user_client {
 	struct user *user;
 	struct profile_client *profile;
-	time_t last_logout;
+	long long last_logout;
 
 	/* connections created by this client */
 	ARRAY(struct client *) clients;
@@ -42,34 +50,69 @@ struct user_client {
 };
 
 struct user {
+	/* in the profile scheduler's queue, sorted by next_min_timestamp */
+	struct priorityq_item schedule_item;
+	bool scheduled;
+
+	/* With profiles the pool and the clients are created only at the
+	   first login (user_init_lazy()), because most of the users are
+	   idle most of the time. */
 	pool_t pool;
+	/* With profiles using username_format this is NULL until
+	   user_get_username() generates it. */
 	const char *username;
 	const char *password;
 	const struct profile_user *profile;
 	struct mailbox_source *mailbox_source;
 
-	/* all of the user's clients (e.g. desktop client, mobile client) */
+	/* all of the user's clients (e.g. desktop client, mobile client).
+	   Not created until user_init_lazy() with profiles. */
 	ARRAY(struct user_client *) clients;
 	/* the client the user is currently using, NULL if user has no clients
 	   connected currently (somewhat randomly switches between clients) */
 	struct user_client *active_client;
 
-	time_t timestamps[USER_TIMESTAMP_COUNT];
-	time_t next_min_timestamp;
+	long long timestamps[USER_TIMESTAMP_COUNT];
+	long long next_min_timestamp;
+
+	/* number used for generating the username from username_format */
+	unsigned int username_idx;
+	/* 0..99: the user logs in only while the profile's load percentage
+	   is above this */
+	unsigned char load_rank;
 };
 ARRAY_DEFINE_TYPE(user, struct user *);
 
 struct user *user_get(const char *username, struct mailbox_source *source);
+/* Create a new profile user. If username is NULL, it's generated from
+   username_format with username_idx when needed. The username and password
+   aren't copied, so they must stay valid while the user exists. */
+struct user *user_new_profile(const struct profile_user *profile,
+			      unsigned int username_idx, const char *username,
+			      const char *password,
+			      struct mailbox_source *source);
+/* Create the user's pool and clients, if they don't exist yet. */
+void user_init_lazy(struct user *user);
+const char *user_get_username(struct user *user);
+/* Returns the number of bytes used by the profile users' shared memory
+   (not including the state of users that have logged in). */
+size_t users_get_profile_memory_used(void);
 bool user_get_random(struct mailbox_source *source, struct user **user_r);
 void user_add_client(struct user *user, struct client *client);
 void user_remove_client(struct user *user, struct client *client);
 
 bool user_get_new_client_profile(struct user *user,
 				 struct user_client **user_client_r);
-time_t user_get_next_login_time(struct user *user);
+long long user_get_next_login_time(struct user *user);
 const char *user_get_new_mailbox(struct client *client);
 
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void);
+const ARRAY_TYPE(user) *users_get_all(void);
+
+/* Returns the current time in milliseconds. */
+long long user_time_now(void);
+/* Convert a profile interval in seconds to milliseconds, scaled down by
+   time_scale. Non-zero intervals are always at least 1 ms. */
+long long user_time_interval(unsigned int secs);
 
 struct imap_client *
 user_find_client_by_mailbox(struct user_client *uc, const char *mailbox);
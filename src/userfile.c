@@ -0,0 +1,265 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "write-full.h"
+#include "userfile.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define USERFILE_BINARY_MAGIC "imaptest-users\n"
+#define USERFILE_BINARY_VERSION 1
+/* offset for a missing password */
+#define USERFILE_NO_PASSWORD ((uint32_t)-1)
+
+struct userfile_binary_header {
+	char magic[16];
+	uint32_t version;
+	uint32_t count;
+	uint32_t strings_size;
+	uint32_t unused;
+	/* followed by count * (username offset, password offset) pairs and
+	   then strings_size bytes of NUL-terminated strings */
+};
+
+struct userfile {
+	char *path;
+
+	void *mmap_base;
+	size_t mmap_size;
+	/* used instead of mmap if the last line doesn't end with LF */
+	char *buf;
+
+	const char *strings;
+	size_t strings_size;
+
+	/* count * (username offset, password offset) pairs */
+	const uint32_t *offsets;
+	ARRAY(uint32_t) offsets_arr;
+	unsigned int count;
+};
+
+static void userfile_parse_text(struct userfile *uf, char *data, size_t size)
+{
+	char *line, *lf, *end = data + size, *p;
+	uint32_t ofs[2];
+
+	/* there's no need to grow the array too many times */
+	i_array_init(&uf->offsets_arr, I_MAX(size / 16, 16));
+	for (line = data; line < end; line = lf + 1) {
+		/* data[size] is always writable */
+		lf = memchr(line, '\n', end - line);
+		if (lf == NULL)
+			lf = end;
+		*lf = '\0';
+		if (lf > line && lf[-1] == '\r')
+			lf[-1] = '\0';
+
+		if (*line == '\0' || *line == ':')
+			continue;
+		ofs[0] = line - data;
+		p = strchr(line, ':');
+		if (p == NULL)
+			ofs[1] = USERFILE_NO_PASSWORD;
+		else {
+			*p = '\0';
+			ofs[1] = p + 1 - data;
+		}
+		array_append(&uf->offsets_arr, ofs, 2);
+	}
+	uf->strings = data;
+	uf->strings_size = size;
+	uf->offsets = array_get(&uf->offsets_arr, &uf->count);
+	uf->count /= 2;
+}
+
+static void userfile_parse_binary(struct userfile *uf)
+{
+	const struct userfile_binary_header *hdr = uf->mmap_base;
+	const unsigned char *data = uf->mmap_base;
+	unsigned int i;
+
+	if (hdr->version != USERFILE_BINARY_VERSION) {
+		i_fatal("userfile %s: Unsupported binary version %u",
+			uf->path, hdr->version);
+	}
+	if (sizeof(*hdr) + (uint64_t)hdr->count * 2 * sizeof(uint32_t) +
+	    hdr->strings_size != uf->mmap_size ||
+	    hdr->strings_size == 0 || data[uf->mmap_size-1] != '\0')
+		i_fatal("userfile %s: Broken binary file", uf->path);
+
+	uf->offsets = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	uf->count = hdr->count;
+	uf->strings = CONST_PTR_OFFSET(uf->offsets,
+				       hdr->count * 2 * sizeof(uint32_t));
+	uf->strings_size = hdr->strings_size;
+
+	/* the strings end with NUL, so any offset within them is safe to
+	   use. check them now instead of failing at the first lookup. */
+	for (i = 0; i < uf->count * 2; i++) {
+		if (uf->offsets[i] >= uf->strings_size &&
+		    (i % 2 == 0 || uf->offsets[i] != USERFILE_NO_PASSWORD)) {
+			i_fatal("userfile %s: Broken binary file: "
+				"user %u has invalid offset %u", uf->path,
+				i / 2, uf->offsets[i]);
+		}
+	}
+}
+
+struct userfile *userfile_open(const char *path)
+{
+	struct userfile *uf;
+	struct stat st;
+	bool binary;
+	int fd;
+
+	uf = i_new(struct userfile, 1);
+	uf->path = i_strdup(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (st.st_size == 0)
+		i_fatal("No usernames in file %s", path);
+	if ((uint64_t)st.st_size >= (uint32_t)-1)
+		i_fatal("userfile %s is too large", path);
+
+	/* the text file is modified in place, but MAP_PRIVATE keeps the
+	   changes away from the file */
+	uf->mmap_size = st.st_size;
+	uf->mmap_base = mmap(NULL, uf->mmap_size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE, fd, 0);
+	if (uf->mmap_base == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	binary = uf->mmap_size >= sizeof(struct userfile_binary_header) &&
+		memcmp(uf->mmap_base, USERFILE_BINARY_MAGIC,
+		       sizeof(USERFILE_BINARY_MAGIC)) == 0;
+	if (binary)
+		userfile_parse_binary(uf);
+	else if (((const char *)uf->mmap_base)[uf->mmap_size-1] == '\n') {
+		(void)madvise(uf->mmap_base, uf->mmap_size, MADV_SEQUENTIAL);
+		userfile_parse_text(uf, uf->mmap_base, uf->mmap_size - 1);
+	} else {
+		/* the last line isn't LF-terminated, so there's no space
+		   for the NUL in the mapping */
+		uf->buf = i_malloc(uf->mmap_size + 1);
+		memcpy(uf->buf, uf->mmap_base, uf->mmap_size);
+		userfile_parse_text(uf, uf->buf, uf->mmap_size);
+		if (munmap(uf->mmap_base, uf->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", path);
+		uf->mmap_base = NULL;
+	}
+	if (uf->count == 0)
+		i_fatal("No usernames in file %s", path);
+	return uf;
+}
+
+void userfile_close(struct userfile **_uf)
+{
+	struct userfile *uf = *_uf;
+
+	*_uf = NULL;
+	if (uf->mmap_base != NULL) {
+		if (munmap(uf->mmap_base, uf->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", uf->path);
+	}
+	if (array_is_created(&uf->offsets_arr))
+		array_free(&uf->offsets_arr);
+	i_free(uf->buf);
+	i_free(uf->path);
+	i_free(uf);
+}
+
+unsigned int userfile_get_count(const struct userfile *uf)
+{
+	return uf->count;
+}
+
+void userfile_get(const struct userfile *uf, unsigned int idx,
+		  const char **username_r, const char **password_r)
+{
+	uint32_t user_ofs, pass_ofs;
+
+	i_assert(idx < uf->count);
+
+	user_ofs = uf->offsets[idx*2];
+	pass_ofs = uf->offsets[idx*2 + 1];
+	i_assert(user_ofs < uf->strings_size);
+	*username_r = uf->strings + user_ofs;
+	if (pass_ofs == USERFILE_NO_PASSWORD)
+		*password_r = NULL;
+	else {
+		i_assert(pass_ofs < uf->strings_size);
+		*password_r = uf->strings + pass_ofs;
+	}
+}
+
+int userfile_write_binary(const struct userfile *uf, const char *path,
+			  const char **error_r)
+{
+	struct userfile_binary_header hdr;
+	ARRAY(uint32_t) offsets;
+	string_t *strings;
+	const char *username, *password, *temp_path;
+	uint32_t ofs[2];
+	unsigned int i;
+	int fd, ret = 0;
+
+	i_array_init(&offsets, uf->count * 2);
+	strings = str_new(default_pool, uf->strings_size + 1);
+	for (i = 0; i < uf->count; i++) {
+		userfile_get(uf, i, &username, &password);
+		ofs[0] = str_len(strings);
+		str_append_data(strings, username, strlen(username) + 1);
+		if (password == NULL)
+			ofs[1] = USERFILE_NO_PASSWORD;
+		else {
+			ofs[1] = str_len(strings);
+			str_append_data(strings, password,
+					strlen(password) + 1);
+		}
+		array_append(&offsets, ofs, 2);
+	}
+
+	i_zero(&hdr);
+	memcpy(hdr.magic, USERFILE_BINARY_MAGIC, sizeof(USERFILE_BINARY_MAGIC));
+	hdr.version = USERFILE_BINARY_VERSION;
+	hdr.count = uf->count;
+	hdr.strings_size = str_len(strings);
+
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+		   write_full(fd, array_idx(&offsets, 0),
+			      array_count(&offsets) * sizeof(uint32_t)) < 0 ||
+		   write_full(fd, str_data(strings), str_len(strings)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if (fd != -1 && close(fd) < 0 && ret == 0) {
+		*error_r = t_strdup_printf("close(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if (ret == 0 && rename(temp_path, path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, path);
+		ret = -1;
+	}
+	if (ret < 0 && fd != -1)
+		i_unlink_if_exists(temp_path);
+
+	array_free(&offsets);
+	str_free(&strings);
+	return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef USERFILE_H
+#define USERFILE_H
+
+/* Userfiles contain either "username" or "username:password" lines.
+   The file is mmap()ed and the lines are split in place, so the usernames
+   and passwords point directly to the mapped file. A precompiled binary
+   userfile (see userfile_write_binary()) doesn't need any parsing. */
+struct userfile;
+
+/* Open the userfile. Fails with i_fatal() if it can't be read or if it
+   contains no users. */
+struct userfile *userfile_open(const char *path);
+void userfile_close(struct userfile **uf);
+
+unsigned int userfile_get_count(const struct userfile *uf);
+/* Get the idx'th user. password_r is set to NULL if the line had no
+   password. The strings are valid until the userfile is closed. */
+void userfile_get(const struct userfile *uf, unsigned int idx,
+		  const char **username_r, const char **password_r);
+
+/* Write the userfile in the binary format. The file is in host byte order,
+   so it can't be used on machines with a different endianness. */
+int userfile_write_binary(const struct userfile *uf, const char *path,
+			  const char **error_r);
+
+#endif
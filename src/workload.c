@@ -0,0 +1,274 @@
+/* Copyright (c) 2013-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "profile-dist.h"
+#include "settings.h"
+#include "workload.h"
+
+struct workload {
+	pool_t pool;
+	ARRAY_TYPE(workload_template) templates[WORKLOAD_COMMAND_COUNT];
+};
+
+struct workload_parser {
+	struct workload *workload;
+	const char *path;
+	unsigned int linenum;
+
+	bool in_section;
+	struct workload_template cur;
+};
+
+static const char *const workload_command_names[WORKLOAD_COMMAND_COUNT] = {
+	"fetch", "store", "search"
+};
+static const char *const workload_command_args[WORKLOAD_COMMAND_COUNT] = {
+	"items", "flags", "query"
+};
+
+static void ATTR_FORMAT(2, 3) ATTR_NORETURN
+workload_parse_fatal(struct workload_parser *parser, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	i_fatal("Invalid workload %s at line %u: %s", parser->path,
+		parser->linenum, t_strdup_vprintf(fmt, args));
+	va_end(args);
+}
+
+static void
+workload_parse_messages(struct workload_parser *parser, const char *value)
+{
+	struct workload_template *tmpl = &parser->cur;
+	struct profile_dist *dist;
+	const char *p, *error;
+	int ret;
+
+	ret = profile_dist_parse(parser->workload->pool, value, &dist, &error);
+	if (ret < 0)
+		workload_parse_fatal(parser, "messages: %s", error);
+	if (ret > 0) {
+		tmpl->msgs_dist = dist;
+		return;
+	}
+
+	p = strchr(value, '-');
+	if (p == NULL) {
+		if (str_to_uint(value, &tmpl->msgs_min) < 0)
+			workload_parse_fatal(parser, "Invalid messages: %s", value);
+		tmpl->msgs_max = tmpl->msgs_min;
+	} else if (str_to_uint(t_strdup_until(value, p), &tmpl->msgs_min) < 0 ||
+		   str_to_uint(p + 1, &tmpl->msgs_max) < 0) {
+		workload_parse_fatal(parser, "Invalid messages range: %s", value);
+	}
+	if (tmpl->msgs_min == 0 || tmpl->msgs_min > tmpl->msgs_max)
+		workload_parse_fatal(parser, "Invalid messages: %s", value);
+}
+
+static void
+workload_parse_keyvalue(struct workload_parser *parser,
+			const char *key, const char *value)
+{
+	struct workload_template *tmpl = &parser->cur;
+
+	if (strcmp(key, "weight") == 0) {
+		if (str_to_uint(value, &tmpl->weight) < 0)
+			workload_parse_fatal(parser, "Invalid weight: %s", value);
+	} else if (strcmp(key, "messages") == 0 &&
+		   tmpl->command != WORKLOAD_COMMAND_SEARCH) {
+		workload_parse_messages(parser, value);
+	} else if (strcmp(key, workload_command_args[tmpl->command]) == 0) {
+		tmpl->args = p_strdup(parser->workload->pool, value);
+	} else {
+		workload_parse_fatal(parser, "Unknown %s setting: %s",
+				     workload_command_names[tmpl->command], key);
+	}
+}
+
+static void workload_parse_section_end(struct workload_parser *parser)
+{
+	struct workload_template *tmpl = &parser->cur;
+	ARRAY_TYPE(workload_template) *templates;
+	const struct workload_template *last;
+
+	if (tmpl->args == NULL) {
+		workload_parse_fatal(parser, "%s %s is missing %s",
+				     workload_command_names[tmpl->command],
+				     tmpl->name,
+				     workload_command_args[tmpl->command]);
+	}
+	if (tmpl->command == WORKLOAD_COMMAND_STORE &&
+	    strncasecmp(tmpl->args, "+FLAGS", 6) != 0 &&
+	    strncasecmp(tmpl->args, "-FLAGS", 6) != 0) {
+		/* the flag tracking requires knowing what is changed */
+		workload_parse_fatal(parser,
+			"store flags must begin with +FLAGS or -FLAGS");
+	}
+	if (tmpl->command == WORKLOAD_COMMAND_STORE)
+		tmpl->store_silent = strncasecmp(tmpl->args + 6, ".SILENT", 7) == 0;
+
+	templates = &parser->workload->templates[tmpl->command];
+	last = array_count(templates) == 0 ? NULL : array_back(templates);
+	tmpl->cumulative_weight = tmpl->weight +
+		(last == NULL ? 0 : last->cumulative_weight);
+	array_append(templates, tmpl, 1);
+	parser->in_section = FALSE;
+}
+
+static void
+workload_parse_section_begin(struct workload_parser *parser, const char *line)
+{
+	const char *const *args = t_strsplit_spaces(line, " ");
+	struct workload_template *tmpl = &parser->cur;
+	unsigned int i;
+
+	if (str_array_length(args) != 3 || strcmp(args[2], "{") != 0)
+		workload_parse_fatal(parser, "Expected <command> <name> {");
+	for (i = 0; i < WORKLOAD_COMMAND_COUNT; i++) {
+		if (strcasecmp(args[0], workload_command_names[i]) == 0)
+			break;
+	}
+	if (i == WORKLOAD_COMMAND_COUNT)
+		workload_parse_fatal(parser, "Unknown command: %s", args[0]);
+
+	i_zero(tmpl);
+	tmpl->command = i;
+	tmpl->name = p_strdup(parser->workload->pool, args[1]);
+	tmpl->weight = 1;
+	tmpl->msgs_min = tmpl->msgs_max = 1;
+	parser->in_section = TRUE;
+}
+
+static void workload_parse_line(struct workload_parser *parser, char *line)
+{
+	const char *key, *value;
+	size_t len;
+	char *p;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	len = strlen(line);
+	while (len > 0 && (line[len-1] == ' ' || line[len-1] == '\t'))
+		line[--len] = '\0';
+	if (*line == '\0' || *line == '#')
+		return;
+
+	if (!parser->in_section) {
+		workload_parse_section_begin(parser, line);
+		return;
+	}
+	if (strcmp(line, "}") == 0) {
+		workload_parse_section_end(parser);
+		return;
+	}
+
+	p = strchr(line, '=');
+	if (p == NULL)
+		workload_parse_fatal(parser, "Expected key = value");
+	key = t_strcut(t_strdup_until(line, p), ' ');
+	for (p++; *p == ' ' || *p == '\t'; p++) ;
+	value = p;
+	workload_parse_keyvalue(parser, key, value);
+}
+
+void workload_check_settings(const struct workload *workload)
+{
+	const struct workload_template *tmpl;
+
+	if (array_count(&workload->templates[WORKLOAD_COMMAND_STORE]) == 0)
+		return;
+	/* the templates' flags are sent as they are */
+	if (conf.own_flags)
+		i_fatal("workload store templates can't be used with own_flags");
+	array_foreach(&workload->templates[WORKLOAD_COMMAND_STORE], tmpl) {
+		if (tmpl->store_silent && conf.checkpoint_interval > 0) {
+			/* checkpointing needs to see the flag changes */
+			i_fatal("workload store %s: FLAGS.SILENT can't be used "
+				"with checkpoint", tmpl->name);
+		}
+	}
+}
+
+struct workload *workload_parse(const char *path)
+{
+	struct workload_parser parser;
+	struct workload *workload;
+	struct istream *input;
+	pool_t pool;
+	char *line;
+	unsigned int i;
+
+	pool = pool_alloconly_create("workload", 1024*4);
+	workload = p_new(pool, struct workload, 1);
+	workload->pool = pool;
+	for (i = 0; i < WORKLOAD_COMMAND_COUNT; i++)
+		p_array_init(&workload->templates[i], pool, 4);
+
+	i_zero(&parser);
+	parser.workload = workload;
+	parser.path = path;
+
+	input = i_stream_create_file(path, (size_t)-1);
+	while ((line = i_stream_read_next_line(input)) != NULL) T_BEGIN {
+		parser.linenum++;
+		workload_parse_line(&parser, line);
+	} T_END;
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_destroy(&input);
+
+	if (parser.in_section)
+		workload_parse_fatal(&parser, "Missing }");
+	return workload;
+}
+
+void workload_deinit(struct workload **_workload)
+{
+	struct workload *workload = *_workload;
+
+	*_workload = NULL;
+	pool_unref(&workload->pool);
+}
+
+const struct workload_template *
+workload_pick(const struct workload *workload, enum workload_command command)
+{
+	const struct workload_template *templates;
+	unsigned int count, weight, idx, left_idx, right_idx;
+
+	templates = array_get(&workload->templates[command], &count);
+	if (count == 0 || templates[count-1].cumulative_weight == 0)
+		return NULL;
+
+	/* find the first template whose cumulative weight is above weight */
+	weight = i_rand_limit(templates[count-1].cumulative_weight);
+	left_idx = 0; right_idx = count - 1;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (templates[idx].cumulative_weight <= weight)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return &templates[left_idx];
+}
+
+unsigned int
+workload_template_get_msg_count(const struct workload_template *tmpl,
+				unsigned int msgs_count)
+{
+	double value;
+	unsigned int count;
+
+	if (tmpl->msgs_dist != NULL) {
+		value = profile_dist_sample(tmpl->msgs_dist) + 0.5;
+		count = value < msgs_count ? (unsigned int)value : msgs_count;
+	} else {
+		count = tmpl->msgs_min +
+			i_rand_limit(tmpl->msgs_max - tmpl->msgs_min + 1);
+	}
+	return I_MAX(I_MIN(count, msgs_count), 1);
+}
@@ -0,0 +1,65 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+/* Workload files define weighted command templates that replace the
+   hardcoded FETCH/STORE/SEARCH commands of the random state engine:
+
+   fetch headers {
+     weight = 60
+     messages = 1-50
+     items = FLAGS BODY.PEEK[HEADER.FIELDS (From Subject)]
+   }
+   store seen {
+     weight = 10
+     messages = exponential 3
+     flags = +FLAGS.SILENT (\Seen)
+   }
+   search unseen {
+     weight = 1
+     query = UNSEEN
+   }
+
+   messages is the message set size: <n>, <min>-<max> or a distribution
+   spec (see profile-dist.h). */
+
+enum workload_command {
+	WORKLOAD_COMMAND_FETCH,
+	WORKLOAD_COMMAND_STORE,
+	WORKLOAD_COMMAND_SEARCH,
+
+	WORKLOAD_COMMAND_COUNT
+};
+
+struct workload_template {
+	const char *name;
+	enum workload_command command;
+	unsigned int weight;
+	/* sum of the weights of the command's templates up to and including
+	   this one */
+	unsigned int cumulative_weight;
+
+	unsigned int msgs_min, msgs_max;
+	const struct profile_dist *msgs_dist;
+	/* FETCH items, STORE flags or SEARCH query */
+	const char *args;
+	/* STORE uses FLAGS.SILENT */
+	bool store_silent;
+};
+ARRAY_DEFINE_TYPE(workload_template, struct workload_template);
+
+struct workload *workload_parse(const char *path);
+void workload_deinit(struct workload **workload);
+/* Fail if the workload can't be used with the other settings. */
+void workload_check_settings(const struct workload *workload);
+
+/* Returns a random template for the command based on the weights, or NULL
+   if the workload has none. */
+const struct workload_template *
+workload_pick(const struct workload *workload, enum workload_command command);
+/* Returns the number of messages the command should use, between 1 and
+   msgs_count. */
+unsigned int
+workload_template_get_msg_count(const struct workload_template *tmpl,
+				unsigned int msgs_count);
+
+#endif
@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+
+# You can use this script to compare ImapTest runs against different server
+# builds, and to fail a release pipeline when the performance regresses.
+# The inputs are files written by ImapTest's summary_output setting. Give
+# each side one or more files from repeated runs:
+#
+# Usage: imaptest_compare.py [options] --baseline <summary> [...]
+#                                      --candidate <summary> [...]
+#
+# For each state the cmds/sec throughput and the chosen latency metric are
+# averaged over the runs, and the candidate's change is printed in percent.
+# With at least two runs on both sides, a 95% confidence interval of the
+# change is printed as well (Welch's t-test), and only statistically
+# significant changes are counted as regressions.
+#
+# The exit code is 1 if any state regressed more than the thresholds allow,
+# or if a state found in all the baseline runs is missing from a candidate
+# run (i.e. none of its commands succeeded), 0 otherwise.
+
+import argparse
+import math
+import sys
+
+# two-sided 95% t-distribution critical values for 1..30 degrees of freedom
+t_table = [
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+]
+
+latency_metrics = ('avg', 'p50', 'p90', 'p99', 'p99.9', 'max')
+
+
+def t_critical(df):
+    if df < 1:
+        df = 1
+    if df > len(t_table):
+        return 1.960
+    return t_table[int(df) - 1]
+
+
+def read_summary(path):
+    # returns {state: {column: value}}
+    with open(path) as f:
+        lines = f.read().splitlines()
+    if len(lines) == 0:
+        raise ValueError('%s: Empty file' % path)
+    header = lines[0].split('\t')
+    if header[0] != 'state' or 'cmds/sec' not in header:
+        raise ValueError('%s: Not an ImapTest summary_output file' % path)
+    result = {}
+    for line in lines[1:]:
+        if line == '':
+            continue
+        fields = line.split('\t')
+        if len(fields) != len(header):
+            raise ValueError('%s: Broken line: %s' % (path, line))
+        result[fields[0]] = dict((name, float(value)) for name, value
+                                 in zip(header[1:], fields[1:]))
+    return result
+
+
+def mean_stdev(values):
+    mean = sum(values) / len(values)
+    if len(values) < 2:
+        return mean, None
+    var = sum((v - mean) ** 2 for v in values) / (len(values) - 1)
+    return mean, math.sqrt(var)
+
+
+def compare(base_values, cand_values):
+    # returns (base mean, candidate mean, delta %, CI low %, CI high %)
+    # with the CI None if it can't be calculated
+    base_mean, base_sd = mean_stdev(base_values)
+    cand_mean, cand_sd = mean_stdev(cand_values)
+    if base_mean == 0:
+        return base_mean, cand_mean, None, None, None
+    delta = (cand_mean - base_mean) * 100.0 / base_mean
+    if base_sd is None or cand_sd is None:
+        return base_mean, cand_mean, delta, None, None
+
+    base_var = base_sd ** 2 / len(base_values)
+    cand_var = cand_sd ** 2 / len(cand_values)
+    se = math.sqrt(base_var + cand_var)
+    if se == 0:
+        return base_mean, cand_mean, delta, delta, delta
+    # Welch-Satterthwaite degrees of freedom
+    df = (base_var + cand_var) ** 2 / \
+        (base_var ** 2 / (len(base_values) - 1) +
+         cand_var ** 2 / (len(cand_values) - 1))
+    margin = t_critical(df) * se * 100.0 / base_mean
+    return base_mean, cand_mean, delta, delta - margin, delta + margin
+
+
+def format_percent(value):
+    if value is None:
+        return 'n/a'
+    return '%+.1f%%' % value
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compare ImapTest summary_output files')
+    parser.add_argument('--baseline', nargs='+', required=True,
+                        metavar='SUMMARY')
+    parser.add_argument('--candidate', nargs='+', required=True,
+                        metavar='SUMMARY')
+    parser.add_argument('--metric', default='p99', choices=latency_metrics,
+                        help='latency metric to compare (default: p99)')
+    parser.add_argument('--max-latency-increase', type=float, default=10.0,
+                        metavar='PERCENT',
+                        help='allowed latency increase (default: 10)')
+    parser.add_argument('--max-throughput-decrease', type=float, default=5.0,
+                        metavar='PERCENT',
+                        help='allowed cmds/sec decrease (default: 5)')
+    parser.add_argument('--states', metavar='STATE[,...]',
+                        help='compare only these states')
+    args = parser.parse_args()
+
+    try:
+        baselines = [read_summary(path) for path in args.baseline]
+        candidates = [read_summary(path) for path in args.candidate]
+    except (IOError, ValueError) as e:
+        sys.stderr.write('%s\n' % e)
+        sys.exit(2)
+
+    if args.states is not None:
+        states = args.states.upper().split(',')
+    else:
+        states = sorted(set(s for run in baselines for s in run) |
+                        set(s for run in candidates for s in run))
+
+    latency_column = '%s msecs' % args.metric
+    regressions = 0
+    print('%-12s %-12s %10s %10s %8s %20s' %
+          ('state', 'metric', 'baseline', 'candidate', 'delta', '95% CI'))
+    for state in states:
+        if all(state in run for run in baselines) and \
+           not all(state in run for run in candidates):
+            # no successful commands at all in some candidate run
+            print('%-12s missing from candidate runs  REGRESSION' % state)
+            regressions += 1
+            continue
+        if not all(state in run for run in baselines + candidates):
+            print('%-12s missing from some of the runs' % state)
+            continue
+        for column, max_change, sign in (
+                ('cmds/sec', args.max_throughput_decrease, -1),
+                (latency_column, args.max_latency_increase, 1)):
+            base_mean, cand_mean, delta, low, high = compare(
+                [run[state][column] for run in baselines],
+                [run[state][column] for run in candidates])
+            if low is None:
+                ci = 'n/a'
+                significant = True
+            else:
+                ci = '[%s, %s]' % (format_percent(low), format_percent(high))
+                significant = low > 0 or high < 0
+            result = ''
+            if delta is not None and significant and \
+               delta * sign > max_change:
+                result = 'REGRESSION'
+                regressions += 1
+            line = '%-12s %-12s %10.1f %10.1f %8s %20s  %s' % \
+                (state, column, base_mean, cand_mean,
+                 format_percent(delta), ci, result)
+            print(line.rstrip())
+
+    if regressions > 0:
+        print('%d regressions' % regressions)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
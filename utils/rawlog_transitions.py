@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+
+# You can use this script to learn an ImapTest transitions file from a corpus
+# of IMAP server rawlogs, such as the *.in files written by Dovecot's
+# rawlog_dir setting. Each file must contain the client input of a single
+# session. Optional "<secs>.<usecs> " timestamp prefixes are ignored.
+#
+# Usage: rawlog_transitions.py <rawlog.in> [...] > transitions
+#
+# The output has "<from state> <to state> <weight>" lines, where the weight
+# is the number of times the transition was seen. Commands that ImapTest
+# can't simulate (e.g. CAPABILITY, ID, IDLE) are skipped.
+
+import re
+import sys
+from collections import defaultdict
+
+timestamp_re = re.compile(br'^[0-9]+\.[0-9]+ ')
+literal_re = re.compile(br'\{([0-9]+)\+?\}$')
+
+
+def fetch_state(args):
+    # FETCH2 is ImapTest's body fetching, FETCH fetches metadata
+    args = args.upper()
+    if b'BODY[' in args or b'BODY.PEEK[' in args or b'BINARY' in args:
+        return 'FETCH2'
+    if re.search(br'RFC822(?![.]SIZE)', args):
+        return 'FETCH2'
+    return 'FETCH'
+
+
+def store_state(args):
+    if b'\\DELETED' in args.upper():
+        return 'DELETE'
+    return 'STORE'
+
+
+simple_states = {
+    b'LOGIN': 'LOGIN',
+    b'AUTHENTICATE': 'AUTHENTICATE',
+    b'LIST': 'LIST',
+    b'LSUB': 'LIST',
+    b'CREATE': 'MCREATE',
+    b'DELETE': 'MDELETE',
+    b'SUBSCRIBE': 'MSUBS',
+    b'STATUS': 'STATUS',
+    b'SELECT': 'SELECT',
+    b'EXAMINE': 'SELECT',
+    b'SEARCH': 'SEARCH',
+    b'SORT': 'SORT',
+    b'THREAD': 'THREAD',
+    b'COPY': 'COPY',
+    b'EXPUNGE': 'EXPUNGE',
+    b'APPEND': 'APPEND',
+    b'NOOP': 'NOOP',
+    b'CHECK': 'CHECK',
+    b'LOGOUT': 'LOGOUT',
+}
+
+
+def command_state(line):
+    args = line.split(b' ', 2)
+    if len(args) < 2:
+        return None
+    name = args[1].upper()
+    rest = args[2] if len(args) > 2 else b''
+    if name == b'UID':
+        args = rest.split(b' ', 1)
+        name = args[0].upper()
+        rest = args[1] if len(args) > 1 else b''
+    if name == b'FETCH':
+        return fetch_state(rest)
+    if name == b'STORE':
+        return store_state(rest)
+    return simple_states.get(name)
+
+
+def read_commands(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    pos = 0
+    while pos < len(data):
+        end = data.find(b'\n', pos)
+        if end < 0:
+            end = len(data)
+        line = timestamp_re.sub(b'', data[pos:end].rstrip(b'\r'))
+        pos = end + 1
+        state = command_state(line)
+        # skip over the literals and the lines continuing the command
+        while True:
+            m = literal_re.search(line)
+            if m is None:
+                break
+            pos += int(m.group(1))
+            end = data.find(b'\n', pos)
+            if end < 0:
+                end = len(data)
+            line = data[pos:end].rstrip(b'\r')
+            pos = end + 1
+        if state is not None:
+            yield state
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write('Usage: %s <rawlog.in> [...]\n' % sys.argv[0])
+        sys.exit(1)
+
+    counts = defaultdict(int)
+    for path in sys.argv[1:]:
+        prev = None
+        for state in read_commands(path):
+            if prev is not None and prev != 'LOGOUT':
+                counts[(prev, state)] += 1
+            prev = state
+
+    for (from_state, to_state), count in sorted(counts.items()):
+        if from_state in ('LOGIN', 'AUTHENTICATE') and \
+           to_state in ('LOGIN', 'AUTHENTICATE'):
+            # failed logins
+            continue
+        print('%s %s %d' % (from_state, to_state, count))
+
+
+if __name__ == '__main__':
+    main()